@@ -249,3 +249,191 @@ AC_DEFUN([AC_HAVE_GET_QUOTA_ROOT],	[
 		AC_MSG_RESULT([no])
 	])
 ])
+
+dnl #
+dnl # AC_HAVE_SPLIT_SHRINKER_CALLBACK checks if shrinker has separate
+dnl # count_objects and scan_objects callbacks
+dnl #
+AC_DEFUN([AC_HAVE_SPLIT_SHRINKER_CALLBACK],	[
+	AC_MSG_CHECKING([whether shrinker has count_objects and scan_objects])
+	ZFS_LINUX_TRY_COMPILE([
+		#include <linux/mm.h>
+
+		unsigned long count(struct shrinker *s,
+				    struct shrink_control *sc)
+		{
+			return 0;
+		}
+
+		unsigned long scan(struct shrinker *s,
+				   struct shrink_control *sc)
+		{
+			return SHRINK_STOP;
+		}
+	],[
+		struct shrinker shrinker = {
+			.count_objects = count,
+			.scan_objects = scan,
+			.seeks = DEFAULT_SEEKS,
+		};
+
+		(void) shrinker;
+	],[
+		AC_MSG_RESULT([yes])
+		AC_DEFINE(HAVE_SPLIT_SHRINKER_CALLBACK, 1,
+			  [Define if shrinker has count_objects and scan_objects])
+	],[
+		AC_MSG_RESULT([no])
+	])
+])
+
+dnl #
+dnl # AC_HAVE_SHRINK_CONTROL_STRUCT checks if shrinker callback accepts
+dnl # struct shrink_control
+dnl #
+AC_DEFUN([AC_HAVE_SHRINK_CONTROL_STRUCT],	[
+	AC_MSG_CHECKING([whether shrinker callback accepts shrink_control])
+	ZFS_LINUX_TRY_COMPILE([
+		#include <linux/mm.h>
+
+		int shrink(struct shrinker *s, struct shrink_control *sc)
+		{
+			return 0;
+		}
+	],[
+		struct shrinker shrinker = {
+			.shrink = shrink,
+			.seeks = DEFAULT_SEEKS,
+		};
+
+		(void) shrinker;
+	],[
+		AC_MSG_RESULT([yes])
+		AC_DEFINE(HAVE_SHRINK_CONTROL_STRUCT, 1,
+			  [Define if shrinker callback accepts shrink_control])
+	],[
+		AC_MSG_RESULT([no])
+	])
+])
+
+dnl #
+dnl # AC_HAVE_REGISTER_SHRINKER_RET checks if register_shrinker can fail
+dnl #
+AC_DEFUN([AC_HAVE_REGISTER_SHRINKER_RET],	[
+	AC_MSG_CHECKING([whether register_shrinker returns int])
+	ZFS_LINUX_TRY_COMPILE([
+		#include <linux/mm.h>
+	],[
+		struct shrinker shrinker = { .seeks = DEFAULT_SEEKS };
+		int err;
+
+		err = register_shrinker(&shrinker);
+		(void) err;
+	],[
+		AC_MSG_RESULT([yes])
+		AC_DEFINE(HAVE_REGISTER_SHRINKER_RET, 1,
+			  [Define if register_shrinker returns int])
+	],[
+		AC_MSG_RESULT([no])
+	])
+])
+
+dnl #
+dnl # AC_HAVE_GENL_MCGRPS checks if generic netlink families carry their
+dnl # multicast groups
+dnl #
+AC_DEFUN([AC_HAVE_GENL_MCGRPS],	[
+	AC_MSG_CHECKING([whether genl_family has mcgrps])
+	ZFS_LINUX_TRY_COMPILE([
+		#include <net/genetlink.h>
+
+		static const struct genl_multicast_group grps[] = {
+			{ .name = "test", },
+		};
+	],[
+		struct genl_family family = {
+			.mcgrps = grps,
+			.n_mcgrps = ARRAY_SIZE(grps),
+		};
+
+		(void) family;
+	],[
+		AC_MSG_RESULT([yes])
+		AC_DEFINE(HAVE_GENL_MCGRPS, 1,
+			  [Define if genl_family has mcgrps])
+	],[
+		AC_MSG_RESULT([no])
+	])
+])
+
+dnl #
+dnl # AC_HAVE_GENL_MCGRP_FLAGS checks if multicast groups carry the
+dnl # permissions their listeners need
+dnl #
+AC_DEFUN([AC_HAVE_GENL_MCGRP_FLAGS],	[
+	AC_MSG_CHECKING([whether genl_multicast_group has flags])
+	ZFS_LINUX_TRY_COMPILE([
+		#include <net/genetlink.h>
+	],[
+		struct genl_multicast_group grp = {
+			.name = "test",
+			.flags = GENL_ADMIN_PERM,
+		};
+
+		(void) grp;
+	],[
+		AC_MSG_RESULT([yes])
+		AC_DEFINE(HAVE_GENL_MCGRP_FLAGS, 1,
+			  [Define if genl_multicast_group has flags])
+	],[
+		AC_MSG_RESULT([no])
+	])
+])
+
+dnl #
+dnl # AC_HAVE_GENL_MCAST_BIND checks if a family is asked before a socket
+dnl # joins its multicast groups
+dnl #
+AC_DEFUN([AC_HAVE_GENL_MCAST_BIND],	[
+	AC_MSG_CHECKING([whether genl_family has mcast_bind])
+	ZFS_LINUX_TRY_COMPILE([
+		#include <net/genetlink.h>
+
+		static int test_bind(struct net *net, int group)
+		{
+			return 0;
+		}
+	],[
+		struct genl_family family = {
+			.mcast_bind = test_bind,
+		};
+
+		(void) family;
+	],[
+		AC_MSG_RESULT([yes])
+		AC_DEFINE(HAVE_GENL_MCAST_BIND, 1,
+			  [Define if genl_family has mcast_bind])
+	],[
+		AC_MSG_RESULT([no])
+	])
+])
+
+dnl #
+dnl # AC_HAVE_GENL_HAS_LISTENERS checks if genl_has_listeners takes a net
+dnl #
+AC_DEFUN([AC_HAVE_GENL_HAS_LISTENERS],	[
+	AC_MSG_CHECKING([whether genl_has_listeners takes a net])
+	ZFS_LINUX_TRY_COMPILE([
+		#include <net/genetlink.h>
+	],[
+		struct genl_family family = { };
+
+		(void) genl_has_listeners(&family, &init_net, 0);
+	],[
+		AC_MSG_RESULT([yes])
+		AC_DEFINE(HAVE_GENL_HAS_LISTENERS, 1,
+			  [Define if genl_has_listeners takes a net])
+	],[
+		AC_MSG_RESULT([no])
+	])
+])
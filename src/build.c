@@ -0,0 +1,177 @@
+#include <linux/module.h>
+#include <linux/list.h>
+#include <linux/sched.h>
+#include <linux/spinlock.h>
+#include <linux/wait.h>
+#include <linux/jiffies.h>
+#ifdef CONFIG_VE
+#include <linux/ve_proto.h>
+#endif /* #ifdef CONFIG_VE */
+
+#include "build.h"
+
+/**
+ * Every tree build is a full scan of the userused/quota ZAPs. When a
+ * crowd of containers opens the quota files at once the builds are queued
+ * here and at most max_builds of them run at a time.
+ */
+
+/* Concurrent tree builds, 0 is unlimited */
+static unsigned int max_builds = 4;
+module_param(max_builds, uint, 0644);
+
+/* Prefer the objsets with fewer builds running over the arrival order */
+static bool build_fair = 1;
+module_param(build_fair, bool, 0644);
+
+/* Builds requested from the host go before the containers' ones */
+static bool build_host_first = 1;
+module_param(build_host_first, bool, 0644);
+
+static DEFINE_SPINLOCK(zqbuild_lock);
+static LIST_HEAD(zqbuild_running);
+static LIST_HEAD(zqbuild_host_queue);
+static LIST_HEAD(zqbuild_queue);
+static struct zqbuild_stats zqbuild_stats;
+
+int zqbuild_from_host(void)
+{
+#ifdef CONFIG_VE
+	return ve_is_super(get_exec_env());
+#else /* #ifdef CONFIG_VE */
+	return 1;
+#endif /* #else #ifdef CONFIG_VE */
+}
+
+/* The rest is called with zqbuild_lock held */
+static unsigned int zqbuild_owner_running(const void *owner)
+{
+	struct zqbuild_ticket *ticket;
+	unsigned int n = 0;
+
+	list_for_each_entry(ticket, &zqbuild_running, list) {
+		if (ticket->owner == owner)
+			n++;
+	}
+	return n;
+}
+
+static struct zqbuild_ticket *zqbuild_pick(struct list_head *queue)
+{
+	struct zqbuild_ticket *ticket, *best = NULL;
+	unsigned int n, best_n = UINT_MAX;
+
+	if (list_empty(queue))
+		return NULL;
+	if (!build_fair)
+		return list_first_entry(queue, struct zqbuild_ticket, list);
+
+	/* Oldest of the tickets whose owner has the fewest builds running */
+	list_for_each_entry(ticket, queue, list) {
+		n = zqbuild_owner_running(ticket->owner);
+		if (n < best_n) {
+			best = ticket;
+			best_n = n;
+			if (!n)
+				break;
+		}
+	}
+	return best;
+}
+
+/* Admit as many tickets as there are free slots and wake them up */
+static void zqbuild_dispatch(void)
+{
+	struct zqbuild_ticket *ticket;
+
+	while (!max_builds || zqbuild_stats.running < max_builds) {
+		ticket = zqbuild_pick(&zqbuild_host_queue);
+		if (!ticket)
+			ticket = zqbuild_pick(&zqbuild_queue);
+		if (!ticket)
+			break;
+
+		list_del(&ticket->list);
+		list_add_tail(&ticket->list, &zqbuild_running);
+		ticket->admitted = 1;
+		zqbuild_stats.running++;
+		zqbuild_stats.queued--;
+		zqbuild_stats.admitted++;
+		wake_up(&ticket->wqh);
+	}
+}
+
+static int zqbuild_admitted(struct zqbuild_ticket *ticket)
+{
+	int admitted;
+
+	spin_lock(&zqbuild_lock);
+	admitted = ticket->admitted;
+	spin_unlock(&zqbuild_lock);
+
+	return admitted;
+}
+
+int zqbuild_admit(struct zqbuild_ticket *ticket, const void *owner,
+		  int from_host)
+{
+	struct list_head *queue = &zqbuild_queue;
+	unsigned long wait_ms;
+	int err;
+
+	ticket->owner = owner;
+	ticket->queued = jiffies;
+	ticket->admitted = 0;
+	init_waitqueue_head(&ticket->wqh);
+	if (build_host_first && from_host)
+		queue = &zqbuild_host_queue;
+
+	spin_lock(&zqbuild_lock);
+	list_add_tail(&ticket->list, queue);
+	zqbuild_stats.queued++;
+	/* Slots could have been added by raising max_builds */
+	zqbuild_dispatch();
+	if (!ticket->admitted) {
+		zqbuild_stats.waited++;
+		zqbuild_stats.max_queued = max(zqbuild_stats.max_queued,
+					       zqbuild_stats.queued);
+	}
+	spin_unlock(&zqbuild_lock);
+
+	err = wait_event_killable(ticket->wqh, zqbuild_admitted(ticket));
+	if (err) {
+		spin_lock(&zqbuild_lock);
+		/* Admitted meanwhile, the slot is ours anyway */
+		if (!ticket->admitted) {
+			list_del(&ticket->list);
+			zqbuild_stats.queued--;
+			spin_unlock(&zqbuild_lock);
+			return -EINTR;
+		}
+		spin_unlock(&zqbuild_lock);
+	}
+
+	wait_ms = jiffies_to_msecs(jiffies - ticket->queued);
+	spin_lock(&zqbuild_lock);
+	zqbuild_stats.wait_ms += wait_ms;
+	zqbuild_stats.max_wait_ms = max(zqbuild_stats.max_wait_ms, wait_ms);
+	spin_unlock(&zqbuild_lock);
+
+	return 0;
+}
+
+void zqbuild_done(struct zqbuild_ticket *ticket)
+{
+	spin_lock(&zqbuild_lock);
+	list_del(&ticket->list);
+	zqbuild_stats.running--;
+	zqbuild_dispatch();
+	spin_unlock(&zqbuild_lock);
+}
+
+void zqbuild_get_stats(struct zqbuild_stats *stats)
+{
+	spin_lock(&zqbuild_lock);
+	*stats = zqbuild_stats;
+	spin_unlock(&zqbuild_lock);
+}
@@ -0,0 +1,40 @@
+#ifndef BUILD_H_INCLUDED
+#define BUILD_H_INCLUDED
+
+/*
+ * Host-wide admission of quota tree builds
+ */
+
+struct zqbuild_ticket {
+	struct list_head	list;
+	const void		*owner;
+	unsigned long		queued;
+	int			admitted;
+	/* Woken up alone once admitted */
+	wait_queue_head_t	wqh;
+};
+
+struct zqbuild_stats {
+	unsigned int		running;
+	unsigned int		queued;
+	unsigned int		max_queued;
+	unsigned long		admitted;
+	unsigned long		waited;
+	unsigned long		wait_ms;
+	unsigned long		max_wait_ms;
+};
+
+/* Called by the requester, workers run on the host */
+int zqbuild_from_host(void);
+
+/*
+ * Sleeps until the build may run, owner is what fairness is counted by.
+ * A fatal signal takes the ticket out of the queue, -EINTR then.
+ */
+int zqbuild_admit(struct zqbuild_ticket *ticket, const void *owner,
+		  int from_host);
+void zqbuild_done(struct zqbuild_ticket *ticket);
+
+void zqbuild_get_stats(struct zqbuild_stats *stats);
+
+#endif /* BUILD_H_INCLUDED */
@@ -0,0 +1,360 @@
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/slab.h>
+#include <linux/mutex.h>
+#include <linux/kdev_t.h>
+#include <linux/quota.h>
+#include <linux/math64.h>
+#include <linux/capability.h>
+#include <net/genetlink.h>
+
+#include "tree.h"
+#include "zfs.h"
+#include "events.h"
+
+/* Percents of a limit, crossing one upwards between two trees is an event */
+static unsigned int thresholds[ZQEVENTS_MAX_THRESHOLDS] = { 80, 95, 100 };
+static int nr_thresholds = 3;
+module_param_array(thresholds, uint, &nr_thresholds, 0644);
+
+struct zqevents_level {
+	uint32_t		qid;
+	uint8_t			level[ZQEVENTS_NR_RESOURCES];
+};
+
+void zqevents_levels_init(struct zqevents_levels *levels)
+{
+	mutex_init(&levels->lock);
+	levels->levels = NULL;
+	levels->nr = 0;
+	levels->seeded = 0;
+}
+
+void zqevents_levels_free(struct zqevents_levels *levels)
+{
+	kfree(levels->levels);
+	levels->levels = NULL;
+	levels->nr = 0;
+}
+
+static unsigned int zqevents_percent(uint64_t used, uint64_t limit)
+{
+	/* Scaled down alike, off by a bit only past an exabyte */
+	while (used > ULLONG_MAX / 100) {
+		used >>= 1;
+		limit >>= 1;
+	}
+	if (!limit)
+		return UINT_MAX;
+
+	return min_t(uint64_t, div64_u64(used * 100, limit), UINT_MAX);
+}
+
+/* Number of the thresholds reached, the largest of them in threshold */
+static unsigned int zqevents_level(uint64_t used, uint64_t limit,
+				   uint32_t *threshold)
+{
+	unsigned int percent, level = 0;
+	int i, n = min_t(int, nr_thresholds, ZQEVENTS_MAX_THRESHOLDS);
+
+	*threshold = 0;
+	if (!limit)
+		return 0;
+
+	percent = zqevents_percent(used, limit);
+	for (i = 0; i < n; i++) {
+		if (!thresholds[i] || percent < thresholds[i])
+			continue;
+		level++;
+		*threshold = max(*threshold, thresholds[i]);
+	}
+
+	return level;
+}
+
+static int zqevents_grow(void **array, unsigned int *size, size_t elem)
+{
+	unsigned int new_size = *size ? *size * 2 : 16;
+	void *p;
+
+	p = krealloc(*array, new_size * elem, GFP_KERNEL);
+	if (!p)
+		return -ENOMEM;
+
+	*array = p;
+	*size = new_size;
+	return 0;
+}
+
+/* Both the tree and the old levels go in qid order, so it is a merge */
+struct zqevents_diff {
+	const struct zqevents_level	*old;
+	unsigned int			old_nr, pos;
+
+	struct zqevents_level		*levels;
+	unsigned int			nr, size;
+
+	struct zqevents_crossing	*crossings;
+	unsigned int			nr_crossings, crossings_size;
+
+	unsigned int			caps;
+	int				seeded;
+};
+
+static int zqevents_diff_entry(const struct zqdata *qd, void *arg)
+{
+	struct zqevents_diff *d = arg;
+	uint64_t used[ZQEVENTS_NR_RESOURCES], limit[ZQEVENTS_NR_RESOURCES];
+	uint32_t threshold[ZQEVENTS_NR_RESOURCES];
+	uint8_t level[ZQEVENTS_NR_RESOURCES];
+	uint8_t old[ZQEVENTS_NR_RESOURCES] = { 0 };
+	struct zqevents_crossing *c;
+	int r, err;
+
+	used[ZQEVENTS_SPACE] = qd->space_used;
+	limit[ZQEVENTS_SPACE] = qd->space_quota;
+	used[ZQEVENTS_OBJ] = limit[ZQEVENTS_OBJ] = 0;
+#ifdef HAVE_ZFS_OBJECT_QUOTA
+	if (d->caps & ZFS_CAP_OBJQUOTA) {
+		used[ZQEVENTS_OBJ] = qd->obj_used;
+		limit[ZQEVENTS_OBJ] = qd->obj_quota;
+	}
+#endif /* HAVE_ZFS_OBJECT_QUOTA */
+
+	for (r = 0; r < ZQEVENTS_NR_RESOURCES; r++)
+		level[r] = zqevents_level(used[r], limit[r], &threshold[r]);
+
+	while (d->pos < d->old_nr && d->old[d->pos].qid < qd->qid)
+		d->pos++;
+	if (d->pos < d->old_nr && d->old[d->pos].qid == qd->qid)
+		memcpy(old, d->old[d->pos].level, sizeof(old));
+
+	/* Only the qids past a threshold are remembered */
+	if (!level[ZQEVENTS_SPACE] && !level[ZQEVENTS_OBJ])
+		return 0;
+
+	if (d->nr == d->size) {
+		err = zqevents_grow((void **)&d->levels, &d->size,
+				    sizeof(*d->levels));
+		if (err)
+			return err;
+	}
+	d->levels[d->nr].qid = qd->qid;
+	memcpy(d->levels[d->nr].level, level, sizeof(level));
+	d->nr++;
+
+	if (!d->seeded)
+		return 0;
+
+	for (r = 0; r < ZQEVENTS_NR_RESOURCES; r++) {
+		if (level[r] <= old[r])
+			continue;
+
+		if (d->nr_crossings == d->crossings_size) {
+			err = zqevents_grow((void **)&d->crossings,
+					    &d->crossings_size,
+					    sizeof(*d->crossings));
+			if (err)
+				return err;
+		}
+		c = &d->crossings[d->nr_crossings++];
+		c->qid = qd->qid;
+		c->resource = r;
+		c->used = used[r];
+		c->limit = limit[r];
+		c->threshold = threshold[r];
+	}
+
+	return 0;
+}
+
+int zqevents_diff(struct zqevents_levels *levels, struct zqtree *qt,
+		  struct zqevents_crossing **crossings)
+{
+	struct zqevents_diff d;
+	int err;
+
+	memset(&d, 0, sizeof(d));
+	d.caps = zqtree_caps(qt);
+
+	mutex_lock(&levels->lock);
+	d.old = levels->levels;
+	d.old_nr = levels->nr;
+	d.seeded = levels->seeded;
+
+	err = zqtree_for_each(qt, UINT_MAX, zqevents_diff_entry, &d);
+	if (err) {
+		kfree(d.levels);
+		kfree(d.crossings);
+		goto out;
+	}
+
+	kfree(levels->levels);
+	levels->levels = d.levels;
+	levels->nr = d.nr;
+	levels->seeded = 1;
+
+	*crossings = d.crossings;
+	err = d.nr_crossings;
+out:
+	mutex_unlock(&levels->lock);
+	return err;
+}
+
+#ifdef HAVE_GENL_MCGRPS
+
+/*
+ * The events tell the usage and limits of every container, so only the
+ * host admin joins the group. Kernels that can't tell get no family.
+ */
+#if defined(HAVE_GENL_MCGRP_FLAGS) || defined(HAVE_GENL_MCAST_BIND)
+#define ZQEVENTS_ADMIN_ONLY
+#endif /* HAVE_GENL_MCGRP_FLAGS || HAVE_GENL_MCAST_BIND */
+
+static const struct genl_multicast_group zqevents_mcgrps[] = {
+	{
+		.name = ZQEVENTS_GENL_MCGRP,
+#ifdef HAVE_GENL_MCGRP_FLAGS
+		.flags = GENL_ADMIN_PERM,
+#endif /* HAVE_GENL_MCGRP_FLAGS */
+	},
+};
+
+#if !defined(HAVE_GENL_MCGRP_FLAGS) && defined(HAVE_GENL_MCAST_BIND)
+static int zqevents_mcast_bind(struct net *net, int group)
+{
+	return capable(CAP_NET_ADMIN) ? 0 : -EPERM;
+}
+#endif /* !HAVE_GENL_MCGRP_FLAGS && HAVE_GENL_MCAST_BIND */
+
+static struct genl_family zqevents_family = {
+	.name = ZQEVENTS_GENL_NAME,
+	.version = ZQEVENTS_GENL_VERSION,
+	.maxattr = ZQEVENTS_A_MAX,
+	.module = THIS_MODULE,
+	.mcgrps = zqevents_mcgrps,
+	.n_mcgrps = ARRAY_SIZE(zqevents_mcgrps),
+#if !defined(HAVE_GENL_MCGRP_FLAGS) && defined(HAVE_GENL_MCAST_BIND)
+	.mcast_bind = zqevents_mcast_bind,
+#endif /* !HAVE_GENL_MCGRP_FLAGS && HAVE_GENL_MCAST_BIND */
+};
+
+static int zqevents_registered;
+
+/* Not worth a diff of the tree with nobody to send the crossings to */
+static int zqevents_listened(void)
+{
+#ifdef HAVE_GENL_HAS_LISTENERS
+	return genl_has_listeners(&zqevents_family, &init_net, 0);
+#else /* HAVE_GENL_HAS_LISTENERS */
+	return 1;
+#endif /* HAVE_GENL_HAS_LISTENERS */
+}
+
+int zqevents_active(void)
+{
+	return zqevents_registered && nr_thresholds > 0 &&
+	       zqevents_listened();
+}
+
+/*
+ * nla_put_u64 is gone from the newer kernels and nla_put_u64_64bit is not
+ * in the older ones
+ */
+static int zqevents_put_u64(struct sk_buff *skb, int attr, uint64_t value)
+{
+	return nla_put(skb, attr, sizeof(value), &value);
+}
+
+#define ZQEVENTS_MSG_SIZE	(5 * nla_total_size(sizeof(uint32_t)) + \
+				 2 * nla_total_size(sizeof(uint64_t)))
+
+int zqevents_send(dev_t dev, int type,
+		  const struct zqevents_crossing *crossing)
+{
+	struct sk_buff *skb;
+	void *hdr;
+	int err;
+
+	skb = genlmsg_new(ZQEVENTS_MSG_SIZE, GFP_KERNEL);
+	if (!skb)
+		return -ENOMEM;
+
+	hdr = genlmsg_put(skb, 0, 0, &zqevents_family, 0,
+			  ZQEVENTS_CMD_THRESHOLD);
+	if (!hdr)
+		goto nla_failure;
+
+	if (nla_put_u32(skb, ZQEVENTS_A_DEV, new_encode_dev(dev)) ||
+	    nla_put_u32(skb, ZQEVENTS_A_TYPE, type) ||
+	    nla_put_u32(skb, ZQEVENTS_A_QID, crossing->qid) ||
+	    nla_put_u32(skb, ZQEVENTS_A_RESOURCE, crossing->resource) ||
+	    zqevents_put_u64(skb, ZQEVENTS_A_USED, crossing->used) ||
+	    zqevents_put_u64(skb, ZQEVENTS_A_LIMIT, crossing->limit) ||
+	    nla_put_u32(skb, ZQEVENTS_A_THRESHOLD, crossing->threshold))
+		goto nla_failure;
+
+	genlmsg_end(skb, hdr);
+
+	err = genlmsg_multicast(&zqevents_family, skb, 0, 0, GFP_KERNEL);
+	/* Nobody listening */
+	if (err == -ESRCH)
+		err = 0;
+	return err;
+
+nla_failure:
+	nlmsg_free(skb);
+	return -EMSGSIZE;
+}
+
+int __init zqevents_init(void)
+{
+	int err;
+
+#ifndef ZQEVENTS_ADMIN_ONLY
+	printk(KERN_WARNING "zfs-quota: no threshold events, "
+	       "the multicast group can't be restricted\n");
+	return 0;
+#endif /* ZQEVENTS_ADMIN_ONLY */
+
+	err = genl_register_family(&zqevents_family);
+	if (err) {
+		/* The quota works without them */
+		printk(KERN_WARNING "zfs-quota: no threshold events, "
+		       "genl_register_family: %d\n", err);
+		return 0;
+	}
+
+	zqevents_registered = 1;
+	return 0;
+}
+
+void zqevents_exit(void)
+{
+	if (zqevents_registered)
+		genl_unregister_family(&zqevents_family);
+}
+
+#else /* HAVE_GENL_MCGRPS */
+
+int zqevents_active(void)
+{
+	return 0;
+}
+
+int zqevents_send(dev_t dev, int type,
+		  const struct zqevents_crossing *crossing)
+{
+	return -EOPNOTSUPP;
+}
+
+int __init zqevents_init(void)
+{
+	return 0;
+}
+
+void zqevents_exit(void)
+{
+}
+
+#endif /* HAVE_GENL_MCGRPS */
@@ -0,0 +1,83 @@
+#ifndef EVENTS_H_INCLUDED
+#define EVENTS_H_INCLUDED
+
+/*
+ * Generic netlink family multicasting quota threshold crossings. Every
+ * event is a ZQEVENTS_CMD_THRESHOLD message in the ZQEVENTS_GENL_MCGRP
+ * group carrying all the attributes below.
+ */
+
+#define ZQEVENTS_GENL_NAME	"ZFSQUOTA"
+#define ZQEVENTS_GENL_VERSION	1
+#define ZQEVENTS_GENL_MCGRP	"events"
+
+enum {
+	ZQEVENTS_CMD_UNSPEC,
+	ZQEVENTS_CMD_THRESHOLD,
+	__ZQEVENTS_CMD_MAX,
+};
+#define ZQEVENTS_CMD_MAX	(__ZQEVENTS_CMD_MAX - 1)
+
+enum {
+	ZQEVENTS_A_UNSPEC,
+	ZQEVENTS_A_DEV,		/* u32, new_encode_dev of the mount */
+	ZQEVENTS_A_TYPE,	/* u32, USRQUOTA or GRPQUOTA */
+	ZQEVENTS_A_QID,		/* u32 */
+	ZQEVENTS_A_RESOURCE,	/* u32, ZQEVENTS_SPACE or ZQEVENTS_OBJ */
+	ZQEVENTS_A_USED,	/* u64, bytes or inodes */
+	ZQEVENTS_A_LIMIT,	/* u64 */
+	ZQEVENTS_A_THRESHOLD,	/* u32, percent of the limit */
+	__ZQEVENTS_A_MAX,
+};
+#define ZQEVENTS_A_MAX		(__ZQEVENTS_A_MAX - 1)
+
+#define ZQEVENTS_SPACE		0
+#define ZQEVENTS_OBJ		1
+#define ZQEVENTS_NR_RESOURCES	2
+
+#ifdef __KERNEL__
+
+struct zqtree;
+
+#define ZQEVENTS_MAX_THRESHOLDS	8
+
+struct zqevents_level;
+
+/* Levels reached by the qids of the last tree of a slot */
+struct zqevents_levels {
+	struct mutex		lock;
+	struct zqevents_level	*levels;
+	unsigned int		nr;
+	/* The first tree only sets the levels */
+	int			seeded;
+};
+
+struct zqevents_crossing {
+	uint32_t		qid;
+	uint32_t		resource;
+	uint64_t		used;
+	uint64_t		limit;
+	uint32_t		threshold;
+};
+
+void zqevents_levels_init(struct zqevents_levels *levels);
+void zqevents_levels_free(struct zqevents_levels *levels);
+
+/*
+ * No thresholds set, no family to send them to or nobody listening. The
+ * levels stay as of the last diff then, so the first one after a listener
+ * joins reports the crossings since.
+ */
+int zqevents_active(void);
+/*
+ * Compare a built tree with the levels of the previous one and remember
+ * its levels. Upward crossings are returned in a kmalloced array.
+ */
+int zqevents_diff(struct zqevents_levels *levels, struct zqtree *qt,
+		  struct zqevents_crossing **crossings);
+int zqevents_send(dev_t dev, int type,
+		  const struct zqevents_crossing *crossing);
+
+#endif /* __KERNEL__ */
+
+#endif /* EVENTS_H_INCLUDED */
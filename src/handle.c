@@ -1,10 +1,17 @@
 
+#include <linux/module.h>
 #include <linux/fs.h>
 #include <linux/radix-tree.h>
 #include <linux/quota.h>
 #include <linux/slab.h>
 #include <linux/sched.h>
 #include <linux/mount.h>
+#include <linux/list.h>
+#include <linux/jiffies.h>
+#include <linux/mm.h>
+#include <linux/rcupdate.h>
+#include <linux/delay.h>
+#include <linux/poll.h>
 
 #include "quota.h"
 #include "handle.h"
@@ -12,6 +19,8 @@
 #include "proc.h"
 #include "tree.h"
 #include "zfs.h"
+#include "events.h"
+#include "history.h"
 
 /**
  * Z(FS)Q(UOTA) part. All the handles are stored into radix-tree zqhandle_tree
@@ -21,15 +30,120 @@
 
 static DEFINE_MUTEX(zqhandle_tree_mutex);
 static RADIX_TREE(zqhandle_tree, GFP_KERNEL);
+/* Same handles keyed by sb->s_dev, looked up under RCU */
+static RADIX_TREE(zqhandle_dev_tree, GFP_KERNEL);
 
-struct zqhandle {
-	struct super_block	*sb;
+/* Seconds a built quota tree is kept cached after the last reader is gone */
+static unsigned int snapshot_ttl = 5;
+module_param(snapshot_ttl, uint, 0644);
+
+/* KiB of usage history kept by every mount registered from then on */
+static unsigned int history_kb;
+module_param(history_kb, uint, 0644);
+
+/**
+ * Superblocks backed by the same dataset share a zqobjset, which owns the
+ * backend and the cached quota trees. It lives in zqobjset_tree keyed by
+ * the backend private data (zfsvfs_t for the real ZFS), also under
+ * zqhandle_tree_mutex.
+ */
+static RADIX_TREE(zqobjset_tree, GFP_KERNEL);
+
+/**
+ * Cached quota tree of an objset. The objset holds a reference to the tree
+ * for as long as it is in the slot. Slots with a tree are linked into
+ * zqhandle_lru, least recently accessed first, so the shrinker can drop
+ * the trees nobody has open.
+ *
+ * Lock order is objset->lock -> zqhandle_lru_lock, the shrinker goes the
+ * other way round with a trylock.
+ */
+struct zqobjset_slot {
+	struct zqtree		*tree;
+	unsigned long		cached;
+	struct list_head	lru;
+	struct zqobjset		*objset;
+	/* Of the last published tree, for the threshold events */
+	struct zqevents_levels	levels;
+	struct zqtree_delta	delta;
+};
+
+static LIST_HEAD(zqhandle_lru);
+static DEFINE_SPINLOCK(zqhandle_lru_lock);
+static atomic_t zqhandle_lru_count = ATOMIC_INIT(0);
+
+struct zqobjset {
+	void			*key;
 	atomic_t		refcnt;
-	void			*zfsh;
+	/* Registered handles, under zqhandle_tree_mutex */
+	unsigned int		nr_handles;
+	/* The same handles for zqobjset_watch, also under handles_lock */
+	struct list_head	handles;
+	struct mutex		handles_lock;
+	zfs_backend_t		zfsh;
 
 	spinlock_t		lock;
+	/* Trees are built up to the largest qid_limit of the handles */
 	unsigned int		qid_limit;
-	struct zqtree		*quota[MAXQUOTAS];
+	int			dead;
+	struct zqobjset_slot	quota[MAXQUOTAS];
+
+	/* ZFS_CAP_*, valid once caps_probed is set */
+	unsigned int		caps;
+	unsigned long		caps_probed;
+
+	/* zqobjset_notify, events under lock */
+	unsigned long		events[MAXQUOTAS];
+	wait_queue_head_t	waitq;
+	struct fasync_struct	*fasync;
+
+	/* Builds and prefetches of its trees left to the workers */
+	atomic_t		builds;
+	wait_queue_head_t	builds_wqh;
+};
+
+/**
+ * Per-handle token buckets, so that a container calling quotactl or
+ * reopening the quota files in a loop can't hog the host. Rates are per
+ * second, 0 is unlimited, a bucket holds rate_burst seconds worth of them.
+ */
+enum {
+	ZQRATE_GET,
+	ZQRATE_SET,
+	ZQRATE_REBUILD,
+	ZQRATE_NR,
+};
+
+static unsigned int get_rate = 1000;
+module_param(get_rate, uint, 0644);
+static unsigned int set_rate = 100;
+module_param(set_rate, uint, 0644);
+static unsigned int rebuild_rate = 1;
+module_param(rebuild_rate, uint, 0644);
+static unsigned int rate_burst = 4;
+module_param(rate_burst, uint, 0644);
+
+/* Credit is in 1/HZ of an operation */
+struct zqrate {
+	unsigned long		credit;
+	unsigned long		stamp;
+};
+
+struct zqhandle {
+	struct super_block	*sb;
+	dev_t			dev;
+	atomic_t		refcnt;
+	struct zqobjset		*objset;
+	/* On objset->handles while registered */
+	struct list_head	objset_list;
+	unsigned int		qid_limit;
+	int			prefetch;
+	struct rcu_head		rcu;
+	/* Samples of the published trees, NULL without history_kb */
+	struct zqhistory	*history;
+
+	spinlock_t		rate_lock;
+	struct zqrate		rate[ZQRATE_NR];
 };
 
 static inline void *get_zfsh(struct super_block *sb)
@@ -41,44 +155,490 @@ static inline void *get_zfsh(struct super_block *sb)
 #endif /* #else #ifdef HAVE_GET_QUOTA_ROOT */
 }
 
+static inline unsigned int zqrate_limit(int op)
+{
+	switch (op) {
+	case ZQRATE_GET:
+		return get_rate;
+	case ZQRATE_SET:
+		return set_rate;
+	default:
+		return rebuild_rate;
+	}
+}
+
+static void zqrate_init(struct zqhandle *handle)
+{
+	int i;
+
+	spin_lock_init(&handle->rate_lock);
+	/* Start with full buckets */
+	for (i = 0; i < ZQRATE_NR; i++)
+		handle->rate[i].stamp = jiffies - max(rate_burst, 1U) * HZ;
+}
+
+/* Takes a token, if there is none returns jiffies until there will be */
+static unsigned long zqrate_take(struct zqhandle *handle, int op)
+{
+	struct zqrate *rate = &handle->rate[op];
+	unsigned int limit = zqrate_limit(op);
+	unsigned long now = jiffies, burst, wait = 0;
+
+	if (!limit)
+		return 0;
+
+	burst = max(rate_burst, 1U) * HZ;
+	spin_lock(&handle->rate_lock);
+	rate->credit += min(now - rate->stamp, burst) * limit;
+	rate->credit = min(rate->credit, burst * limit);
+	rate->stamp = now;
+	if (rate->credit >= HZ)
+		rate->credit -= HZ;
+	else
+		wait = DIV_ROUND_UP(HZ - rate->credit, limit);
+	spin_unlock(&handle->rate_lock);
+
+	return wait;
+}
+
+static int zqrate_throttle(struct zqhandle *handle, int op)
+{
+	unsigned long wait;
+
+	while ((wait = zqrate_take(handle, op))) {
+		if (msleep_interruptible(jiffies_to_msecs(wait)))
+			return -ERESTARTSYS;
+	}
+	return 0;
+}
+
+/* Slot helpers, called with objset->lock held */
+static void zqslot_cache(struct zqobjset_slot *slot, struct zqtree *zqtree)
+{
+	slot->tree = zqtree_get(zqtree);
+	slot->cached = jiffies;
+
+	spin_lock(&zqhandle_lru_lock);
+	list_add_tail(&slot->lru, &zqhandle_lru);
+	atomic_inc(&zqhandle_lru_count);
+	spin_unlock(&zqhandle_lru_lock);
+}
+
+static void zqslot_touch(struct zqobjset_slot *slot)
+{
+	spin_lock(&zqhandle_lru_lock);
+	list_move_tail(&slot->lru, &zqhandle_lru);
+	spin_unlock(&zqhandle_lru_lock);
+}
+
+/* Returns the tree the caller has to put after dropping the lock */
+static struct zqtree *zqslot_detach(struct zqobjset_slot *slot)
+{
+	struct zqtree *zqtree = slot->tree;
+
+	if (!zqtree)
+		return NULL;
+
+	spin_lock(&zqhandle_lru_lock);
+	list_del_init(&slot->lru);
+	atomic_dec(&zqhandle_lru_count);
+	spin_unlock(&zqhandle_lru_lock);
+
+	slot->tree = NULL;
+	return zqtree;
+}
+
+/* snapshot_ttl runs from the build and from every close since */
+static inline int zqslot_expired(struct zqobjset_slot *slot)
+{
+	return time_after(jiffies, slot->cached + snapshot_ttl * HZ);
+}
+
+struct zqobjset *zqobjset_get(struct zqobjset *objset)
+{
+	if (likely(objset))
+		atomic_inc(&objset->refcnt);
+	return objset;
+}
+
+void zqobjset_put(struct zqobjset *objset)
+{
+	int i;
+
+	if (!objset || !atomic_dec_and_test(&objset->refcnt))
+		return;
+
+	/* Cached trees reference the objset, so they're gone by now */
+	for (i = 0; i < MAXQUOTAS; i++) {
+		WARN_ON(objset->quota[i].tree);
+		zqevents_levels_free(&objset->quota[i].levels);
+		zqtree_delta_free(&objset->quota[i].delta);
+	}
+	zfs_backend_release(&objset->zfsh);
+	kfree(objset);
+}
+
+void *zqobjset_get_zfsh(struct zqobjset *objset)
+{
+	return &objset->zfsh;
+}
+
+unsigned long zqobjset_notify(struct zqobjset *objset, int type)
+{
+	unsigned long events;
+
+	spin_lock(&objset->lock);
+	events = ++objset->events[type];
+	spin_unlock(&objset->lock);
+
+	wake_up_interruptible_poll(&objset->waitq, POLLIN | POLLPRI);
+	kill_fasync(&objset->fasync, SIGIO, POLL_PRI);
+
+	return events;
+}
+
+unsigned long zqobjset_events(struct zqobjset *objset, int type)
+{
+	unsigned long events;
+
+	spin_lock(&objset->lock);
+	events = objset->events[type];
+	spin_unlock(&objset->lock);
+
+	return events;
+}
+
+struct zqobjset_watch {
+	int				type;
+	struct zqtree			*qt;
+	struct zqevents_crossing	*crossings;
+	int				nr;
+};
+
+static void zqobjset_watch_handle(struct zqhandle *handle,
+				  struct zqobjset_watch *w)
+{
+	int i;
+
+	for (i = 0; i < w->nr; i++)
+		if (w->crossings[i].qid < handle->qid_limit)
+			zqevents_send(handle->dev, w->type, &w->crossings[i]);
+
+	if (handle->history)
+		zqhistory_add(handle->history, w->type, w->qt,
+			      handle->qid_limit);
+}
+
+/*
+ * Threshold crossings against the previous tree of the type go out for
+ * every mount of the objset that sees the qid, and the mounts keeping a
+ * history take their sample of the tree.
+ */
+void zqobjset_watch(struct zqobjset *objset, int type, struct zqtree *qt)
+{
+	struct zqobjset_watch w = {
+		.type = type,
+		.qt = qt,
+	};
+	struct zqhandle *handle;
+
+	if (zqevents_active()) {
+		w.nr = zqevents_diff(&objset->quota[type].levels, qt,
+				     &w.crossings);
+		if (w.nr < 0)
+			w.nr = 0;
+	}
+
+	/* Unregister waits, the handles stay while on the list */
+	mutex_lock(&objset->handles_lock);
+	list_for_each_entry(handle, &objset->handles, objset_list)
+		zqobjset_watch_handle(handle, &w);
+	mutex_unlock(&objset->handles_lock);
+	kfree(w.crossings);
+}
+
+void zqobjset_tree_closed(struct zqobjset *objset, int type,
+			  struct zqtree *qt)
+{
+	struct zqobjset_slot *slot = &objset->quota[type];
+
+	spin_lock(&objset->lock);
+	if (slot->tree == qt)
+		slot->cached = jiffies;
+	spin_unlock(&objset->lock);
+}
+
+struct zqhistory *zqhandle_history(struct zqhandle *handle)
+{
+	return handle->history;
+}
+
+struct zqtree_delta *zqobjset_delta(struct zqobjset *objset, int type)
+{
+	return &objset->quota[type].delta;
+}
+
+wait_queue_head_t *zqobjset_waitq(struct zqobjset *objset)
+{
+	return &objset->waitq;
+}
+
+int zqobjset_fasync(struct zqobjset *objset, int fd, struct file *file,
+		    int on)
+{
+	return fasync_helper(fd, file, on, &objset->fasync);
+}
+
+/*
+ * zfs upgrade can give a mounted dataset object accounting, so its lack
+ * is probed again once in a while. Once there it stays.
+ */
+#define ZQOBJSET_CAPS_RECHECK	(60 * HZ)
+
+unsigned int zqobjset_caps(struct zqobjset *objset)
+{
+	unsigned long probed;
+	unsigned int caps;
+
+	spin_lock(&objset->lock);
+	caps = objset->caps;
+	probed = objset->caps_probed;
+	spin_unlock(&objset->lock);
+
+	if (probed && ((caps & ZFS_CAP_OBJQUOTA) ||
+		       time_before(jiffies, probed + ZQOBJSET_CAPS_RECHECK)))
+		return caps;
+
+	caps = zfs_probe_caps(&objset->zfsh);
+
+	spin_lock(&objset->lock);
+	objset->caps = caps;
+	objset->caps_probed = jiffies ?: 1;
+	spin_unlock(&objset->lock);
+
+	return caps;
+}
+
+/* Drop the cached trees of all the types, dead objset caches nothing new */
+static void zqobjset_drop_trees(struct zqobjset *objset, int dead)
+{
+	struct zqtree *trees[MAXQUOTAS];
+	int i;
+
+	spin_lock(&objset->lock);
+	if (dead)
+		objset->dead = 1;
+	for (i = 0; i < MAXQUOTAS; i++)
+		trees[i] = zqslot_detach(&objset->quota[i]);
+	spin_unlock(&objset->lock);
+
+	for (i = 0; i < MAXQUOTAS; i++)
+		zqtree_put(trees[i]);
+}
+
+/*
+ * Find the objset of the backend or make a new one out of it and count
+ * the handle in. Backend is consumed. Called with zqhandle_tree_mutex held.
+ */
+static struct zqobjset *zqobjset_attach(zfs_backend_t *zfsh,
+					struct zqhandle *handle)
+{
+	unsigned int qid_limit = handle->qid_limit;
+	struct zqobjset *objset;
+	int err, i;
+
+	objset = radix_tree_lookup(&zqobjset_tree, (unsigned long)zfsh->priv);
+	if (objset) {
+		zfs_backend_release(zfsh);
+		zqobjset_get(objset);
+		goto attach;
+	}
+
+	objset = kzalloc(sizeof(struct zqobjset), GFP_KERNEL);
+	if (objset == NULL) {
+		zfs_backend_release(zfsh);
+		return ERR_PTR(-ENOMEM);
+	}
+
+	objset->key = zfsh->priv;
+	objset->zfsh = *zfsh;
+	atomic_set(&objset->refcnt, 1);
+	spin_lock_init(&objset->lock);
+	INIT_LIST_HEAD(&objset->handles);
+	mutex_init(&objset->handles_lock);
+	init_waitqueue_head(&objset->waitq);
+	init_waitqueue_head(&objset->builds_wqh);
+	for (i = 0; i < MAXQUOTAS; i++) {
+		INIT_LIST_HEAD(&objset->quota[i].lru);
+		objset->quota[i].objset = objset;
+		zqevents_levels_init(&objset->quota[i].levels);
+		zqtree_delta_init(&objset->quota[i].delta);
+	}
+
+	err = radix_tree_insert(&zqobjset_tree, (unsigned long)objset->key,
+				objset);
+	if (err) {
+		zqobjset_put(objset);
+		return ERR_PTR(err);
+	}
+
+attach:
+	objset->nr_handles++;
+	mutex_lock(&objset->handles_lock);
+	list_add_tail(&handle->objset_list, &objset->handles);
+	mutex_unlock(&objset->handles_lock);
+	if (qid_limit > objset->qid_limit) {
+		/* Cached trees miss the qids this handle can see */
+		spin_lock(&objset->lock);
+		objset->qid_limit = qid_limit;
+		spin_unlock(&objset->lock);
+		zqobjset_drop_trees(objset, 0);
+	}
+
+	return objset;
+}
+
+/*
+ * Called with zqhandle_tree_mutex held. Returns 1 once the last handle is
+ * gone, zqobjset_flush_builds is then due before the backend goes away.
+ */
+static int zqobjset_detach(struct zqhandle *handle)
+{
+	struct zqobjset *objset = handle->objset;
+
+	mutex_lock(&objset->handles_lock);
+	list_del(&handle->objset_list);
+	mutex_unlock(&objset->handles_lock);
+
+	if (--objset->nr_handles)
+		return 0;
+
+	radix_tree_delete(&zqobjset_tree, (unsigned long)objset->key);
+	/* Breaks the objset <-> tree reference loop */
+	zqobjset_drop_trees(objset, 1);
+	return 1;
+}
+
+int zqobjset_dead(struct zqobjset *objset)
+{
+	int dead;
+
+	spin_lock(&objset->lock);
+	dead = objset->dead;
+	spin_unlock(&objset->lock);
+
+	return dead;
+}
+
+void zqobjset_build_queued(struct zqobjset *objset)
+{
+	atomic_inc(&objset->builds);
+}
+
+void zqobjset_build_done(struct zqobjset *objset)
+{
+	if (atomic_dec_and_test(&objset->builds))
+		wake_up_all(&objset->builds_wqh);
+}
+
+/*
+ * Only the work of this objset, the other datasets build on. Builds of a
+ * dead objset stop at their next slice. Not under zqhandle_tree_mutex.
+ */
+static void zqobjset_flush_builds(struct zqobjset *objset)
+{
+	wait_event(objset->builds_wqh, !atomic_read(&objset->builds));
+}
+
+static void zqhandle_detach(struct zqhandle *handle)
+{
+	int dead;
+
+	mutex_lock(&zqhandle_tree_mutex);
+	dead = zqobjset_detach(handle);
+	mutex_unlock(&zqhandle_tree_mutex);
+
+	if (dead)
+		zqobjset_flush_builds(handle->objset);
+}
+
 int zqhandle_register_superblock(struct super_block *sb,
 				 struct zfsquota_options *zfsq_opts)
 {
 	struct zqhandle *data = NULL;
-	int err;
+	struct zqobjset *objset;
+	zfs_backend_t zfsh;
+	int err = 0, dead = 0;
 
 	mutex_lock(&zqhandle_tree_mutex);
 	data = radix_tree_delete(&zqhandle_tree, (unsigned long)sb);
+	if (data)
+		radix_tree_delete(&zqhandle_dev_tree, data->dev);
 	mutex_unlock(&zqhandle_tree_mutex);
 
 	if (data) {
 		WARN(1, "simfs sb = %p was registered already, freeing", sb);
-		/* FIXME free the trees first */
-		kfree(data);
+		zqhandle_detach(data);
+		zqhandle_put(data);
 	}
 
-	err = -ENOMEM;
 	data = kzalloc(sizeof(struct zqhandle), GFP_KERNEL);
 	if (data == NULL)
-		goto out;
+		return -ENOMEM;
 
 	data->sb = sb;
-	data->zfsh = get_zfsh(sb);
+	data->dev = sb->s_dev;
 	atomic_set(&data->refcnt, 1);
+	zqrate_init(data);
+	data->history = zqhistory_new(history_kb);
+	if (IS_ERR(data->history)) {
+		printk(KERN_WARNING "zfs-quota: no usage history: %ld\n",
+		       PTR_ERR(data->history));
+		data->history = NULL;
+	}
 	if (zfsq_opts) {
 		data->qid_limit = zfsq_opts->qid_limit;
+		data->prefetch = zfsq_opts->prefetch;
 	}
 
+	if (zfsq_opts && zfsq_opts->synth)
+		err = zfs_synth_backend_init(&zfsh, zfsq_opts->synth);
+	else
+		zfs_zpl_backend_init(&zfsh, get_zfsh(sb));
+	if (err)
+		goto out_free;
+
 	mutex_lock(&zqhandle_tree_mutex);
+	objset = zqobjset_attach(&zfsh, data);
+	if (IS_ERR(objset)) {
+		mutex_unlock(&zqhandle_tree_mutex);
+		err = PTR_ERR(objset);
+		goto out_free;
+	}
+	data->objset = objset;
+
 	err = radix_tree_insert(&zqhandle_tree, (unsigned long)sb, data);
+	if (!err) {
+		err = radix_tree_insert(&zqhandle_dev_tree, data->dev, data);
+		if (err)
+			radix_tree_delete(&zqhandle_tree, (unsigned long)sb);
+	}
+	if (err)
+		dead = zqobjset_detach(data);
 	mutex_unlock(&zqhandle_tree_mutex);
+	if (dead)
+		zqobjset_flush_builds(objset);
 	if (err)
-		goto out_free;
+		goto out_put;
 
 	zqproc_register_handle(sb);
 out:
 	return err;
+out_put:
+	zqhandle_put(data);
+	goto out;
 out_free:
+	zqhistory_put(data->history);
 	kfree(data);
 	goto out;
 }
@@ -90,25 +650,28 @@ struct zqhandle *zqhandle_get(struct zqhandle *handle)
 	return handle;
 }
 
+static void zqhandle_free_rcu(struct rcu_head *rcu)
+{
+	kfree(container_of(rcu, struct zqhandle, rcu));
+}
+
 void zqhandle_put(struct zqhandle *handle)
 {
 	if (!handle)
 		return;
 
 	if (atomic_dec_and_test(&handle->refcnt)) {
-		int i;
-		spin_lock(&handle->lock);
-		for (i = 0; i < MAXQUOTAS; i++)
-			handle->quota[i] = NULL;
-		spin_unlock(&handle->lock);
-		kfree(handle);
+		zqobjset_put(handle->objset);
+		zqhistory_put(handle->history);
+		/* zqhandle_get_by_dev may still be looking at it */
+		call_rcu(&handle->rcu, zqhandle_free_rcu);
 	}
 }
 
 int zqhandle_unregister_superblock(struct super_block *sb)
 {
 	struct zqhandle *handle;
-	int err = -ENOENT;
+	int err = -ENOENT, dead = 0;
 
 	mutex_lock(&zqhandle_tree_mutex);
 	handle = radix_tree_delete(&zqhandle_tree, (unsigned long)sb);
@@ -118,16 +681,60 @@ int zqhandle_unregister_superblock(struct super_block *sb)
 	if (handle == NULL)
 		goto out;
 
+	radix_tree_delete(&zqhandle_dev_tree, handle->dev);
 	err = 0;
-	zqhandle_put(handle);
+	dead = zqobjset_detach(handle);
 out:
 	mutex_unlock(&zqhandle_tree_mutex);
+	/* No build reads the dataset once the superblock goes */
+	if (dead)
+		zqobjset_flush_builds(handle->objset);
+	zqhandle_put(handle);
 	return 0;
 }
 
 void *zqhandle_get_zfsh(struct zqhandle *handle)
 {
-	return handle->zfsh;
+	return &handle->objset->zfsh;
+}
+
+unsigned int zqhandle_qid_limit(struct zqhandle *handle)
+{
+	return handle->qid_limit;
+}
+
+dev_t zqhandle_dev(struct zqhandle *handle)
+{
+	return handle->dev;
+}
+
+#define ZQHANDLE_BATCH		16
+
+int zqhandle_for_each(int (*fn)(struct zqhandle *handle, void *arg),
+		      void *arg)
+{
+	struct zqhandle *handles[ZQHANDLE_BATCH];
+	unsigned long index = 0;
+	int i, n, err = 0;
+
+	do {
+		mutex_lock(&zqhandle_tree_mutex);
+		n = radix_tree_gang_lookup(&zqhandle_tree, (void **)handles,
+					   index, ZQHANDLE_BATCH);
+		for (i = 0; i < n; i++)
+			zqhandle_get(handles[i]);
+		mutex_unlock(&zqhandle_tree_mutex);
+
+		/* fn may sleep, so it runs with references only */
+		for (i = 0; i < n; i++) {
+			index = (unsigned long)handles[i]->sb + 1;
+			if (!err)
+				err = fn(handles[i], arg);
+			zqhandle_put(handles[i]);
+		}
+	} while (n == ZQHANDLE_BATCH && !err);
+
+	return err;
 }
 
 struct zqhandle *zqhandle_get_by_sb(void *sb)
@@ -147,80 +754,409 @@ out:
 	return handle;
 }
 
-struct zqtree *zqhandle_get_tree(struct zqhandle *handle, int type)
+struct zqhandle *zqhandle_get_by_dev(dev_t dev)
 {
-	struct zqtree *quota_tree;
+	struct zqhandle *handle;
+
+	rcu_read_lock();
+	handle = radix_tree_lookup(&zqhandle_dev_tree, dev);
+	if (handle && !atomic_inc_not_zero(&handle->refcnt))
+		handle = NULL;
+	rcu_read_unlock();
+
+	return handle;
+}
+
+/*
+ * The tree is shared by all the handles of the objset, read it through
+ * zqhandle_qid_limit of the handle. With nowait a new tree out of the
+ * rebuild rate is -EAGAIN rather than a sleep.
+ */
+static struct zqtree *__zqhandle_get_tree(struct zqhandle *handle, int type,
+					  int nowait)
+{
+	struct zqobjset *objset = handle->objset;
+	struct zqobjset_slot *slot = &objset->quota[type];
+	struct zqtree *quota_tree, *stale;
+	unsigned int qid_limit;
+	int charged = 0, err = 0;
 
 again:
-	spin_lock(&handle->lock);
-	quota_tree = zqtree_get(handle->quota[type]);
-	spin_unlock(&handle->lock);
+	stale = NULL;
+	spin_lock(&objset->lock);
+	/* Out of rebuilds the expired tree is still better than waiting */
+	if (slot->tree && zqslot_expired(slot) &&
+	    (charged || !zqrate_take(handle, ZQRATE_REBUILD))) {
+		charged = 1;
+		stale = zqslot_detach(slot);
+	}
+	quota_tree = zqtree_get(slot->tree);
+	if (quota_tree)
+		zqslot_touch(slot);
+	qid_limit = objset->qid_limit;
+	spin_unlock(&objset->lock);
+
+	zqtree_put(stale);
 
 	if (!quota_tree) {
-		quota_tree = zqtree_new(handle, type, handle->qid_limit);
+		if (!charged) {
+			if (!nowait)
+				err = zqrate_throttle(handle, ZQRATE_REBUILD);
+			else if (zqrate_take(handle, ZQRATE_REBUILD))
+				err = -EAGAIN;
+			if (err)
+				return ERR_PTR(err);
+			charged = 1;
+		}
+
+		quota_tree = zqtree_new(objset, type, qid_limit);
 		if (IS_ERR(quota_tree))
 			goto out;
 
-		spin_lock(&handle->lock);
-		if (handle->quota[type]) {
-			spin_unlock(&handle->lock);
-			kfree(quota_tree);
+		spin_lock(&objset->lock);
+		if (slot->tree || qid_limit != objset->qid_limit) {
+			spin_unlock(&objset->lock);
+			zqtree_put(quota_tree);
 			goto again;
 		}
-		handle->quota[type] = quota_tree;
-		spin_unlock(&handle->lock);
+		if (!objset->dead)
+			zqslot_cache(slot, quota_tree);
+		spin_unlock(&objset->lock);
 	}
 out:
 	return quota_tree;
 }
 
-void zqhandle_unref_tree(struct zqhandle *handle, struct zqtree *zqtree)
+struct zqtree *zqhandle_get_tree(struct zqhandle *handle, int type)
+{
+	return __zqhandle_get_tree(handle, type, 0);
+}
+
+struct zqtree *zqhandle_get_tree_nowait(struct zqhandle *handle, int type)
 {
-	int i = 0;
+	return __zqhandle_get_tree(handle, type, 1);
+}
 
-	if (!handle)
+void zqhandle_prefetch_tree(struct zqhandle *handle, int type)
+{
+	struct zqtree *quota_tree;
+
+	if (!handle->prefetch)
 		return;
 
-	spin_lock(&handle->lock);
-	for (i = 0; i < MAXQUOTAS; i++) {
-		if (handle->quota[i] != zqtree)
-			continue;
-		handle->quota[i] = NULL;
-		break;
+	quota_tree = __zqhandle_get_tree(handle, type, 1);
+	if (IS_ERR(quota_tree))
+		return;
+
+	zqtree_prefetch(quota_tree);
+	zqtree_put(quota_tree);
+}
+
+/* The cached tree, or a built one within the rebuild rate with build */
+static struct zqtree *zqhandle_cached_tree(struct zqhandle *handle, int type,
+					   int build)
+{
+	struct zqobjset *objset = handle->objset;
+	struct zqtree *zqtree;
+	int err;
+
+	if (build) {
+		/* Out of the rebuild rate is the same as not built */
+		zqtree = __zqhandle_get_tree(handle, type, 1);
+		if (IS_ERR(zqtree))
+			return zqtree;
+		err = zqtree_upgrade(zqtree);
+		if (err) {
+			zqtree_put(zqtree);
+			return ERR_PTR(err);
+		}
+	} else {
+		spin_lock(&objset->lock);
+		zqtree = zqtree_get(objset->quota[type].tree);
+		spin_unlock(&objset->lock);
+		if (!zqtree)
+			return ERR_PTR(-ENOENT);
 	}
-	spin_unlock(&handle->lock);
+
+	return zqtree;
 }
 
-/* ZQ handle get/set quota */
-int zqhandle_get_quota_dqblk(void *sb, int type, qid_t id, struct if_dqblk *di)
+int zqhandle_get_summary(struct zqhandle *handle, int type, int build,
+			 struct zqtree_summary *summary)
 {
-	int err = -EIO;
-	struct zqdata quota_data;
-	struct zqhandle *handle = zqhandle_get_by_sb(sb);
+	struct zqtree *zqtree;
+	int err;
 
-	if (!handle)
-		goto out;
+	zqtree = zqhandle_cached_tree(handle, type, build);
+	if (IS_ERR(zqtree))
+		return PTR_ERR(zqtree);
 
-	if (zfs_fill_quotadata(handle->zfsh, &quota_data, type, id))
-		goto out_zqhandle_put;
+	err = zqtree_summary(zqtree, handle->qid_limit, summary);
+	zqtree_put(zqtree);
+	return err;
+}
 
-	di->dqb_curspace = quota_data.space_used;
+int zqhandle_for_each_over(struct zqhandle *handle, int type, int build,
+			   int (*fn)(const struct zqdata *qd, void *arg),
+			   void *arg)
+{
+	struct zqtree *zqtree;
+	int err;
+
+	zqtree = zqhandle_cached_tree(handle, type, build);
+	if (IS_ERR(zqtree))
+		return PTR_ERR(zqtree);
+
+	err = zqtree_for_each_over(zqtree, handle->qid_limit, fn, arg);
+	zqtree_put(zqtree);
+	return err;
+}
+
+void zqhandle_drop_tree(struct zqhandle *handle, int type)
+{
+	struct zqobjset *objset = handle->objset;
+	struct zqtree *zqtree;
+
+	spin_lock(&objset->lock);
+	zqtree = zqslot_detach(&objset->quota[type]);
+	spin_unlock(&objset->lock);
+
+	zqtree_put(zqtree);
+}
+
+/**
+ * Memory pressure. Idle cached trees are freed least recently accessed
+ * first, trees that are open by someone are left alone.
+ */
+#define ZQHANDLE_SHRINK_BATCH	16
+
+static unsigned long zqhandle_lru_scan(unsigned long nr_to_scan)
+{
+	struct zqtree *dispose[ZQHANDLE_SHRINK_BATCH];
+	struct zqobjset_slot *slot, *next;
+	struct zqobjset *objset;
+	unsigned long freed = 0;
+	int i, n;
+
+	do {
+		n = 0;
+		spin_lock(&zqhandle_lru_lock);
+		list_for_each_entry_safe(slot, next, &zqhandle_lru, lru) {
+			if (!nr_to_scan || n == ZQHANDLE_SHRINK_BATCH)
+				break;
+			nr_to_scan--;
+
+			objset = slot->objset;
+			if (!spin_trylock(&objset->lock))
+				continue;
+
+			if (zqtree_idle(slot->tree)) {
+				dispose[n++] = slot->tree;
+				slot->tree = NULL;
+				list_del_init(&slot->lru);
+				atomic_dec(&zqhandle_lru_count);
+			} else {
+				list_move_tail(&slot->lru, &zqhandle_lru);
+			}
+			spin_unlock(&objset->lock);
+		}
+		spin_unlock(&zqhandle_lru_lock);
+
+		for (i = 0; i < n; i++)
+			zqtree_put(dispose[i]);
+		freed += n;
+	} while (n == ZQHANDLE_SHRINK_BATCH && nr_to_scan);
+
+	return freed;
+}
+
+static inline unsigned long zqhandle_lru_size(void)
+{
+	return atomic_read(&zqhandle_lru_count);
+}
+
+#ifdef HAVE_SPLIT_SHRINKER_CALLBACK
+static unsigned long zqhandle_shrink_count(struct shrinker *shrink,
+					   struct shrink_control *sc)
+{
+	return zqhandle_lru_size();
+}
+
+static unsigned long zqhandle_shrink_scan(struct shrinker *shrink,
+					  struct shrink_control *sc)
+{
+	unsigned long freed = zqhandle_lru_scan(sc->nr_to_scan);
+
+	return freed ?: SHRINK_STOP;
+}
+
+static struct shrinker zqhandle_shrinker = {
+	.count_objects = zqhandle_shrink_count,
+	.scan_objects = zqhandle_shrink_scan,
+	.seeks = DEFAULT_SEEKS,
+};
+#else /* #ifdef HAVE_SPLIT_SHRINKER_CALLBACK */
+#ifdef HAVE_SHRINK_CONTROL_STRUCT
+static int zqhandle_shrink(struct shrinker *shrink, struct shrink_control *sc)
+{
+	unsigned long nr_to_scan = sc->nr_to_scan;
+#else /* #ifdef HAVE_SHRINK_CONTROL_STRUCT */
+static int zqhandle_shrink(struct shrinker *shrink, int nr_to_scan,
+			   gfp_t gfp_mask)
+{
+#endif /* #else #ifdef HAVE_SHRINK_CONTROL_STRUCT */
+	if (nr_to_scan)
+		zqhandle_lru_scan(nr_to_scan);
+
+	return zqhandle_lru_size();
+}
+
+static struct shrinker zqhandle_shrinker = {
+	.shrink = zqhandle_shrink,
+	.seeks = DEFAULT_SEEKS,
+};
+#endif /* #else #ifdef HAVE_SPLIT_SHRINKER_CALLBACK */
+
+/* Entry from the cached tree, if there is a built one */
+static int zqhandle_get_cached_quota(struct zqhandle *handle, int type,
+				     qid_t id, struct zqdata *quota_data)
+{
+	struct zqobjset *objset = handle->objset;
+	struct zqtree *zqtree;
+	int err;
+
+	spin_lock(&objset->lock);
+	zqtree = zqtree_get(objset->quota[type].tree);
+	spin_unlock(&objset->lock);
+
+	if (!zqtree)
+		return -ENOENT;
+
+	err = zqtree_lookup(zqtree, id, quota_data);
+	zqtree_put(zqtree);
+	return err;
+}
+
+static void zqhandle_fill_dqblk(struct if_dqblk *di,
+				const struct zqdata *quota_data,
+				unsigned int caps)
+{
+	di->dqb_curspace = quota_data->space_used;
 	di->dqb_valid |= QIF_SPACE;
-	if (quota_data.space_quota) {
+	if (quota_data->space_quota) {
 		di->dqb_bhardlimit = di->dqb_bsoftlimit =
-		    quota_data.space_quota / 1024;
+		    quota_data->space_quota / 1024;
 		di->dqb_valid |= QIF_BLIMITS;
 	}
 
 #ifdef HAVE_ZFS_OBJECT_QUOTA
-	di->dqb_curinodes = quota_data.obj_used;
+	if (!(caps & ZFS_CAP_OBJQUOTA))
+		return;
+	di->dqb_curinodes = quota_data->obj_used;
 	di->dqb_valid |= QIF_INODES;
-	if (quota_data.obj_quota) {
-		di->dqb_ihardlimit = di->dqb_isoftlimit = quota_data.obj_quota;
+	if (quota_data->obj_quota) {
+		di->dqb_ihardlimit = di->dqb_isoftlimit = quota_data->obj_quota;
 		di->dqb_valid |= QIF_ILIMITS;
 	}
 #endif /* HAVE_ZFS_OBJECT_QUOTA */
+}
+
+/* Built tree of the slot, with fresh only if not past snapshot_ttl */
+static struct zqtree *zqhandle_built_tree(struct zqhandle *handle, int type,
+					  int fresh)
+{
+	struct zqobjset_slot *slot = &handle->objset->quota[type];
+	struct zqtree *zqtree = NULL;
 
+	spin_lock(&handle->objset->lock);
+	if (slot->tree && zqtree_built(slot->tree) &&
+	    !(fresh && zqslot_expired(slot)))
+		zqtree = zqtree_get(slot->tree);
+	spin_unlock(&handle->objset->lock);
+
+	return zqtree;
+}
+
+/*
+ * Quota of nr ids in one go. The ids a fresh snapshot has cost nothing,
+ * each of the others takes a get_rate token as in quotactl, and over the
+ * rate a stale snapshot answers for it. Returns 1 if no id went to the
+ * backend.
+ */
+int zqhandle_get_quota_many(struct zqhandle *handle, int type,
+			    const qid_t *ids, unsigned int nr,
+			    struct if_dqblk *di)
+{
+	unsigned int caps = zqobjset_caps(handle->objset);
+	struct zqdata quota_data;
+	struct zqtree *zqtree;
+	int err, fresh = 1, cached = 1;
+	unsigned int i;
+
+	zqtree = zqhandle_built_tree(handle, type, 1);
+	if (!zqtree) {
+		zqtree = zqhandle_built_tree(handle, type, 0);
+		fresh = 0;
+	}
+
+	for (i = 0; i < nr; i++) {
+		memset(&di[i], 0, sizeof(di[i]));
+		/* Misses are past the qid_limit the tree was built with */
+		if (fresh && !zqtree_lookup(zqtree, ids[i], &quota_data))
+			goto fill;
+
+		if (zqrate_take(handle, ZQRATE_GET)) {
+			if (zqtree && !fresh &&
+			    !zqtree_lookup(zqtree, ids[i], &quota_data))
+				goto fill;
+			err = zqrate_throttle(handle, ZQRATE_GET);
+			if (err)
+				goto out;
+		}
+
+		cached = 0;
+		err = -EIO;
+		if (zfs_fill_quotadata(zqhandle_get_zfsh(handle),
+				       &quota_data, type, ids[i], caps))
+			goto out;
+fill:
+		zqhandle_fill_dqblk(&di[i], &quota_data, caps);
+	}
+
+	err = cached;
+out:
+	zqtree_put(zqtree);
+	return err;
+}
+
+/* ZQ handle get/set quota */
+int zqhandle_get_quota_dqblk(void *sb, int type, qid_t id, struct if_dqblk *di)
+{
+	int err = -EIO;
+	struct zqdata quota_data;
+	struct zqhandle *handle = zqhandle_get_by_sb(sb);
+	unsigned int caps;
+
+	if (!handle)
+		goto out;
+	caps = zqobjset_caps(handle->objset);
+
+	/* Over the rate, answer from the snapshot or wait for a token */
+	if (zqrate_take(handle, ZQRATE_GET)) {
+		if (!zqhandle_get_cached_quota(handle, type, id, &quota_data))
+			goto fill;
+		err = zqrate_throttle(handle, ZQRATE_GET);
+		if (err)
+			goto out_zqhandle_put;
+		err = -EIO;
+	}
+
+	if (zfs_fill_quotadata(zqhandle_get_zfsh(handle), &quota_data, type, id,
+			       caps))
+		goto out_zqhandle_put;
+
+fill:
+	zqhandle_fill_dqblk(di, &quota_data, caps);
 	err = 0;
 out_zqhandle_put:
 	zqhandle_put(handle);
@@ -236,33 +1172,68 @@ static inline uint64_t min_except_zero(uint64_t a, uint64_t b)
 int zqhandle_set_quota_dqblk(void *sb, int type, qid_t id, struct if_dqblk *di)
 {
 	struct zqhandle *handle = zqhandle_get_by_sb(sb);
-	int ret = 0;
+	int ret = 0, changed = 0;
 	uint64_t limit;
 
 	if (!handle)
 		return -ENOENT;
 
+	ret = zqrate_throttle(handle, ZQRATE_SET);
+	if (ret)
+		goto out_put;
+
 	if (di->dqb_valid & QIF_BLIMITS) {
 		limit = 1024 * min_except_zero(di->dqb_bhardlimit,
 					       di->dqb_bsoftlimit);
-		ret = zfs_set_space_quota(handle->zfsh, type,
+		ret = zfs_set_space_quota(zqhandle_get_zfsh(handle), type,
 					  id, limit);
 		if (ret)
 			goto out;
+		changed = 1;
 	}
 
 #ifdef HAVE_ZFS_OBJECT_QUOTA
 	if (di->dqb_valid & QIF_ILIMITS) {
 		limit = min_except_zero(di->dqb_ihardlimit,
 					di->dqb_isoftlimit);
-		ret = zfs_set_object_quota(handle->zfsh, type,
+		/* setquota passes zero inode limits along with block ones */
+		if (!(zqobjset_caps(handle->objset) & ZFS_CAP_OBJQUOTA)) {
+			if (limit)
+				ret = -EOPNOTSUPP;
+			goto out;
+		}
+		ret = zfs_set_object_quota(zqhandle_get_zfsh(handle), type,
 					   id, limit);
 		if (ret)
 			goto out;
+		changed = 1;
 	}
 #endif /* HAVE_ZFS_OBJECT_QUOTA */
 
 out:
+	/* Cached tree carries the old limits, if any limit was set */
+	if (changed) {
+		zqhandle_drop_tree(handle, type);
+		zqobjset_notify(handle->objset, type);
+	}
+out_put:
 	zqhandle_put(handle);
 	return ret;
 }
+
+int __init zqhandle_init(void)
+{
+#ifdef HAVE_REGISTER_SHRINKER_RET
+	return register_shrinker(&zqhandle_shrinker);
+#else /* #ifdef HAVE_REGISTER_SHRINKER_RET */
+	register_shrinker(&zqhandle_shrinker);
+	return 0;
+#endif /* #else #ifdef HAVE_REGISTER_SHRINKER_RET */
+}
+
+void zqhandle_exit(void)
+{
+	unregister_shrinker(&zqhandle_shrinker);
+	/* The last handles are freed from RCU callbacks into this module */
+	rcu_barrier();
+}
@@ -2,17 +2,69 @@
 #define HANDLE_H_INCLUDED
 
 struct zqhandle;
+struct zqobjset;
 struct zqtree;
 
 struct zqhandle *zqhandle_get(struct zqhandle *handle);
 void zqhandle_put(struct zqhandle *handle);
 
 struct zqhandle *zqhandle_get_by_sb(void *sb);
+/* Lockless, for the proc files that only know the device */
+struct zqhandle *zqhandle_get_by_dev(dev_t dev);
 void *zqhandle_get_zfsh(struct zqhandle *handle);
+unsigned int zqhandle_qid_limit(struct zqhandle *handle);
+/* Not referenced, NULL if the mount keeps no usage history */
+struct zqhistory *zqhandle_history(struct zqhandle *handle);
+dev_t zqhandle_dev(struct zqhandle *handle);
+/* Every registered handle until fn returns non-zero, can sleep */
+int zqhandle_for_each(int (*fn)(struct zqhandle *handle, void *arg),
+		      void *arg);
+
+/* Objset is shared by the handles of the same dataset */
+struct zqobjset *zqobjset_get(struct zqobjset *objset);
+void zqobjset_put(struct zqobjset *objset);
+void *zqobjset_get_zfsh(struct zqobjset *objset);
+/* ZFS_CAP_* of the dataset, probed once and cached */
+unsigned int zqobjset_caps(struct zqobjset *objset);
+/* The last handle is gone, the builds of its trees are to stop */
+int zqobjset_dead(struct zqobjset *objset);
+/* Work on its trees queued and finished, waited for when the last goes */
+void zqobjset_build_queued(struct zqobjset *objset);
+void zqobjset_build_done(struct zqobjset *objset);
+/*
+ * Counted per type when a tree is published or limits are set, wakes up
+ * the pollers of the quota files. Returns the new count.
+ */
+unsigned long zqobjset_notify(struct zqobjset *objset, int type);
+unsigned long zqobjset_events(struct zqobjset *objset, int type);
+/* Delta feed state of the type, NULL if the objset keeps none */
+struct zqtree_delta *zqobjset_delta(struct zqobjset *objset, int type);
+/* A reader is done with the tree, snapshot_ttl of the cached one restarts */
+void zqobjset_tree_closed(struct zqobjset *objset, int type,
+			  struct zqtree *qt);
+/* Threshold events and history samples of a published tree, can sleep */
+void zqobjset_watch(struct zqobjset *objset, int type, struct zqtree *qt);
+/* poll_wait and fasync_helper of the quota files go here */
+wait_queue_head_t *zqobjset_waitq(struct zqobjset *objset);
+int zqobjset_fasync(struct zqobjset *objset, int fd, struct file *file,
+		    int on);
 
 struct zqtree *zqhandle_get_tree(struct zqhandle *handle, int type);
-/* Unreference tree from the handle */
-void zqhandle_unref_tree(struct zqhandle *handle, struct zqtree *zqtree);
+/* -EAGAIN instead of a sleep on the rebuild rate, for O_NONBLOCK opens */
+struct zqtree *zqhandle_get_tree_nowait(struct zqhandle *handle, int type);
+/* Builds the tree in the background if the mount asked for prefetch */
+void zqhandle_prefetch_tree(struct zqhandle *handle, int type);
+/* From the cached tree, -ENOENT if there is none and build is not set */
+struct zqtree_summary;
+int zqhandle_get_summary(struct zqhandle *handle, int type, int build,
+			 struct zqtree_summary *summary);
+/* Over limit entries of the tree, same rules as zqhandle_get_summary */
+struct zqdata;
+int zqhandle_for_each_over(struct zqhandle *handle, int type, int build,
+			   int (*fn)(const struct zqdata *qd, void *arg),
+			   void *arg);
+/* Drop the cached tree so the next reader gets a fresh one */
+void zqhandle_drop_tree(struct zqhandle *handle, int type);
 
 /* Register and unregister fake-FS superblock  */
 struct zfsquota_options;
@@ -23,5 +75,9 @@ int zqhandle_unregister_superblock(struct super_block *sb);
 /* Get/set quota dqblk for given superblock, quota type and id */
 int zqhandle_get_quota_dqblk(void *sb, int type, qid_t id, struct if_dqblk *di);
 int zqhandle_set_quota_dqblk(void *sb, int type, qid_t id, struct if_dqblk *di);
+/* Many ids of a handle at once, 1 if all came from the snapshot */
+int zqhandle_get_quota_many(struct zqhandle *handle, int type,
+			    const qid_t *ids, unsigned int nr,
+			    struct if_dqblk *di);
 
 #endif /* #ifndef HANDLE_H_INCLUDED */
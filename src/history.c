@@ -0,0 +1,327 @@
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/slab.h>
+#include <linux/mutex.h>
+#include <linux/mm.h>
+#include <linux/vmalloc.h>
+#include <linux/quota.h>
+
+#include "tree.h"
+#include "zfs.h"
+#include "usage.h"
+#include "history.h"
+
+/* Every history_key-th sample of a type has the absolute values */
+static unsigned int history_key = 12;
+module_param(history_key, uint, 0644);
+
+struct zqhistory_val {
+	uint32_t		qid;
+	uint64_t		space_used;
+	uint64_t		obj_used;
+};
+
+/* Values of the last sample of a type, what the next one is encoded against */
+struct zqhistory_chain {
+	struct zqhistory_val	*vals;
+	unsigned int		nr;
+	unsigned int		since_key;
+	int			seeded;
+};
+
+/*
+ * The header and the ring are mapped to the userspace, so what the ring
+ * is walked by is kept here and only ever copied out: head, tail, dropped
+ * and the sizes of the records between tail and head, oldest at first.
+ */
+struct zqhistory {
+	atomic_t		refcnt;
+	struct mutex		lock;
+	struct zqhistory_header	*header;
+	void			*ring;
+	size_t			size;
+	uint64_t		head, tail, dropped;
+	uint32_t		*sizes;
+	unsigned int		nr_sizes, first, nr;
+	struct zqhistory_chain	chains[MAXQUOTAS];
+};
+
+struct zqhistory *zqhistory_new(unsigned int kb)
+{
+	struct zqhistory *history;
+	size_t size;
+	int type;
+
+	if (!kb)
+		return NULL;
+	size = PAGE_ALIGN((size_t)kb * 1024);
+
+	history = kzalloc(sizeof(*history), GFP_KERNEL);
+	if (!history)
+		return ERR_PTR(-ENOMEM);
+
+	/* Zeroed and fine to map to the userspace */
+	history->header = vmalloc_user(PAGE_SIZE + size);
+	/* Samples are a record header at least, a pad is at the wrap only */
+	history->nr_sizes = size / sizeof(struct zqhistory_record) + 1;
+	history->sizes = vmalloc(history->nr_sizes * sizeof(*history->sizes));
+	if (!history->header || !history->sizes) {
+		vfree(history->sizes);
+		vfree(history->header);
+		kfree(history);
+		return ERR_PTR(-ENOMEM);
+	}
+
+	atomic_set(&history->refcnt, 1);
+	mutex_init(&history->lock);
+	history->ring = (void *)history->header + PAGE_SIZE;
+	history->size = size;
+	for (type = 0; type < MAXQUOTAS; type++)
+		history->chains[type].seeded = 0;
+
+	history->header->magic = ZQHISTORY_MAGIC;
+	history->header->version = ZQHISTORY_VERSION;
+	history->header->offset = PAGE_SIZE;
+	history->header->size = size;
+
+	return history;
+}
+
+struct zqhistory *zqhistory_get(struct zqhistory *history)
+{
+	if (likely(history))
+		atomic_inc(&history->refcnt);
+	return history;
+}
+
+void zqhistory_put(struct zqhistory *history)
+{
+	int type;
+
+	if (!history || !atomic_dec_and_test(&history->refcnt))
+		return;
+
+	for (type = 0; type < MAXQUOTAS; type++)
+		vfree(history->chains[type].vals);
+	vfree(history->sizes);
+	vfree(history->header);
+	kfree(history);
+}
+
+void *zqhistory_buf(struct zqhistory *history, size_t *size)
+{
+	*size = PAGE_SIZE + history->size;
+	return history->header;
+}
+
+/* A sample being encoded, merged in qid order with the previous one */
+struct zqhistory_walk {
+	uint8_t				*buf;
+	size_t				len, limit;
+	uint32_t			last_qid;
+
+	const struct zqhistory_val	*old;
+	unsigned int			old_nr, pos;
+	uint32_t			*gone;
+	unsigned int			nr_gone;
+
+	struct zqhistory_val		*vals;
+	unsigned int			nr, size;
+	uint32_t			changed;
+	uint64_t			obj_used;
+};
+
+static int zqhistory_varint(struct zqhistory_walk *w, uint64_t v)
+{
+	do {
+		if (w->len == w->limit)
+			return -E2BIG;
+		w->buf[w->len++] = (v & 0x7f) | (v > 0x7f ? 0x80 : 0);
+		v >>= 7;
+	} while (v);
+
+	return 0;
+}
+
+/* Small differences either way take a byte or two */
+static inline uint64_t zqhistory_zigzag(uint64_t now, uint64_t was)
+{
+	uint64_t d = now - was;
+
+	return (d << 1) ^ (uint64_t)((int64_t)d >> 63);
+}
+
+static int zqhistory_put_qid(struct zqhistory_walk *w, uint32_t qid)
+{
+	int err = zqhistory_varint(w, qid - w->last_qid);
+
+	w->last_qid = qid;
+	return err;
+}
+
+static int zqhistory_walk_entry(const struct zqdata *qd, void *arg)
+{
+	struct zqhistory_walk *w = arg;
+	struct zqhistory_val val = { .qid = qd->qid }, was = { 0 };
+	int found = 0, err;
+
+	while (w->pos < w->old_nr && w->old[w->pos].qid < qd->qid)
+		w->gone[w->nr_gone++] = w->old[w->pos++].qid;
+	if (w->pos < w->old_nr && w->old[w->pos].qid == qd->qid) {
+		was = w->old[w->pos++];
+		found = 1;
+	}
+
+	val.space_used = qd->space_used;
+#ifdef HAVE_ZFS_OBJECT_QUOTA
+	val.obj_used = qd->obj_used;
+#endif /* HAVE_ZFS_OBJECT_QUOTA */
+
+	/* The tree is the one the size was taken of */
+	if (WARN_ON(w->nr == w->size))
+		return -EINVAL;
+	w->vals[w->nr++] = val;
+	w->obj_used += val.obj_used;
+
+	if (found && val.space_used == was.space_used &&
+	    val.obj_used == was.obj_used)
+		return 0;
+
+	err = zqhistory_put_qid(w, val.qid);
+	if (!err)
+		err = zqhistory_varint(w, zqhistory_zigzag(val.space_used,
+							   was.space_used));
+	if (!err)
+		err = zqhistory_varint(w, zqhistory_zigzag(val.obj_used,
+							   was.obj_used));
+	w->changed++;
+	return err;
+}
+
+static void zqhistory_append(struct zqhistory *history, size_t len)
+{
+	history->sizes[(history->first + history->nr++) % history->nr_sizes] =
+		len;
+}
+
+/*
+ * Room for len bytes at head, the oldest records make it. Tail moves
+ * before the bytes it covered get overwritten.
+ */
+static void zqhistory_push(struct zqhistory *history, const void *rec,
+			   size_t len)
+{
+	struct zqhistory_header *header = history->header;
+	struct zqhistory_record *pad;
+	size_t pos = history->head % history->size, skip = 0;
+
+	if (pos + len > history->size)
+		skip = history->size - pos;
+
+	while (history->head + skip + len - history->tail > history->size) {
+		history->tail += history->sizes[history->first];
+		history->first = (history->first + 1) % history->nr_sizes;
+		history->nr--;
+	}
+	header->tail = history->tail;
+	smp_wmb();
+
+	if (skip) {
+		pad = history->ring + pos;
+		pad->size = skip;
+		pad->kind = ZQHISTORY_PAD;
+		zqhistory_append(history, skip);
+		pos = 0;
+	}
+	memcpy(history->ring + pos, rec, len);
+	zqhistory_append(history, len);
+	history->head += skip + len;
+	smp_wmb();
+	header->head = history->head;
+}
+
+void zqhistory_add(struct zqhistory *history, int type, struct zqtree *qt,
+		   unsigned int qid_limit)
+{
+	struct zqhistory_chain *chain = &history->chains[type];
+	struct zqhistory_record *rec;
+	struct zqtree_summary summary;
+	struct zqhistory_walk w;
+	unsigned int i;
+	int key, err;
+
+	if (zqtree_summary(qt, qid_limit, &summary))
+		return;
+
+	memset(&w, 0, sizeof(w));
+	mutex_lock(&history->lock);
+
+	key = !chain->seeded || chain->since_key >= max(history_key, 1U);
+	if (!key) {
+		w.old = chain->vals;
+		w.old_nr = chain->nr;
+	}
+
+	/* Half the ring at most, the rest keeps some history around */
+	w.limit = round_down(min_t(size_t, history->size / 2, sizeof(*rec) +
+				   summary.entries * 25 + w.old_nr * 5 + 8), 8);
+	w.size = summary.entries;
+	err = -ENOMEM;
+	w.buf = vmalloc(w.limit);
+	w.vals = vmalloc(max_t(size_t, w.size, 1) * sizeof(*w.vals));
+	w.gone = vmalloc(max_t(size_t, w.old_nr, 1) * sizeof(*w.gone));
+	if (!w.buf || !w.vals || !w.gone)
+		goto out_reset;
+
+	w.len = sizeof(*rec);
+	err = zqtree_for_each(qt, qid_limit, zqhistory_walk_entry, &w);
+	if (err)
+		goto out_reset;
+	while (w.pos < w.old_nr)
+		w.gone[w.nr_gone++] = w.old[w.pos++].qid;
+
+	w.last_qid = 0;
+	for (i = 0; i < w.nr_gone && !err; i++)
+		err = zqhistory_put_qid(&w, w.gone[i]);
+	if (err)
+		goto out_reset;
+	/* The limit is aligned too */
+	while (w.len % 8)
+		w.buf[w.len++] = 0;
+
+	rec = (struct zqhistory_record *)w.buf;
+	memset(rec, 0, sizeof(*rec));
+	rec->size = w.len;
+	rec->kind = ZQHISTORY_SAMPLE;
+	rec->flags = key ? ZQHISTORY_KEY : 0;
+	if (zqtree_caps(qt) & ZFS_CAP_OBJQUOTA)
+		rec->flags |= ZQHISTORY_OBJ;
+	rec->type = type;
+	rec->changed = w.changed;
+	rec->gone = w.nr_gone;
+	rec->generation = zqtree_generation(qt);
+	rec->time = zqtree_mtime(qt).tv_sec;
+	rec->entries = summary.entries;
+	rec->space_used = summary.space_used;
+	rec->obj_used = w.obj_used;
+	zqhistory_push(history, rec, w.len);
+
+	vfree(chain->vals);
+	chain->vals = w.vals;
+	chain->nr = w.nr;
+	chain->since_key = key ? 1 : chain->since_key + 1;
+	chain->seeded = 1;
+	w.vals = NULL;
+	goto out;
+
+out_reset:
+	/* The chain is broken, the next sample of the type is a key one */
+	if (err == -E2BIG)
+		history->header->dropped = ++history->dropped;
+	chain->seeded = 0;
+out:
+	mutex_unlock(&history->lock);
+	vfree(w.gone);
+	vfree(w.vals);
+	vfree(w.buf);
+}
@@ -0,0 +1,24 @@
+#ifndef HISTORY_H_INCLUDED
+#define HISTORY_H_INCLUDED
+
+/*
+ * Usage history of a mount, a ring of samples of its published trees
+ * exported as is, see usage.h for the layout
+ */
+
+struct zqtree;
+struct zqhistory;
+
+/* Ring of kb KiB, NULL for 0 */
+struct zqhistory *zqhistory_new(unsigned int kb);
+struct zqhistory *zqhistory_get(struct zqhistory *history);
+void zqhistory_put(struct zqhistory *history);
+
+/* Sample of the entries of a built tree below qid_limit, can sleep */
+void zqhistory_add(struct zqhistory *history, int type, struct zqtree *qt,
+		   unsigned int qid_limit);
+
+/* The header page and the ring, vmalloc_user memory of size bytes */
+void *zqhistory_buf(struct zqhistory *history, size_t *size);
+
+#endif /* HISTORY_H_INCLUDED */
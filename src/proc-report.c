@@ -0,0 +1,155 @@
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/proc_fs.h>
+#include <linux/seq_file.h>
+#include <linux/slab.h>
+#include <linux/quota.h>
+
+#include "proc.h"
+#include "handle.h"
+#include "tree.h"
+
+/**
+ * report.user and report.group: what repquota -n prints, a line per qid
+ * in qid order straight from the tree taken at open. Space is in 1024 byte
+ * blocks as quota-tools count it, soft and hard are both the ZFS limit.
+ *
+ * The position of an entry is its qid + 1, 0 is the header, so a read
+ * goes on with a lookup from the next qid instead of a walk from the start.
+ */
+struct zqreport {
+	struct zqtree	*zqtree;
+	unsigned int	qid_limit;
+	struct zqdata	qd;
+};
+
+static void *zqreport_entry(struct zqreport *report, loff_t from)
+{
+	if (from > UINT_MAX ||
+	    zqtree_next(report->zqtree, from, report->qid_limit, &report->qd))
+		return NULL;
+
+	return &report->qd;
+}
+
+static void *zqreport_start(struct seq_file *m, loff_t *pos)
+{
+	if (!*pos)
+		return SEQ_START_TOKEN;
+
+	return zqreport_entry(m->private, *pos - 1);
+}
+
+static void *zqreport_next(struct seq_file *m, void *v, loff_t *pos)
+{
+	struct zqreport *report = m->private;
+	loff_t from = 0;
+
+	if (v != SEQ_START_TOKEN)
+		from = (loff_t)report->qd.qid + 1;
+	*pos = from + 1;
+
+	return zqreport_entry(report, from);
+}
+
+static void zqreport_stop(struct seq_file *m, void *v)
+{
+}
+
+static int zqreport_show(struct seq_file *m, void *v)
+{
+	const struct zqdata *qd = v;
+	unsigned long long obj_used = 0, obj_quota = 0;
+
+	if (v == SEQ_START_TOKEN) {
+		seq_puts(m, "qid used soft hard iused isoft ihard\n");
+		return 0;
+	}
+
+#ifdef HAVE_ZFS_OBJECT_QUOTA
+	obj_used = qd->obj_used;
+	obj_quota = qd->obj_quota;
+#endif /* HAVE_ZFS_OBJECT_QUOTA */
+
+	seq_printf(m, "%u %llu %llu %llu %llu %llu %llu\n", qd->qid,
+		   (unsigned long long)DIV_ROUND_UP(qd->space_used, 1024),
+		   (unsigned long long)qd->space_quota / 1024,
+		   (unsigned long long)qd->space_quota / 1024,
+		   obj_used, obj_quota, obj_quota);
+	return 0;
+}
+
+static const struct seq_operations zqreport_seq_ops = {
+	.start = zqreport_start,
+	.next = zqreport_next,
+	.stop = zqreport_stop,
+	.show = zqreport_show,
+};
+
+static int zqreport_open(struct inode *inode, struct file *file)
+{
+	struct zqreport *report;
+	struct zqhandle *handle;
+	struct zqtree *zqtree;
+	int err, type;
+
+	err = zqproc_get_handle_type(inode, &handle, &type);
+	if (err)
+		return err;
+
+	if (file->f_flags & O_NONBLOCK)
+		zqtree = zqhandle_get_tree_nowait(handle, type);
+	else
+		zqtree = zqhandle_get_tree(handle, type);
+	if (IS_ERR(zqtree)) {
+		err = PTR_ERR(zqtree);
+		goto out_put;
+	}
+
+	if (file->f_flags & O_NONBLOCK)
+		err = zqtree_upgrade_nowait(zqtree);
+	else
+		err = zqtree_upgrade(zqtree);
+	if (err)
+		goto out_tree;
+
+	err = -ENOMEM;
+	report = kmalloc(sizeof(*report), GFP_KERNEL);
+	if (!report)
+		goto out_tree;
+	report->zqtree = zqtree;
+	report->qid_limit = zqhandle_qid_limit(handle);
+
+	err = seq_open(file, &zqreport_seq_ops);
+	if (err) {
+		kfree(report);
+		goto out_tree;
+	}
+	((struct seq_file *)file->private_data)->private = report;
+	zqhandle_put(handle);
+	return 0;
+
+out_tree:
+	zqtree_close(zqtree);
+out_put:
+	zqhandle_put(handle);
+	return err;
+}
+
+static int zqreport_release(struct inode *inode, struct file *file)
+{
+	struct seq_file *m = file->private_data;
+	struct zqreport *report = m->private;
+
+	zqtree_close(report->zqtree);
+	kfree(report);
+	return seq_release(inode, file);
+}
+
+const struct file_operations zqproc_report_file_operations = {
+	.owner = THIS_MODULE,
+	.open = zqreport_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = zqreport_release,
+};
@@ -0,0 +1,136 @@
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/proc_fs.h>
+#include <linux/seq_file.h>
+#include <linux/slab.h>
+#include <linux/quota.h>
+#include <linux/uaccess.h>
+
+#include "proc.h"
+#include "handle.h"
+#include "tree.h"
+
+/**
+ * top.user and top.group: the largest consumers of the mount out of the
+ * top index of the tree, top_n of them by space. Writing "<n> [space|obj]"
+ * to the open file changes what the following reads from 0 list.
+ */
+static unsigned int top_n = 20;
+module_param(top_n, uint, 0644);
+
+struct zqtop_query {
+	struct inode	*inode;
+	unsigned int	n;
+	int		key;
+};
+
+static int zqtop_show_entry(const struct zqdata *qd, void *arg)
+{
+	struct seq_file *m = arg;
+	unsigned long long obj_used = 0, obj_quota = 0;
+
+#ifdef HAVE_ZFS_OBJECT_QUOTA
+	obj_used = qd->obj_used;
+	obj_quota = qd->obj_quota;
+#endif /* HAVE_ZFS_OBJECT_QUOTA */
+
+	seq_printf(m, "%u %llu %llu %llu %llu\n", qd->qid,
+		   (unsigned long long)qd->space_used,
+		   (unsigned long long)qd->space_quota, obj_used, obj_quota);
+	return 0;
+}
+
+static int zqtop_show(struct seq_file *m, void *v)
+{
+	struct zqtop_query *query = m->private;
+	struct zqhandle *handle;
+	struct zqtree *zqtree;
+	int err, type;
+
+	err = zqproc_get_handle_type(query->inode, &handle, &type);
+	if (err)
+		return err;
+
+	zqtree = zqhandle_get_tree(handle, type);
+	if (IS_ERR(zqtree)) {
+		err = PTR_ERR(zqtree);
+		goto out_put;
+	}
+
+	err = zqtree_upgrade(zqtree);
+	if (!err) {
+		seq_puts(m, "qid space_used space_quota obj_used obj_quota\n");
+		err = zqtree_top(zqtree, query->key,
+				 zqhandle_qid_limit(handle), query->n,
+				 zqtop_show_entry, m);
+	}
+	zqtree_close(zqtree);
+
+out_put:
+	zqhandle_put(handle);
+	return err;
+}
+
+static ssize_t zqtop_write(struct file *file, const char __user *ubuf,
+			   size_t count, loff_t *ppos)
+{
+	struct seq_file *m = file->private_data;
+	struct zqtop_query *query = m->private;
+	char buf[32], key[8] = "space";
+	unsigned int n;
+
+	if (count >= sizeof(buf))
+		return -EINVAL;
+	if (copy_from_user(buf, ubuf, count))
+		return -EFAULT;
+	buf[count] = '\0';
+
+	if (sscanf(buf, "%u %7s", &n, key) < 1)
+		return -EINVAL;
+
+	if (!strcmp(key, "space"))
+		query->key = ZQTREE_TOP_SPACE;
+	else if (!strcmp(key, "obj"))
+		query->key = ZQTREE_TOP_OBJ;
+	else
+		return -EINVAL;
+	query->n = n;
+
+	return count;
+}
+
+static int zqtop_open(struct inode *inode, struct file *file)
+{
+	struct zqtop_query *query;
+	int err;
+
+	query = kmalloc(sizeof(*query), GFP_KERNEL);
+	if (!query)
+		return -ENOMEM;
+
+	query->inode = inode;
+	query->n = top_n;
+	query->key = ZQTREE_TOP_SPACE;
+
+	err = single_open(file, zqtop_show, query);
+	if (err)
+		kfree(query);
+	return err;
+}
+
+static int zqtop_release(struct inode *inode, struct file *file)
+{
+	struct seq_file *m = file->private_data;
+
+	kfree(m->private);
+	return single_release(inode, file);
+}
+
+const struct file_operations zqproc_top_file_operations = {
+	.owner = THIS_MODULE,
+	.open = zqtop_open,
+	.read = seq_read,
+	.write = zqtop_write,
+	.llseek = seq_lseek,
+	.release = zqtop_release,
+};
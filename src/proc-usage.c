@@ -0,0 +1,484 @@
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/proc_fs.h>
+#include <linux/fs.h>
+#include <linux/mm.h>
+#include <linux/poll.h>
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+#include <linux/quota.h>
+
+#include "proc.h"
+#include "handle.h"
+#include "tree.h"
+#include "zfs.h"
+#include "usage.h"
+#include "history.h"
+
+/**
+ * usage.bin: both quota types of the mount packed at open into a buffer
+ * that read and mmap serve as is. Reopen to get a fresh one.
+ */
+struct zqusage_file {
+	void		*buf;
+	size_t		size;
+	/* For poll, zqtree_event of the trees packed */
+	struct zqobjset	*objset;
+	unsigned long	seen[MAXQUOTAS];
+};
+
+struct zqusage_fill {
+	struct zqusage_entry	*entry;
+	int			type;
+};
+
+static int zqusage_fill_entry(const struct zqdata *qd, void *arg)
+{
+	struct zqusage_fill *fill = arg;
+	struct zqusage_entry *entry = fill->entry++;
+
+	entry->qid = qd->qid;
+	entry->type = fill->type;
+	entry->space_used = qd->space_used;
+	entry->space_quota = qd->space_quota;
+#ifdef HAVE_ZFS_OBJECT_QUOTA
+	entry->obj_used = qd->obj_used;
+	entry->obj_quota = qd->obj_quota;
+#endif /* HAVE_ZFS_OBJECT_QUOTA */
+
+	return 0;
+}
+
+/* Built trees of both types, not waiting for them with O_NONBLOCK */
+static int zqusage_get_trees(struct zqhandle *handle, struct file *file,
+			     struct zqtree **trees)
+{
+	int err, type;
+
+	for (type = USRQUOTA; type <= GRPQUOTA; type++) {
+		if (file->f_flags & O_NONBLOCK)
+			trees[type] = zqhandle_get_tree_nowait(handle, type);
+		else
+			trees[type] = zqhandle_get_tree(handle, type);
+		if (IS_ERR(trees[type])) {
+			err = PTR_ERR(trees[type]);
+			trees[type] = NULL;
+			return err;
+		}
+		if (file->f_flags & O_NONBLOCK)
+			err = zqtree_upgrade_nowait(trees[type]);
+		else
+			err = zqtree_upgrade(trees[type]);
+		if (err)
+			return err;
+	}
+
+	return 0;
+}
+
+static int zqusage_open(struct inode *inode, struct file *file)
+{
+	struct zqtree *trees[MAXQUOTAS] = { NULL };
+	struct zqtree_summary summary;
+	struct zqusage_header *header;
+	struct zqusage_fill fill;
+	struct zqusage_file *data;
+	struct zqhandle *handle;
+	struct timespec mtime, tree_mtime;
+	unsigned int qid_limit;
+	uint64_t count = 0;
+	int err, type;
+
+	err = zqproc_get_handle_type(inode, &handle, NULL);
+	if (err)
+		return err;
+	qid_limit = zqhandle_qid_limit(handle);
+
+	err = -ENOMEM;
+	data = kzalloc(sizeof(*data), GFP_KERNEL);
+	if (!data)
+		goto out_put;
+
+	err = zqusage_get_trees(handle, file, trees);
+	if (err)
+		goto out_free;
+
+	for (type = USRQUOTA; type <= GRPQUOTA; type++) {
+		err = zqtree_summary(trees[type], qid_limit, &summary);
+		if (err)
+			goto out_free;
+		count += summary.entries;
+	}
+
+	data->size = sizeof(*header) + count * sizeof(struct zqusage_entry);
+	err = -ENOMEM;
+	/* Zeroed and fine to map to the userspace */
+	data->buf = vmalloc_user(PAGE_ALIGN(data->size));
+	if (!data->buf)
+		goto out_free;
+
+	header = data->buf;
+	header->magic = ZQUSAGE_MAGIC;
+	header->version = ZQUSAGE_VERSION;
+	header->count = count;
+	header->entry_size = sizeof(struct zqusage_entry);
+	header->flags = ZQUSAGE_OBJ;
+
+	fill.entry = (struct zqusage_entry *)(header + 1);
+	mtime = zqtree_mtime(trees[USRQUOTA]);
+	for (type = USRQUOTA; type <= GRPQUOTA; type++) {
+		fill.type = type;
+		data->seen[type] = zqtree_event(trees[type]);
+		tree_mtime = zqtree_mtime(trees[type]);
+		if (timespec_compare(&mtime, &tree_mtime) < 0)
+			mtime = tree_mtime;
+		zqtree_for_each(trees[type], qid_limit, zqusage_fill_entry,
+				&fill);
+		header->generation = max_t(uint64_t, header->generation,
+					   zqtree_generation(trees[type]));
+		if (!(zqtree_caps(trees[type]) & ZFS_CAP_OBJQUOTA))
+			header->flags &= ~ZQUSAGE_OBJ;
+	}
+
+	data->objset = zqobjset_get(zqtree_get_objset(trees[USRQUOTA]));
+	inode->i_mtime = mtime;
+	file->private_data = data;
+	err = 0;
+	data = NULL;
+
+out_free:
+	for (type = USRQUOTA; type <= GRPQUOTA; type++)
+		zqtree_close(trees[type]);
+	kfree(data);
+out_put:
+	zqhandle_put(handle);
+	return err;
+}
+
+static int zqusage_release(struct inode *inode, struct file *file)
+{
+	struct zqusage_file *data = file->private_data;
+
+	zqobjset_fasync(data->objset, -1, file, 0);
+	zqobjset_put(data->objset);
+	vfree(data->buf);
+	kfree(data);
+	return 0;
+}
+
+static ssize_t zqusage_read(struct file *file, char __user *buf, size_t size,
+			    loff_t *ppos)
+{
+	struct zqusage_file *data = file->private_data;
+
+	return simple_read_from_buffer(buf, size, ppos, data->buf,
+				       data->size);
+}
+
+static int zqusage_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	struct zqusage_file *data = file->private_data;
+
+	if (vma->vm_flags & VM_WRITE)
+		return -EPERM;
+	vma->vm_flags &= ~VM_MAYWRITE;
+
+	return remap_vmalloc_range(vma, data->buf, vma->vm_pgoff);
+}
+
+/* Like the aquota files after a read: ready when either type has news */
+static unsigned int zqusage_poll(struct file *file, poll_table *wait)
+{
+	struct zqusage_file *data = file->private_data;
+	int type;
+
+	poll_wait(file, zqobjset_waitq(data->objset), wait);
+
+	for (type = USRQUOTA; type <= GRPQUOTA; type++)
+		if (zqobjset_events(data->objset, type) != data->seen[type])
+			return POLLIN | POLLPRI | POLLRDNORM;
+
+	return 0;
+}
+
+static int zqusage_fasync(int fd, struct file *file, int on)
+{
+	struct zqusage_file *data = file->private_data;
+
+	return zqobjset_fasync(data->objset, fd, file, on);
+}
+
+const struct file_operations zqproc_usage_file_operations = {
+	.owner = THIS_MODULE,
+	.open = zqusage_open,
+	.read = zqusage_read,
+	.llseek = default_llseek,
+	.mmap = zqusage_mmap,
+	.poll = zqusage_poll,
+	.fasync = zqusage_fasync,
+	.release = zqusage_release,
+};
+
+/**
+ * delta.bin: what changed in the trees of the mount after a generation.
+ * Seek to the generation of the last usage.bin or delta.bin read, the
+ * first read packs the changes out of the trees taken at open. Seeking
+ * is over after it, reopen for the next delta.
+ */
+struct zqdelta_file {
+	struct zqtree	*trees[MAXQUOTAS];
+	unsigned int	qid_limit;
+	void		*buf;
+	size_t		size, alloc;
+	/* Offset of the image in the file, the since of the delta */
+	loff_t		base;
+};
+
+struct zqdelta_fill {
+	struct zqdelta_file	*data;
+	int			type;
+};
+
+static int zqdelta_fill_entry(const struct zqdata *qd, int gone, void *arg)
+{
+	struct zqdelta_fill *fill = arg;
+	struct zqdelta_file *data = fill->data;
+	struct zqdelta_entry *entry;
+	size_t alloc;
+	void *buf;
+
+	if (data->size + sizeof(*entry) > data->alloc) {
+		alloc = data->alloc * 2;
+		buf = vmalloc(alloc);
+		if (!buf)
+			return -ENOMEM;
+		memcpy(buf, data->buf, data->size);
+		vfree(data->buf);
+		data->buf = buf;
+		data->alloc = alloc;
+	}
+
+	entry = data->buf + data->size;
+	data->size += sizeof(*entry);
+
+	memset(entry, 0, sizeof(*entry));
+	entry->qid = qd->qid;
+	entry->type = fill->type;
+	entry->version = qd->version;
+	if (gone) {
+		entry->flags = ZQDELTA_GONE;
+		return 0;
+	}
+
+	entry->space_used = qd->space_used;
+	entry->space_quota = qd->space_quota;
+#ifdef HAVE_ZFS_OBJECT_QUOTA
+	entry->obj_used = qd->obj_used;
+	entry->obj_quota = qd->obj_quota;
+#endif /* HAVE_ZFS_OBJECT_QUOTA */
+
+	return 0;
+}
+
+static void zqdelta_put_trees(struct zqdelta_file *data)
+{
+	int type;
+
+	for (type = USRQUOTA; type <= GRPQUOTA; type++) {
+		zqtree_close(data->trees[type]);
+		data->trees[type] = NULL;
+	}
+}
+
+static int zqdelta_pack(struct zqdelta_file *data, uint64_t since)
+{
+	struct zqdelta_header *header;
+	struct zqdelta_fill fill;
+	uint64_t generation = 0;
+	unsigned int flags = ZQUSAGE_OBJ;
+	struct zqtree *qt;
+	int err, type;
+
+	data->alloc = PAGE_SIZE;
+	data->buf = vmalloc(data->alloc);
+	if (!data->buf)
+		return -ENOMEM;
+	data->size = sizeof(*header);
+
+	fill.data = data;
+	for (type = USRQUOTA; type <= GRPQUOTA; type++) {
+		qt = data->trees[type];
+		fill.type = type;
+		err = zqtree_delta(qt, zqobjset_delta(zqtree_get_objset(qt),
+						      type),
+				   since, data->qid_limit, zqdelta_fill_entry,
+				   &fill);
+		if (err)
+			goto out_free;
+
+		generation = max_t(uint64_t, generation,
+				   zqtree_generation(qt));
+		if (!(zqtree_caps(qt) & ZFS_CAP_OBJQUOTA))
+			flags &= ~ZQUSAGE_OBJ;
+	}
+
+	header = data->buf;
+	memset(header, 0, sizeof(*header));
+	header->magic = ZQDELTA_MAGIC;
+	header->version = ZQDELTA_VERSION;
+	header->generation = generation;
+	header->since = since;
+	header->count = (data->size - sizeof(*header)) /
+			sizeof(struct zqdelta_entry);
+	header->flags = flags;
+	header->entry_size = sizeof(struct zqdelta_entry);
+
+	zqdelta_put_trees(data);
+	return 0;
+
+out_free:
+	vfree(data->buf);
+	data->buf = NULL;
+	data->size = data->alloc = 0;
+	return err;
+}
+
+static int zqdelta_open(struct inode *inode, struct file *file)
+{
+	struct zqdelta_file *data;
+	struct zqhandle *handle;
+	int err;
+
+	err = zqproc_get_handle_type(inode, &handle, NULL);
+	if (err)
+		return err;
+
+	err = -ENOMEM;
+	data = kzalloc(sizeof(*data), GFP_KERNEL);
+	if (!data)
+		goto out_put;
+
+	data->qid_limit = zqhandle_qid_limit(handle);
+	err = zqusage_get_trees(handle, file, data->trees);
+	if (err) {
+		zqdelta_put_trees(data);
+		kfree(data);
+		goto out_put;
+	}
+
+	file->private_data = data;
+out_put:
+	zqhandle_put(handle);
+	return err;
+}
+
+static int zqdelta_release(struct inode *inode, struct file *file)
+{
+	struct zqdelta_file *data = file->private_data;
+
+	zqdelta_put_trees(data);
+	vfree(data->buf);
+	kfree(data);
+	return 0;
+}
+
+static loff_t zqdelta_llseek(struct file *file, loff_t offset, int whence)
+{
+	struct zqdelta_file *data = file->private_data;
+
+	if (data->buf || whence != SEEK_SET || offset < 0)
+		return -EINVAL;
+
+	file->f_pos = offset;
+	return offset;
+}
+
+static ssize_t zqdelta_read(struct file *file, char __user *buf, size_t size,
+			    loff_t *ppos)
+{
+	struct zqdelta_file *data = file->private_data;
+	loff_t pos;
+	ssize_t ret;
+	int err;
+
+	if (!data->buf) {
+		err = zqdelta_pack(data, *ppos);
+		if (err)
+			return err;
+		data->base = *ppos;
+	}
+
+	pos = *ppos - data->base;
+	ret = simple_read_from_buffer(buf, size, &pos, data->buf, data->size);
+	if (ret > 0)
+		*ppos += ret;
+	return ret;
+}
+
+const struct file_operations zqproc_delta_file_operations = {
+	.owner = THIS_MODULE,
+	.open = zqdelta_open,
+	.read = zqdelta_read,
+	.llseek = zqdelta_llseek,
+	.release = zqdelta_release,
+};
+
+/**
+ * history: the usage history ring of the mount, mapped or read as is.
+ * It changes under the reader, see usage.h for how to copy it out.
+ */
+static int zqhistory_open(struct inode *inode, struct file *file)
+{
+	struct zqhistory *history;
+	struct zqhandle *handle;
+	int err;
+
+	err = zqproc_get_handle_type(inode, &handle, NULL);
+	if (err)
+		return err;
+
+	history = zqhistory_get(zqhandle_history(handle));
+	zqhandle_put(handle);
+	if (!history)
+		return -ENODATA;
+
+	file->private_data = history;
+	return 0;
+}
+
+static int zqhistory_release(struct inode *inode, struct file *file)
+{
+	zqhistory_put(file->private_data);
+	return 0;
+}
+
+static ssize_t zqhistory_read(struct file *file, char __user *buf,
+			      size_t size, loff_t *ppos)
+{
+	size_t buf_size;
+	void *data = zqhistory_buf(file->private_data, &buf_size);
+
+	return simple_read_from_buffer(buf, size, ppos, data, buf_size);
+}
+
+static int zqhistory_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	size_t buf_size;
+	void *data = zqhistory_buf(file->private_data, &buf_size);
+
+	if (vma->vm_flags & VM_WRITE)
+		return -EPERM;
+	/* Nor made writable later by mprotect */
+	vma->vm_flags &= ~VM_MAYWRITE;
+
+	return remap_vmalloc_range(vma, data, vma->vm_pgoff);
+}
+
+const struct file_operations zqproc_history_file_operations = {
+	.owner = THIS_MODULE,
+	.open = zqhistory_open,
+	.read = zqhistory_read,
+	.llseek = default_llseek,
+	.mmap = zqhistory_mmap,
+	.release = zqhistory_release,
+};
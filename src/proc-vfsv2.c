@@ -5,6 +5,8 @@
 #include <linux/mount.h>
 #include <linux/slab.h>
 #include <linux/radix-tree.h>
+#include <linux/poll.h>
+#include <linux/compat.h>
 
 #include <linux/uaccess.h>
 #include <linux/ctype.h>
@@ -12,48 +14,75 @@
 #include "proc.h"
 #include "handle.h"
 #include "tree.h"
+#include "usage.h"
 
 #define QTREE_BLOCKSIZE	1024
 
+/* Shared tree seen through the qid_limit of the superblock */
+struct zfs_aquotf_data {
+	struct zqtree		*zqtree;
+	unsigned int		qid_limit;
+	struct zqobjset		*objset;
+	int			type;
+	/* zqtree_event of the tree as of the last read, 0 before it */
+	unsigned long		seen;
+};
+
 static int zfs_aquotf_vfsv2r1_open(struct inode *inode, struct file *file)
 {
 	int err, type;
-	struct super_block *sb;
 	struct zqtree *quota_tree;
 	struct zqhandle *handle;
+	struct zfs_aquotf_data *data;
 
-	err = zqproc_get_sb_type(inode, &sb, &type);
-	if (err)
+	err = -ENOMEM;
+	data = kmalloc(sizeof(*data), GFP_KERNEL);
+	if (!data)
 		goto out_err;
 
-	err = -ENOENT;
-	handle = zqhandle_get_by_sb(sb);
-	if (!handle)
-		goto out_err;
+	err = zqproc_get_handle_type(inode, &handle, &type);
+	if (err)
+		goto out_free;
 
-	quota_tree = zqhandle_get_tree(handle, type);
+	if (file->f_flags & O_NONBLOCK)
+		quota_tree = zqhandle_get_tree_nowait(handle, type);
+	else
+		quota_tree = zqhandle_get_tree(handle, type);
+	data->qid_limit = zqhandle_qid_limit(handle);
+	/* repquota -ug reads the other file right after this one */
+	if (!IS_ERR(quota_tree))
+		zqhandle_prefetch_tree(handle,
+				       type == USRQUOTA ? GRPQUOTA : USRQUOTA);
 	zqhandle_put(handle);
 
 	if (IS_ERR(quota_tree)) {
 		err = PTR_ERR(quota_tree);
-		goto out_err;
+		goto out_free;
 	}
-	file->private_data = quota_tree;
+	data->zqtree = quota_tree;
+	data->objset = zqtree_get_objset(quota_tree);
+	data->type = type;
+	data->seen = 0;
+	file->private_data = data;
 
 	return 0;
 
+out_free:
+	kfree(data);
 out_err:
 	return err;
 }
 
 static int zfs_aquotf_vfsv2r1_release(struct inode *inode, struct file *file)
 {
-	struct zqtree *zqtree;
+	struct zfs_aquotf_data *data;
 
-	zqtree = file->private_data;
+	data = file->private_data;
 	file->private_data = NULL;
 
-	zqtree_put(zqtree);
+	zqobjset_fasync(data->objset, -1, file, 0);
+	zqtree_close(data->zqtree);
+	kfree(data);
 
 	return 0;
 }
@@ -82,12 +111,22 @@ static ssize_t zfs_aquotf_vfsv2r1_read(struct file *file,
 	size_t bufsize;
 	ssize_t l, l2, copied;
 	int err;
-	struct zqtree *zqtree = file->private_data;
+	struct zfs_aquotf_data *data = file->private_data;
+	struct zqtree *zqtree = data->zqtree;
 
 	if (*ppos == 0 && size == 8) {
 		return zfs_aquotf_vfsv2r1_read_magic(zqtree, buf);
 	}
 
+	if (file->f_flags & O_NONBLOCK)
+		err = zqtree_upgrade_nowait(zqtree);
+	else
+		err = zqtree_upgrade(zqtree);
+	if (err)
+		return err;
+	file->f_path.dentry->d_inode->i_mtime = zqtree_mtime(zqtree);
+	data->seen = zqtree_event(zqtree);
+
 	err = -ENOMEM;
 	page = (char *)__get_free_page(GFP_KERNEL);
 	if (!page)
@@ -102,7 +141,8 @@ static ssize_t zfs_aquotf_vfsv2r1_read(struct file *file,
 
 		/* TODO fix double memory set for non-zero regions */
 		memset(page, 0, QTREE_BLOCKSIZE);
-		l = zqtree_output_block(zqtree, page, *ppos / QTREE_BLOCKSIZE);
+		l = zqtree_output_block(zqtree, page, *ppos / QTREE_BLOCKSIZE,
+					data->qid_limit);
 		if (l <= 0)
 			break;
 		l = bufsize;
@@ -131,9 +171,152 @@ out_err:
 	return err;
 }
 
+/*
+ * Readable once the tree is built. After a read, only when the dataset got
+ * a newer tree or new limits: the file stays with its tree, reopen it then.
+ */
+static unsigned int zfs_aquotf_vfsv2r1_poll(struct file *file,
+					    poll_table *wait)
+{
+	struct zfs_aquotf_data *data = file->private_data;
+
+	poll_wait(file, zqobjset_waitq(data->objset), wait);
+
+	if (!data->seen) {
+		/* Build errors are readable too */
+		if (zqtree_upgrade_nowait(data->zqtree) == -EAGAIN)
+			return 0;
+		return POLLIN | POLLRDNORM;
+	}
+
+	if (zqobjset_events(data->objset, data->type) != data->seen)
+		return POLLIN | POLLPRI | POLLRDNORM;
+
+	return 0;
+}
+
+static int zfs_aquotf_vfsv2r1_fasync(int fd, struct file *file, int on)
+{
+	struct zfs_aquotf_data *data = file->private_data;
+
+	return zqobjset_fasync(data->objset, fd, file, on);
+}
+
+/* Qids looked up per pass, the buffers of a pass fit a few pages */
+#define ZQGETQUOTA_BATCH	128
+
+static void zqgetquota_fill(struct zqdqblk *out, qid_t qid,
+			    const struct if_dqblk *di)
+{
+	out->bhardlimit = di->dqb_bhardlimit;
+	out->bsoftlimit = di->dqb_bsoftlimit;
+	out->curspace = di->dqb_curspace;
+	out->ihardlimit = di->dqb_ihardlimit;
+	out->isoftlimit = di->dqb_isoftlimit;
+	out->curinodes = di->dqb_curinodes;
+	out->qid = qid;
+	out->valid = di->dqb_valid;
+}
+
+static long zfs_aquotf_vfsv2r1_getquota(struct file *file,
+					struct zqgetquota __user *uarg)
+{
+	struct zfs_aquotf_data *data = file->private_data;
+	qid_t __user *uqids;
+	struct zqdqblk __user *udqblks;
+	struct zqgetquota arg;
+	struct zqhandle *handle;
+	struct if_dqblk *dqblks;
+	struct zqdqblk out;
+	qid_t *qids;
+	unsigned int done, nr, i;
+	int err, cached = 1;
+
+	if (copy_from_user(&arg, uarg, sizeof(arg)))
+		return -EFAULT;
+	if (arg.count > ZQGETQUOTA_MAX)
+		return -E2BIG;
+	uqids = (qid_t __user *)(unsigned long)arg.qids;
+	udqblks = (struct zqdqblk __user *)(unsigned long)arg.dqblks;
+
+	err = zqproc_get_handle_type(file->f_path.dentry->d_inode, &handle,
+				     NULL);
+	if (err)
+		return err;
+
+	err = -ENOMEM;
+	qids = kmalloc(ZQGETQUOTA_BATCH * sizeof(*qids), GFP_KERNEL);
+	dqblks = kmalloc(ZQGETQUOTA_BATCH * sizeof(*dqblks), GFP_KERNEL);
+	if (!qids || !dqblks)
+		goto out_free;
+
+	for (done = 0; done < arg.count; done += nr) {
+		nr = min_t(unsigned int, arg.count - done, ZQGETQUOTA_BATCH);
+
+		err = -EFAULT;
+		if (copy_from_user(qids, uqids + done, nr * sizeof(*qids)))
+			goto out_free;
+
+		err = zqhandle_get_quota_many(handle, data->type, qids, nr,
+					      dqblks);
+		if (err < 0)
+			goto out_free;
+		cached &= err;
+
+		err = -EFAULT;
+		for (i = 0; i < nr; i++) {
+			zqgetquota_fill(&out, qids[i], &dqblks[i]);
+			if (copy_to_user(udqblks + done + i, &out, sizeof(out)))
+				goto out_free;
+		}
+
+		cond_resched();
+	}
+
+	arg.flags = cached ? ZQGETQUOTA_CACHED : 0;
+	err = 0;
+	if (copy_to_user(&uarg->flags, &arg.flags, sizeof(arg.flags)))
+		err = -EFAULT;
+
+out_free:
+	kfree(dqblks);
+	kfree(qids);
+	zqhandle_put(handle);
+	return err;
+}
+
+static long zfs_aquotf_vfsv2r1_ioctl(struct file *file, unsigned int cmd,
+				     unsigned long arg)
+{
+	switch (cmd) {
+	case ZQ_IOC_GETQUOTA:
+		return zfs_aquotf_vfsv2r1_getquota(file,
+				(struct zqgetquota __user *)arg);
+	}
+
+	return -ENOTTY;
+}
+
+#ifdef CONFIG_COMPAT
+/* The structures are the same for the 32-bit callers */
+static long zfs_aquotf_vfsv2r1_compat_ioctl(struct file *file,
+					    unsigned int cmd,
+					    unsigned long arg)
+{
+	return zfs_aquotf_vfsv2r1_ioctl(file, cmd,
+					(unsigned long)compat_ptr(arg));
+}
+#endif /* CONFIG_COMPAT */
+
 const struct file_operations zfs_aquotf_vfsv2r1_file_operations = {
 	.open = &zfs_aquotf_vfsv2r1_open,
 	.read = &zfs_aquotf_vfsv2r1_read,
+	.poll = &zfs_aquotf_vfsv2r1_poll,
+	.fasync = &zfs_aquotf_vfsv2r1_fasync,
+	.unlocked_ioctl = &zfs_aquotf_vfsv2r1_ioctl,
+#ifdef CONFIG_COMPAT
+	.compat_ioctl = &zfs_aquotf_vfsv2r1_compat_ioctl,
+#endif /* CONFIG_COMPAT */
 	.release = &zfs_aquotf_vfsv2r1_release,
 };
 
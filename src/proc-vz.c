@@ -7,11 +7,14 @@
 
 #include <linux/fs_struct.h>
 #include <linux/sched.h>
+#include <linux/slab.h>
+#include <linux/rwsem.h>
 
 #include <linux/uaccess.h>
 #include <linux/ctype.h>
 
 #include "proc.h"
+#include "handle.h"
 
 #define DQBLOCK_SIZE 1024
 
@@ -19,8 +22,6 @@ static const char aquota_user[] = "aquota.user";
 static const char aquota_group[] = "aquota.group";
 static struct proc_dir_entry *glob_zfsquota_proc;
 
-extern struct quotactl_ops zfsquota_q_cops;
-
 
 #define INO_MASK	0xec000000UL
 static inline int zfs_aquot_inode_masked(unsigned long i_ino)
@@ -44,6 +45,118 @@ static inline int zfs_aquot_type(unsigned long i_ino)
 }
 
 
+/*
+ * Superblocks with zfs-quota enabled, kept up to date by the handle
+ * register/unregister so that readdir and getattr do not walk the mount
+ * trees. Simfs is mounted from the host, so the list is shared and the
+ * device permissions of a VE tell which entries it sees.
+ */
+struct zfs_aquot_de {
+	struct list_head list;
+	struct super_block *sb;
+	dev_t dev;
+	/* The list and the dentries looked up through the entry */
+	atomic_t refcnt;
+	/* Set once off the list, its dentries get looked up again */
+	int dead;
+};
+
+static LIST_HEAD(zfs_aquot_mntlist);
+static DECLARE_RWSEM(zfs_aquot_mntlist_sem);
+
+static void zfs_aquot_de_put(struct zfs_aquot_de *de)
+{
+	if (atomic_dec_and_test(&de->refcnt))
+		kfree(de);
+}
+
+void zqproc_vz_register_sb(struct super_block *sb)
+{
+	struct zfs_aquot_de *p;
+
+	p = kmalloc(sizeof(*p), GFP_KERNEL);
+	if (p == NULL) {
+		printk(KERN_WARNING "ZFSQUOTA: no memory to list sb %p "
+		       "in /proc/vz/vzaquota\n", sb);
+		return;
+	}
+	p->sb = sb;
+	p->dev = sb->s_dev;
+	atomic_set(&p->refcnt, 1);
+	p->dead = 0;
+
+	down_write(&zfs_aquot_mntlist_sem);
+	list_add_tail(&p->list, &zfs_aquot_mntlist);
+	up_write(&zfs_aquot_mntlist_sem);
+}
+
+void zqproc_vz_unregister_sb(struct super_block *sb)
+{
+	struct zfs_aquot_de *p;
+
+	down_write(&zfs_aquot_mntlist_sem);
+	list_for_each_entry(p, &zfs_aquot_mntlist, list) {
+		if (p->sb == sb) {
+			list_del(&p->list);
+			p->dead = 1;
+			goto out;
+		}
+	}
+	p = NULL;
+out:
+	up_write(&zfs_aquot_mntlist_sem);
+
+	if (p)
+		zfs_aquot_de_put(p);
+}
+
+/* Called in the VE exec env */
+static inline int zfs_aquot_visible(struct ve_struct *ve, dev_t dev)
+{
+	return ve_is_super(ve) ||
+	       !get_device_perms_ve(S_IFBLK, dev, FMODE_QUOTACTL);
+}
+
+/* The entry of dev, referenced */
+static struct zfs_aquot_de *zfs_aquot_find(dev_t dev)
+{
+	struct zfs_aquot_de *p;
+
+	down_read(&zfs_aquot_mntlist_sem);
+	list_for_each_entry(p, &zfs_aquot_mntlist, list) {
+		if (p->dev == dev) {
+			atomic_inc(&p->refcnt);
+			goto out;
+		}
+	}
+	p = NULL;
+out:
+	up_read(&zfs_aquot_mntlist_sem);
+	return p;
+}
+
+/*
+ * Dentries of /proc/vz/vzaquota/QID and the files in it hold the entry
+ * they were looked up through and stay valid while it is registered, so
+ * path walks hit the dcache and an unregister drops only its own.
+ */
+static int zfs_aquot_revalidate(struct dentry *dentry, struct nameidata *nd)
+{
+	struct zfs_aquot_de *de = dentry->d_fsdata;
+
+	return !ACCESS_ONCE(de->dead);
+}
+
+static void zfs_aquot_d_release(struct dentry *dentry)
+{
+	zfs_aquot_de_put(dentry->d_fsdata);
+}
+
+static struct dentry_operations zfs_aquot_dentry_operations = {
+	.d_revalidate = &zfs_aquot_revalidate,
+	.d_release = &zfs_aquot_d_release,
+};
+
 /* ----------------------------------------------------------------------
  *
  * /proc/vz/vzaquota/QID/aquota.* files
@@ -133,21 +246,13 @@ static int zfs_aquotq_lookset(struct inode *inode, void *data)
 	return 0;
 }
 
-static int zfs_aquotq_revalidate(struct dentry *vdentry, struct nameidata *nd)
-{
-	return 0;
-}
-
-static struct dentry_operations zfs_aquotq_dentry_operations = {
-	.d_revalidate = &zfs_aquotq_revalidate,
-};
-
 static struct dentry *zfs_aquotq_lookup(struct inode *dir,
 					struct dentry *dentry,
 					struct nameidata *nd)
 {
 	struct inode *inode;
 	struct zfs_aquotq_lookdata d;
+	struct zfs_aquot_de *de;
 	int k, fmt;
 
 	if (dentry->d_name.len == sizeof(aquota_user) - 1) {
@@ -168,15 +273,22 @@ static struct dentry *zfs_aquotq_lookup(struct inode *dir,
 	d.type = k;
 	d.fmt = fmt;
 
+	de = zfs_aquot_find(d.dev);
+	if (!de)
+		goto out;
+
 	inode = iget5_locked(dir->i_sb, dir->i_ino + k + fmt * 10 + 1,
 			     zfs_aquotq_looktest, zfs_aquotq_lookset, &d);
 
-	if (inode == NULL)
+	if (inode == NULL) {
+		zfs_aquot_de_put(de);
 		goto out;
+	}
 
 	if (inode->i_state & I_NEW)
 		unlock_new_inode(inode);
-	dentry->d_op = &zfs_aquotq_dentry_operations;
+	dentry->d_fsdata = de;
+	dentry->d_op = &zfs_aquot_dentry_operations;
 	d_add(dentry, inode);
 	return NULL;
 
@@ -184,38 +296,24 @@ out:
 	return ERR_PTR(-ENOENT);
 }
 
-int zqproc_reg_get_sb_type(struct inode *inode, struct super_block **psb,
-			   int *ptype);
-int zqproc_get_sb_type(struct inode *inode, struct super_block **psb,
-		       int *ptype)
+int zqproc_reg_get_handle_type(struct inode *inode, struct zqhandle **phandle,
+			       int *ptype);
+int zqproc_get_handle_type(struct inode *inode, struct zqhandle **phandle,
+			   int *ptype)
 {
-	int err, type;
-	struct block_device *bdev;
-	struct super_block *sb;
+	struct zqhandle *handle;
 
 	if (!zfs_aquot_inode_masked(inode->i_ino))
-		return zqproc_reg_get_sb_type(inode, psb, ptype);
-
-	err = -ENODEV;
-	bdev = bdget(zfs_aquot_getdev(inode->i_ino));
-	if (bdev == NULL)
-		goto out_err;
-	sb = get_super(bdev);
-	bdput(bdev);
-	if (sb == NULL)
-		goto out_err;
-	drop_super(sb);
-	type = zfs_aquot_type(inode->i_ino) - 1;
-
-	if (psb)
-		*psb = sb;
-	if (ptype)
-		*ptype = type;
+		return zqproc_reg_get_handle_type(inode, phandle, ptype);
 
-	err = 0;
+	handle = zqhandle_get_by_dev(zfs_aquot_getdev(inode->i_ino));
+	if (!handle)
+		return -ENODEV;
 
-out_err:
-	return err;
+	*phandle = handle;
+	if (ptype)
+		*ptype = zfs_aquot_type(inode->i_ino) - 1;
+	return 0;
 }
 
 static struct file_operations zfs_aquotq_file_operations = {
@@ -233,101 +331,20 @@ static struct inode_operations zfs_aquotq_inode_operations = {
  *
  * --------------------------------------------------------------------- */
 
-struct zfs_aquot_de {
-	struct list_head list;
-	struct vfsmount *mnt;
-};
-
-static int zfs_aquot_buildmntlist(struct ve_struct *ve, struct list_head *head)
-{
-	struct vfsmount *mnt;
-	struct path root;
-	struct zfs_aquot_de *p;
-	int err;
-
-	root = ve->root_path;
-	path_get(&root);
-
-	mnt = root.mnt;
-	spin_lock(&vfsmount_lock);
-	while (1) {
-		list_for_each_entry(p, head, list) {
-			if (p->mnt->mnt_sb == mnt->mnt_sb)
-				goto skip;
-		}
-
-		err = -ENOMEM;
-		p = kmalloc(sizeof(*p), GFP_ATOMIC);
-		if (p == NULL)
-			goto out;
-		p->mnt = mntget(mnt);
-		list_add_tail(&p->list, head);
-
-skip:
-		err = 0;
-		if (list_empty(&mnt->mnt_mounts)) {
-			while (1) {
-				if (mnt == root.mnt)
-					goto out;
-				if (mnt->mnt_child.next !=
-				    &mnt->mnt_parent->mnt_mounts)
-					break;
-				mnt = mnt->mnt_parent;
-			}
-			mnt = list_entry(mnt->mnt_child.next,
-					 struct vfsmount, mnt_child);
-		} else
-			mnt = list_entry(mnt->mnt_mounts.next,
-					 struct vfsmount, mnt_child);
-	}
-out:
-	spin_unlock(&vfsmount_lock);
-	path_put(&root);
-	return err;
-}
-
-static void zfs_aquot_releasemntlist(struct ve_struct *ve,
-				     struct list_head *head)
-{
-	struct zfs_aquot_de *p;
-
-	while (!list_empty(head)) {
-		p = list_entry(head->next, typeof(*p), list);
-		mntput(p->mnt);
-		list_del(&p->list);
-		kfree(p);
-	}
-}
 static int zfs_aquotd_readdir(struct file *file, void *data, filldir_t filler)
 {
 	struct ve_struct *ve, *old_ve;
-	struct list_head mntlist;
 	struct zfs_aquot_de *de;
-	struct super_block *sb;
 	loff_t i, n;
 	char buf[24];
-	int l, err;
+	int l;
 
 	i = 0;
 	n = file->f_pos;
 
-	INIT_LIST_HEAD(&mntlist);
 	ve = file->f_dentry->d_sb->s_type->owner_env;
 	old_ve = set_exec_env(ve);
 
-	/*
-	 * The only reason of disabling readdir for the host system is that
-	 * this readdir can be slow and CPU consuming with large number of VPSs
-	 * (or just mount points).
-	 */
-	err = ve_is_super(ve);
-
-	if (!err) {
-		err = zfs_aquot_buildmntlist(ve, &mntlist);
-		if (err)
-			goto out_err;
-	}
-
 	if (i >= n) {
 		if ((*filler) (data, ".", 1, i,
 			       file->f_dentry->d_inode->i_ino, DT_DIR))
@@ -342,31 +359,26 @@ static int zfs_aquotd_readdir(struct file *file, void *data, filldir_t filler)
 	}
 	i++;
 
-	list_for_each_entry(de, &mntlist, list) {
-		sb = de->mnt->mnt_sb;
-		if (get_device_perms_ve(S_IFBLK, sb->s_dev, FMODE_QUOTACTL))
-			continue;
-
-		if (sb->s_qcop != &zfsquota_q_cops)
+	down_read(&zfs_aquot_mntlist_sem);
+	list_for_each_entry(de, &zfs_aquot_mntlist, list) {
+		if (!zfs_aquot_visible(ve, de->dev))
 			continue;
 
 		i++;
 		if (i <= n)
 			continue;
 
-		l = sprintf(buf, "%08x", new_encode_dev(sb->s_dev));
+		l = sprintf(buf, "%08x", new_encode_dev(de->dev));
 		if ((*filler) (data, buf, l, i - 1,
-			       zfs_aquot_getino(sb->s_dev, 0), DT_DIR))
+			       zfs_aquot_getino(de->dev, 0), DT_DIR))
 			break;
 	}
+	up_read(&zfs_aquot_mntlist_sem);
 
 out_fill:
-	err = 0;
 	file->f_pos = i;
-out_err:
-	zfs_aquot_releasemntlist(ve, &mntlist);
 	(void) set_exec_env(old_ve);
-	return err;
+	return 0;
 }
 
 static int zfs_aquotd_looktest(struct inode *inode, void *data)
@@ -397,19 +409,13 @@ static struct dentry *zfs_aquotd_lookup(struct inode *dir,
 {
 	struct ve_struct *ve, *old_ve;
 	const unsigned char *s;
+	struct zfs_aquot_de *de;
 	int l;
 	dev_t dev;
 	struct inode *inode;
 
 	ve = dir->i_sb->s_type->owner_env;
 	old_ve = set_exec_env(ve);
-	/*
-	 * Lookup is much lighter than readdir, so it can be allowed for the
-	 * host system.  But it would be strange to be able to do lookup only
-	 * without readdir...
-	 */
-	if (ve_is_super(ve))
-		goto out;
 
 	dev = 0;
 	l = dentry->d_name.len;
@@ -430,18 +436,26 @@ static struct dentry *zfs_aquotd_lookup(struct inode *dir,
 	}
 	dev = new_decode_dev(dev);
 
-	if (get_device_perms_ve(S_IFBLK, dev, FMODE_QUOTACTL))
+	if (!zfs_aquot_visible(ve, dev))
+		goto out;
+
+	de = zfs_aquot_find(dev);
+	if (!de)
 		goto out;
 
 	inode = iget5_locked(dir->i_sb, zfs_aquot_getino(dev, 0),
 			     zfs_aquotd_looktest, zfs_aquotd_lookset,
 			     (void *)(unsigned long)dev);
-	if (inode == NULL)
+	if (inode == NULL) {
+		zfs_aquot_de_put(de);
 		goto out;
+	}
 
 	if (inode->i_state & I_NEW)
 		unlock_new_inode(inode);
 
+	dentry->d_fsdata = de;
+	dentry->d_op = &zfs_aquot_dentry_operations;
 	d_add(dentry, inode);
 	(void)set_exec_env(old_ve);
 	return NULL;
@@ -455,25 +469,18 @@ static int zfs_aquotd_getattr(struct vfsmount *mnt, struct dentry *dentry,
 			      struct kstat *stat)
 {
 	struct ve_struct *ve, *old_ve;
-	struct list_head mntlist, *pos;
+	struct zfs_aquot_de *de;
 
 	generic_fillattr(dentry->d_inode, stat);
 	ve = dentry->d_sb->s_type->owner_env;
 
-	/*
-	 * The only reason of disabling getattr for the host system is that
-	 * this getattr can be slow and CPU consuming with large number of VPSs
-	 * (or just mount points).
-	 */
-	if (ve_is_super(ve))
-		return 0;
-
-	INIT_LIST_HEAD(&mntlist);
 	old_ve = set_exec_env(ve);
-	if (!zfs_aquot_buildmntlist(ve, &mntlist))
-		list_for_each(pos, &mntlist)
-		    stat->nlink++;
-	zfs_aquot_releasemntlist(ve, &mntlist);
+	down_read(&zfs_aquot_mntlist_sem);
+	list_for_each_entry(de, &zfs_aquot_mntlist, list) {
+		if (zfs_aquot_visible(ve, de->dev))
+			stat->nlink++;
+	}
+	up_read(&zfs_aquot_mntlist_sem);
 	(void)set_exec_env(old_ve);
 	return 0;
 }
@@ -494,13 +501,15 @@ int __init zfsquota_proc_vz_init(void)
 	    create_proc_entry("vzaquota", S_IFDIR | S_IRUSR | S_IXUSR,
 			      glob_proc_vz_dir
 			    );
+	if (!glob_zfsquota_proc)
+		return -ENOMEM;
 	glob_zfsquota_proc->proc_iops = &zfs_aquotd_inode_operations;
 	glob_zfsquota_proc->proc_fops = &zfs_aquotd_file_operations;
 
 	return 0;
 }
 
-void __exit zfsquota_proc_vz_exit(void)
+void zfsquota_proc_vz_exit(void)
 {
 	remove_proc_entry("vzaquota", glob_proc_vz_dir);
 }
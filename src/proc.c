@@ -4,7 +4,11 @@
 #include <linux/proc_fs.h>
 
 #include <linux/stat.h>
+#include <linux/seq_file.h>
+#include <linux/jiffies.h>
 
+#include "build.h"
+#include "handle.h"
 #include "tree.h"
 #include "proc.h"
 #include "proc-compat.h"
@@ -16,25 +20,27 @@ static const char quota_group[] = "quota.group";
 static const char aquota_user[] = "aquota.user";
 static const char aquota_group[] = "aquota.group";
 
-int zqproc_ve_get_sb_type(struct inode *inode, struct super_block **psb,
-		       int *ptype);
-
 #ifndef CONFIG_VE
-int zqproc_get_sb_type(struct inode *inode, struct super_block **psb,
-		       int *ptype)
-#else /* #ifndef CONFIG_VE */
-int zqproc_reg_get_sb_type(struct inode *inode, struct super_block **psb,
+int zqproc_get_handle_type(struct inode *inode, struct zqhandle **phandle,
 			   int *ptype)
+#else /* #ifndef CONFIG_VE */
+int zqproc_reg_get_handle_type(struct inode *inode, struct zqhandle **phandle,
+			       int *ptype)
 #endif /* #ifndef #else CONFIG_VE */
 {
-	if (psb)
-		*psb = (struct super_block *)proc_get_parent_data(inode);
+	struct zqhandle *handle;
+
+	handle = zqhandle_get_by_sb(proc_get_parent_data(inode));
+	if (!handle)
+		return -ENOENT;
+
+	*phandle = handle;
 	if (ptype)
 		*ptype = (int)(unsigned long)PDE_DATA(inode);
 	return 0;
 }
 
-extern struct file_operations zfs_aquotf_vfsv2r1_file_operations;
+static const struct file_operations zqproc_over_fops;
 
 struct proc_dir_entry* zqproc_register_handle(struct super_block *sb)
 {
@@ -53,6 +59,33 @@ struct proc_dir_entry* zqproc_register_handle(struct super_block *sb)
 			 &zfs_aquotf_vfsv2r1_file_operations,
 			 (void *)GRPQUOTA);
 
+	proc_create_data("usage.bin", S_IRUSR, dev_dir,
+			 &zqproc_usage_file_operations, NULL);
+
+	proc_create_data("delta.bin", S_IRUSR, dev_dir,
+			 &zqproc_delta_file_operations, NULL);
+
+	proc_create_data("history", S_IRUSR, dev_dir,
+			 &zqproc_history_file_operations, NULL);
+
+	proc_create_data("top.user", S_IRUSR | S_IWUSR, dev_dir,
+			 &zqproc_top_file_operations, (void *)USRQUOTA);
+
+	proc_create_data("top.group", S_IRUSR | S_IWUSR, dev_dir,
+			 &zqproc_top_file_operations, (void *)GRPQUOTA);
+
+	proc_create_data("report.user", S_IRUSR, dev_dir,
+			 &zqproc_report_file_operations, (void *)USRQUOTA);
+
+	proc_create_data("report.group", S_IRUSR, dev_dir,
+			 &zqproc_report_file_operations, (void *)GRPQUOTA);
+
+	proc_create_data("over", S_IRUSR, dev_dir, &zqproc_over_fops, NULL);
+
+#ifdef CONFIG_VE
+	zqproc_vz_register_sb(sb);
+#endif /* #ifdef CONFIG_VE */
+
 	return dev_dir;
 }
 
@@ -61,18 +94,222 @@ int zqproc_unregister_handle(struct super_block *sb)
 	char buf[32];
 	sprintf(buf, "%08x", new_encode_dev(sb->s_dev));
 
+#ifdef CONFIG_VE
+	zqproc_vz_unregister_sb(sb);
+#endif /* #ifdef CONFIG_VE */
+
 	return remove_proc_subtree(buf, zfsquota_proc_root);
 }
 
+/* /proc/zfsquota/builds, see build.c */
+static int zqproc_builds_show(struct seq_file *m, void *v)
+{
+	struct zqbuild_stats stats;
+	struct zqtree_plan_stats plan;
+
+	zqbuild_get_stats(&stats);
+	seq_printf(m, "running %u\n", stats.running);
+	seq_printf(m, "queued %u\n", stats.queued);
+	seq_printf(m, "max_queued %u\n", stats.max_queued);
+	seq_printf(m, "admitted %lu\n", stats.admitted);
+	seq_printf(m, "waited %lu\n", stats.waited);
+	seq_printf(m, "wait_ms %lu\n", stats.wait_ms);
+	seq_printf(m, "max_wait_ms %lu\n", stats.max_wait_ms);
+
+	zqtree_get_plan_stats(&plan);
+	seq_printf(m, "plan_scan %lu\n", plan.scan);
+	seq_printf(m, "plan_point %lu\n", plan.point);
+	seq_printf(m, "plan_hybrid %lu\n", plan.hybrid);
+	seq_printf(m, "scanned %lu\n", plan.scanned);
+	seq_printf(m, "lookups %lu\n", plan.lookups);
+	return 0;
+}
+
+/*
+ * One line per mount out of the cached trees, "-" for a type that has no
+ * built one. Nothing is built for it unless summary_build is set.
+ */
+static int summary_build;
+module_param(summary_build, int, 0644);
+
+static void zqproc_summary_type(struct seq_file *m, struct zqhandle *handle,
+				int type)
+{
+	struct zqtree_summary summary;
+
+	if (zqhandle_get_summary(handle, type, summary_build, &summary)) {
+		seq_puts(m, " - - - -");
+		return;
+	}
+
+	seq_printf(m, " %lu %llu %lu %u", summary.entries,
+		   (unsigned long long)summary.space_used, summary.over,
+		   jiffies_to_msecs(summary.age) / MSEC_PER_SEC);
+}
+
+static int zqproc_summary_handle(struct zqhandle *handle, void *arg)
+{
+	struct seq_file *m = arg;
+
+	seq_printf(m, "%08x", new_encode_dev(zqhandle_dev(handle)));
+	zqproc_summary_type(m, handle, USRQUOTA);
+	zqproc_summary_type(m, handle, GRPQUOTA);
+	seq_putc(m, '\n');
+	return 0;
+}
+
+static int zqproc_summary_show(struct seq_file *m, void *v)
+{
+	seq_puts(m, "dev usr_qids usr_used usr_over usr_age "
+		 "grp_qids grp_used grp_over grp_age\n");
+	zqhandle_for_each(zqproc_summary_handle, m);
+	return 0;
+}
+
+static int zqproc_summary_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, zqproc_summary_show, NULL);
+}
+
+static const struct file_operations zqproc_summary_fops = {
+	.owner = THIS_MODULE,
+	.open = zqproc_summary_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+/*
+ * Quota ids at or over over_percent of a limit, out of the index the build
+ * keeps. Host-wide from the cached trees like the summary, per mount the
+ * trees are built within the rebuild rate.
+ */
+struct zqproc_over {
+	struct seq_file		*m;
+	struct zqhandle		*handle;
+	int			type;
+};
+
+static int zqproc_over_entry(const struct zqdata *qd, void *arg)
+{
+	struct zqproc_over *over = arg;
+	unsigned long long obj_used = 0, obj_quota = 0;
+
+#ifdef HAVE_ZFS_OBJECT_QUOTA
+	obj_used = qd->obj_used;
+	obj_quota = qd->obj_quota;
+#endif /* HAVE_ZFS_OBJECT_QUOTA */
+
+	seq_printf(over->m, "%08x %s %u %llu %llu %llu %llu\n",
+		   new_encode_dev(zqhandle_dev(over->handle)),
+		   over->type == USRQUOTA ? "usr" : "grp", qd->qid,
+		   (unsigned long long)qd->space_used,
+		   (unsigned long long)qd->space_quota, obj_used, obj_quota);
+	return 0;
+}
+
+static void zqproc_over_handle(struct seq_file *m, struct zqhandle *handle,
+			       int build)
+{
+	struct zqproc_over over = {
+		.m = m,
+		.handle = handle,
+	};
+
+	for (over.type = USRQUOTA; over.type <= GRPQUOTA; over.type++)
+		zqhandle_for_each_over(handle, over.type, build,
+				       zqproc_over_entry, &over);
+}
+
+static const char zqproc_over_header[] =
+	"dev type qid space_used space_quota obj_used obj_quota\n";
+
+static int zqproc_over_all_handle(struct zqhandle *handle, void *arg)
+{
+	zqproc_over_handle(arg, handle, summary_build);
+	return 0;
+}
+
+static int zqproc_over_all_show(struct seq_file *m, void *v)
+{
+	seq_puts(m, zqproc_over_header);
+	zqhandle_for_each(zqproc_over_all_handle, m);
+	return 0;
+}
+
+static int zqproc_over_all_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, zqproc_over_all_show, NULL);
+}
+
+static const struct file_operations zqproc_over_all_fops = {
+	.owner = THIS_MODULE,
+	.open = zqproc_over_all_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+static int zqproc_over_show(struct seq_file *m, void *v)
+{
+	struct zqhandle *handle;
+	int err;
+
+	err = zqproc_get_handle_type(m->private, &handle, NULL);
+	if (err)
+		return err;
+
+	seq_puts(m, zqproc_over_header);
+	zqproc_over_handle(m, handle, 1);
+	zqhandle_put(handle);
+	return 0;
+}
+
+static int zqproc_over_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, zqproc_over_show, inode);
+}
+
+static const struct file_operations zqproc_over_fops = {
+	.owner = THIS_MODULE,
+	.open = zqproc_over_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+static int zqproc_builds_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, zqproc_builds_show, NULL);
+}
+
+static const struct file_operations zqproc_builds_fops = {
+	.owner = THIS_MODULE,
+	.open = zqproc_builds_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
 int __init zfsquota_proc_init(void)
 {
 	zfsquota_proc_root = proc_mkdir_data("zfsquota", S_IRWXU, NULL, NULL);
 	if (!zfsquota_proc_root)
 		return -ENOMEM;
+
+	if (!proc_create_data("builds", S_IRUSR, zfsquota_proc_root,
+			      &zqproc_builds_fops, NULL) ||
+	    !proc_create_data("summary", S_IRUSR, zfsquota_proc_root,
+			      &zqproc_summary_fops, NULL) ||
+	    !proc_create_data("over", S_IRUSR, zfsquota_proc_root,
+			      &zqproc_over_all_fops, NULL)) {
+		remove_proc_subtree("zfsquota", NULL);
+		return -ENOMEM;
+	}
 	return 0;
 }
 
-void __exit zfsquota_proc_exit(void)
+void zfsquota_proc_exit(void)
 {
 	remove_proc_subtree("zfsquota", NULL);
 }
@@ -3,11 +3,25 @@
 #define PROC_H_INCLUDED
 
 struct proc_dir_entry;
+struct zqhandle;
 
 struct proc_dir_entry* zqproc_register_handle(struct super_block *sb);
 int zqproc_unregister_handle(struct super_block *sb);
 
-int zqproc_get_sb_type(struct inode *, struct super_block **,
-		       int *);
+#ifdef CONFIG_VE
+/* Superblocks listed in /proc/vz/vzaquota */
+void zqproc_vz_register_sb(struct super_block *sb);
+void zqproc_vz_unregister_sb(struct super_block *sb);
+#endif /* #ifdef CONFIG_VE */
+
+/* Returns referenced handle and quota type of a proc quota file */
+int zqproc_get_handle_type(struct inode *, struct zqhandle **, int *);
+
+extern const struct file_operations zfs_aquotf_vfsv2r1_file_operations;
+extern const struct file_operations zqproc_usage_file_operations;
+extern const struct file_operations zqproc_top_file_operations;
+extern const struct file_operations zqproc_report_file_operations;
+extern const struct file_operations zqproc_delta_file_operations;
+extern const struct file_operations zqproc_history_file_operations;
 
 #endif /* PROC_H_INCLUDED */
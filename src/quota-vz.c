@@ -11,6 +11,11 @@ static unsigned int vz_qid_limit = 128 * 1024;
 
 module_param(vz_qid_limit, uint, 0644);
 
+/* Taken by the containers' mounts at quota on */
+static int vz_prefetch = 1;
+
+module_param(vz_prefetch, int, 0644);
+
 static int zfsquota_notifier_call(struct vnotifier_block *self,
 				  unsigned long n, void *data, int err)
 {
@@ -20,7 +25,8 @@ static int zfsquota_notifier_call(struct vnotifier_block *self,
 	switch (n) {
 	case VIRTINFO_QUOTA_ON: {
 		struct zfsquota_options zfsq_opts = {
-			.qid_limit = vz_qid_limit
+			.qid_limit = vz_qid_limit,
+			.prefetch = vz_prefetch,
 		};
 		status = zfsquota_setup_quota_opts(viq->super, &zfsq_opts);
 		break;
@@ -42,17 +48,21 @@ struct vnotifier_block zfsquota_notifier_block = {
 };
 
 int __init zfsquota_proc_vz_init(void);
-void __exit zfsquota_proc_vz_exit(void);
+void zfsquota_proc_vz_exit(void);
 
 int __init zfsquota_vz_init(void)
 {
-	zfsquota_proc_vz_init();
+	int err;
+
+	err = zfsquota_proc_vz_init();
+	if (err)
+		return err;
 	virtinfo_notifier_register(VITYPE_QUOTA, &zfsquota_notifier_block);
 
 	return 0;
 }
 
-void __exit zfsquota_vz_exit(void)
+void zfsquota_vz_exit(void)
 {
 	zfsquota_proc_vz_exit();
 	virtinfo_notifier_unregister(VITYPE_QUOTA, &zfsquota_notifier_block);
@@ -238,7 +238,7 @@ int zfsquota_setup_quota_opts(struct super_block *sb,
 	fsname = sb->s_root->d_inode->i_sb->s_type->name;
 #endif /* #else #ifdef CONFIG_VE */
 
-	if (strcmp(fsname, "zfs")) {
+	if (strcmp(fsname, "zfs") && !(zfsq_opts && zfsq_opts->synth)) {
 		return -ENOSYS;
 	}
 
@@ -278,30 +278,69 @@ int zfsquota_teardown_quota(struct super_block *sb)
 }
 EXPORT_SYMBOL(zfsquota_teardown_quota);
 
+/* The exits are not __exit, a failed init unwinds with them */
 int __init zfsquota_proc_init(void);
-void __exit zfsquota_proc_exit(void);
+void zfsquota_proc_exit(void);
 int __init zfsquota_tree_init(void);
-int __init zfsquota_tree_exit(void);
+void zfsquota_tree_exit(void);
 int __init zfsquota_vz_init(void);
-int __init zfsquota_vz_exit(void);
+void zfsquota_vz_exit(void);
+int __init zqhandle_init(void);
+void zqhandle_exit(void);
+int __init zqevents_init(void);
+void zqevents_exit(void);
 
 static int __init zfsquota_init(void)
 {
-	zfsquota_proc_init();
-	zfsquota_tree_init();
+	int err;
+
+	err = zfsquota_proc_init();
+	if (err)
+		goto out;
+	err = zfsquota_tree_init();
+	if (err)
+		goto out_proc;
+	err = zqhandle_init();
+	if (err)
+		goto out_tree;
+	err = zqevents_init();
+	if (err)
+		goto out_handle;
 
 #ifdef CONFIG_VE
-	zfsquota_vz_init();
+	err = zfsquota_vz_init();
+	if (err)
+		goto out_events;
 #endif /* #ifdef CONFIG_VE */
 
-	register_quota_format(&zfs_quota_empty_vfsv2_format);
+	err = register_quota_format(&zfs_quota_empty_vfsv2_format);
+	if (err)
+		goto out_vz;
 	return 0;
+
+out_vz:
+#ifdef CONFIG_VE
+	zfsquota_vz_exit();
+out_events:
+#endif /* #ifdef CONFIG_VE */
+	zqevents_exit();
+out_handle:
+	zqhandle_exit();
+out_tree:
+	zfsquota_tree_exit();
+out_proc:
+	zfsquota_proc_exit();
+out:
+	return err;
 }
 
 static void __exit zfsquota_exit(void)
 {
+	zqevents_exit();
 	zfsquota_proc_exit();
+	/* Flushes the builds, which still get and put handles */
 	zfsquota_tree_exit();
+	zqhandle_exit();
 
 #ifdef CONFIG_VE
 	zfsquota_vz_exit();
@@ -2,8 +2,14 @@
 #ifndef QUOTA_H_INCLUDED
 #define QUOTA_H_INCLUDED
 
+struct zfs_synth_params;
+
 struct zfsquota_options {
 	unsigned int	qid_limit;
+	/* Opening one quota file starts building the other type */
+	int		prefetch;
+	/* Serve from the synthetic backend rather than ZFS when set */
+	struct zfs_synth_params	*synth;
 };
 
 int zfsquota_setup_quota(struct super_block *sb);
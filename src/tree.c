@@ -6,7 +6,15 @@
 #include <linux/sched.h>
 #include <linux/mount.h>
 #include <linux/wait.h>
-
+#include <linux/list.h>
+#include <linux/jiffies.h>
+#include <linux/workqueue.h>
+#include <linux/mm.h>
+#include <linux/mempool.h>
+#include <linux/vmalloc.h>
+#include <linux/math64.h>
+
+#include "build.h"
 #include "handle.h"
 #include "proc.h"
 #include "radix-tree-iter.h"
@@ -15,26 +23,168 @@
 
 //#error "TODO fix mount.zqfs, add limits (probably via ugidlimit by vzdquota) and recheck the whole thing"
 
-/* ZFS QUOTA radix-tree key qid -> value quota_data */
+/**
+ * Everything a snapshot allocates during the build, the quota data and
+ * the block tree nodes, comes from its arena of page chunks and goes away
+ * with it at once. Chunks are taken from a mempool when the page allocator
+ * fails, so that builds under memory pressure don't fail halfway.
+ */
+#define ZQARENA_ORDER		2
+#define ZQARENA_CHUNK		(PAGE_SIZE << ZQARENA_ORDER)
+
+/* Chunks kept in reserve, set at module load */
+static unsigned int arena_reserve = 64;
+module_param(arena_reserve, uint, 0444);
+
+static mempool_t *zqarena_pool;
+
+struct zqarena_chunk {
+	struct zqarena_chunk	*next;
+	struct page		*page;
+};
+
+struct zqarena {
+	struct zqarena_chunk	*chunks;
+	char			*pos, *end;
+};
+
+/* Zeroed memory, only the owner of the arena allocates from it */
+static void *zqarena_alloc(struct zqarena *arena, size_t size)
+{
+	struct zqarena_chunk *chunk;
+	struct page *page;
+	void *ptr;
+
+	size = ALIGN(size, sizeof(void *));
+	if (!arena->pos || (size_t)(arena->end - arena->pos) < size) {
+		BUG_ON(size > ZQARENA_CHUNK - sizeof(*chunk));
+
+		page = alloc_pages(GFP_NOFS | __GFP_NOWARN, ZQARENA_ORDER);
+		if (!page)
+			page = mempool_alloc(zqarena_pool, GFP_NOWAIT);
+		if (!page)
+			return NULL;
+
+		chunk = page_address(page);
+		chunk->page = page;
+		chunk->next = arena->chunks;
+		arena->chunks = chunk;
+		arena->pos = (char *)(chunk + 1);
+		arena->end = (char *)chunk + ZQARENA_CHUNK;
+	}
 
-struct kmem_cache *quota_data_cachep = NULL;
+	ptr = arena->pos;
+	arena->pos += size;
+	memset(ptr, 0, size);
+	return ptr;
+}
+
+/* Frees nr chunks at most, 1 once all are gone */
+static int zqarena_release(struct zqarena *arena, unsigned int nr)
+{
+	struct zqarena_chunk *chunk;
+
+	while (nr-- && (chunk = arena->chunks)) {
+		arena->chunks = chunk->next;
+		/* Refills the reserve first */
+		mempool_free(chunk->page, zqarena_pool);
+	}
+	if (arena->chunks)
+		return 0;
+
+	arena->pos = arena->end = NULL;
+	return 1;
+}
+
+/**
+ * A build goes in passes of at most build_slice_ms each, so that a tree of
+ * millions of ids doesn't hold the CPU for seconds. The state is kept in
+ * the tree between the passes: the property iterator goes on from its
+ * cookie and the block tree from the next qid. A reader interrupted by a
+ * signal hands the rest of the build to a worker, the tree is not left
+ * half built for the others.
+ */
+static unsigned int build_slice_ms = 10;
+module_param(build_slice_ms, uint, 0644);
+
+/* Entries between the checks of the budget */
+#define ZQTREE_BUILD_BATCH	256
+
+enum {
+	ZQTREE_BUILD_PROPS,
+	ZQTREE_BUILD_BLOCKS,
+};
 
 struct blktree_root;
 
+struct zqtree_build {
+	struct zqbuild_ticket	ticket;
+	struct work_struct	work;
+	struct work_struct	prefetch;
+	/* Of the last prefetch request, the worker can't tell */
+	int			from_host;
+	int			stage;
+
+	zfs_prop_list_t		*prop;
+	unsigned int		nprop;
+	zfs_prop_iter_t		iter;
+	int			iterating;
+
+	/* Props looked up qid by qid, bit per position in the list */
+	unsigned int		point;
+	unsigned long		scanned, lookups;
+
+	struct blktree_root	*root;
+	qid_t			next_qid;
+
+	unsigned long		deadline;
+	unsigned int		n;
+};
+
+/* ZFS QUOTA radix-tree key qid -> value quota_data */
+
+/* Largest entries by a key, a min heap while building, descending after */
+struct zqtree_top {
+	struct zqdata		**heap;
+	unsigned int		nr, size;
+};
+
 struct zqtree {
 	int			type;
 	unsigned int		qid_limit;
+	/* ZFS_CAP_* of the dataset at the build, ZQDATA_SPACE_SIZE without obj */
+	unsigned int		caps;
 
-	struct zqhandle		*handle;
+	struct zqobjset		*objset;
 
 	atomic_t		refcnt;
 	atomic_t		state;
 
 	struct radix_tree_root	radix;
 	struct blktree_root	*blktree_root;
+	struct zqarena		arena;
+
+	/* Counted by the build for the whole tree */
+	struct zqtree_summary	summary;
+	struct zqtree_top	top[ZQTREE_TOP_NR];
+	/* Entries over_percent of a limit or past it, in qid order */
+	struct zqdata		**over;
+	unsigned int		nr_over, over_size;
+	unsigned long		built;
+	uint64_t		generation;
+	/* Wall clock of the build and the objset event that published it */
+	struct timespec		mtime;
+	unsigned long		event;
+
+	struct list_head	reclaim;
+
+	struct zqtree_build	build;
 };
 
-struct zqtree *zqtree_new(struct zqhandle *handle, int type,
+static void zqtree_build_work(struct work_struct *work);
+static void zqtree_prefetch_work(struct work_struct *work);
+
+struct zqtree *zqtree_new(struct zqobjset *objset, int type,
 			  unsigned int qid_limit)
 {
 	struct zqtree *qt;
@@ -46,11 +196,13 @@ struct zqtree *zqtree_new(struct zqhandle *handle, int type,
 		return ERR_PTR(-ENOMEM);
 
 	qt->type = type;
-	qt->handle = zqhandle_get(handle);
+	qt->objset = zqobjset_get(objset);
 	qt->qid_limit = qid_limit;
 	atomic_set(&qt->refcnt, 1);
 	atomic_set(&qt->state, ZQTREE_EMPTY);
 	INIT_RADIX_TREE(&qt->radix, GFP_KERNEL);
+	INIT_WORK(&qt->build.work, zqtree_build_work);
+	INIT_WORK(&qt->build.prefetch, zqtree_prefetch_work);
 
 	return qt;
 }
@@ -63,22 +215,460 @@ struct zqtree *zqtree_get(struct zqtree *qt)
 	return qt;
 }
 
-static int zqtree_quota_tree_destroy(struct zqtree *quota_tree);
+static int zqtree_quota_tree_destroy(struct zqtree *quota_tree,
+				     unsigned int nr);
 static int blktree_free(struct blktree_root *root);
 
+/**
+ * Freeing a big tree takes a while, so the last put only queues it and
+ * the reclaim worker frees it in batches, rescheduling in between. Every
+ * tree goes this way, whether the cache, the shrinker or a reader let it
+ * go.
+ */
+#define ZQTREE_RECLAIM_BATCH	1024
+
+static struct workqueue_struct *zqtree_reclaim_wq;
+static LIST_HEAD(zqtree_reclaim_list);
+static DEFINE_SPINLOCK(zqtree_reclaim_lock);
+
+/* A batch of the entries, then of the arena. 1 once nothing is left */
+static int zqtree_reclaim_batch(struct zqtree *qt)
+{
+	int i;
+
+	if (!zqtree_quota_tree_destroy(qt, ZQTREE_RECLAIM_BATCH) ||
+	    !zqarena_release(&qt->arena, ZQTREE_RECLAIM_BATCH))
+		return 0;
+
+	blktree_free(qt->blktree_root);
+	for (i = 0; i < ZQTREE_TOP_NR; i++)
+		kfree(qt->top[i].heap);
+	kfree(qt->over);
+	zqobjset_put(qt->objset);
+	return 1;
+}
+
+static void zqtree_reclaim(struct work_struct *work)
+{
+	struct zqtree *qt;
+
+	while (1) {
+		/* Only the worker takes them off, puts add at the tail */
+		spin_lock(&zqtree_reclaim_lock);
+		qt = list_empty(&zqtree_reclaim_list) ? NULL :
+		    list_first_entry(&zqtree_reclaim_list, struct zqtree,
+				     reclaim);
+		spin_unlock(&zqtree_reclaim_lock);
+
+		if (!qt)
+			break;
+
+		if (zqtree_reclaim_batch(qt)) {
+			spin_lock(&zqtree_reclaim_lock);
+			list_del(&qt->reclaim);
+			spin_unlock(&zqtree_reclaim_lock);
+			kfree(qt);
+		}
+		cond_resched();
+	}
+}
+
+static DECLARE_WORK(zqtree_reclaim_work, zqtree_reclaim);
+
 void zqtree_put(struct zqtree *qt)
 {
 	if (unlikely(!qt))
 		return;
 
 	if (atomic_dec_and_test(&qt->refcnt)) {
-		zqhandle_unref_tree(qt->handle, qt);
-		zqhandle_put(qt->handle);
+		spin_lock(&zqtree_reclaim_lock);
+		list_add_tail(&qt->reclaim, &zqtree_reclaim_list);
+		spin_unlock(&zqtree_reclaim_lock);
+		queue_work(zqtree_reclaim_wq, &zqtree_reclaim_work);
+	}
+}
+
+void zqtree_close(struct zqtree *qt)
+{
+	if (unlikely(!qt))
+		return;
+
+	zqobjset_tree_closed(qt->objset, qt->type, qt);
+	zqtree_put(qt);
+}
+
+/* Nobody but the cache holds the tree */
+int zqtree_idle(struct zqtree *qt)
+{
+	return atomic_read(&qt->refcnt) == 1;
+}
+
+int zqtree_built(struct zqtree *qt)
+{
+	return atomic_read(&qt->state) == 1;
+}
+
+static inline size_t zqtree_entry_size(struct zqtree *qt)
+{
+	return qt->caps & ZFS_CAP_OBJQUOTA ? sizeof(struct zqdata) :
+	    ZQDATA_SPACE_SIZE;
+}
+
+/* Full struct out of a possibly short entry */
+static void zqtree_copy_entry(struct zqtree *qt, struct zqdata *qd,
+			      const struct zqdata *entry)
+{
+	memset(qd, 0, sizeof(*qd));
+	memcpy(qd, entry, zqtree_entry_size(qt));
+}
+
+/* Percent of a limit that counts as over it, for the summary and the index */
+static unsigned int over_percent = 100;
+module_param(over_percent, uint, 0644);
+
+static int zqtree_over_limit(uint64_t used, uint64_t limit)
+{
+	uint64_t q;
+
+	if (!limit)
+		return 0;
+
+	q = div64_u64(limit, 100);
+	return used >= q * over_percent +
+	    div64_u64((limit - q * 100) * over_percent, 100);
+}
+
+static int zqtree_entry_over(const struct zqdata *qd)
+{
+	return zqtree_over_limit(qd->space_used, qd->space_quota)
+#ifdef HAVE_ZFS_OBJECT_QUOTA
+	    || zqtree_over_limit(qd->obj_used, qd->obj_quota)
+#endif /* HAVE_ZFS_OBJECT_QUOTA */
+	    ;
+}
+
+static void zqtree_summary_add(struct zqtree *qt,
+			       struct zqtree_summary *summary,
+			       const struct zqdata *entry)
+{
+	struct zqdata qd;
+
+	zqtree_copy_entry(qt, &qd, entry);
+
+	summary->entries++;
+	summary->space_used += qd.space_used;
+	if (zqtree_entry_over(&qd))
+		summary->over++;
+}
+
+/* Built along with the summary, so the over entries cost no walk later */
+static int zqtree_over_add(struct zqtree *qt, struct zqdata *entry)
+{
+	struct zqdata qd, **over;
+	unsigned int size;
+
+	zqtree_copy_entry(qt, &qd, entry);
+	if (!zqtree_entry_over(&qd))
+		return 0;
 
-		blktree_free(qt->blktree_root);
-		zqtree_quota_tree_destroy(qt);
-		kfree(qt);
+	if (qt->nr_over == qt->over_size) {
+		size = qt->over_size ? qt->over_size * 2 : 16;
+		over = krealloc(qt->over, size * sizeof(*over),
+				GFP_NOFS | __GFP_NOWARN);
+		if (!over)
+			return -ENOMEM;
+		qt->over = over;
+		qt->over_size = size;
 	}
+	qt->over[qt->nr_over++] = entry;
+
+	return 0;
+}
+
+int zqtree_for_each_over(struct zqtree *qt, unsigned int qid_limit,
+			 int (*fn)(const struct zqdata *qd, void *arg),
+			 void *arg)
+{
+	struct zqdata qd;
+	unsigned int i;
+	int err;
+
+	if (atomic_read(&qt->state) != 1)
+		return -EAGAIN;
+
+	for (i = 0; i < qt->nr_over && qt->over[i]->qid < qid_limit; i++) {
+		zqtree_copy_entry(qt, &qd, qt->over[i]);
+		err = fn(&qd, arg);
+		if (err)
+			return err;
+	}
+
+	return 0;
+}
+
+int zqtree_summary(struct zqtree *qt, unsigned int qid_limit,
+		   struct zqtree_summary *summary)
+{
+	my_radix_tree_iter_t iter;
+	struct zqdata *qd;
+
+	if (atomic_read(&qt->state) != 1)
+		return -EAGAIN;
+
+	if (qid_limit >= qt->qid_limit) {
+		*summary = qt->summary;
+	} else {
+		/* Seen through a smaller limit, count the visible part */
+		memset(summary, 0, sizeof(*summary));
+		for (my_radix_tree_iter_start(&iter, &qt->radix, 0);
+		     (qd = my_radix_tree_iter_item(&iter)) &&
+		     qd->qid < qid_limit;
+		     my_radix_tree_iter_next(&iter, qd->qid))
+			zqtree_summary_add(qt, summary, qd);
+	}
+	summary->age = jiffies - qt->built;
+
+	return 0;
+}
+
+/**
+ * Top index: the top_index largest entries by space and by inodes are
+ * picked by a bounded heap as the build goes and sorted at its end, so a
+ * query for as many of them is a copy. Bigger queries and the ones
+ * through a smaller qid_limit pick them out of the whole tree instead.
+ */
+static unsigned int top_index = 256;
+module_param(top_index, uint, 0644);
+
+static uint64_t zqtree_top_value(const struct zqdata *qd, int key)
+{
+#ifdef HAVE_ZFS_OBJECT_QUOTA
+	if (key == ZQTREE_TOP_OBJ)
+		return qd->obj_used;
+#endif /* HAVE_ZFS_OBJECT_QUOTA */
+	return qd->space_used;
+}
+
+/* Ranks lower: smaller, or as large with a larger qid */
+static inline int zqtree_top_less(const struct zqdata *a,
+				  const struct zqdata *b, int key)
+{
+	uint64_t va = zqtree_top_value(a, key), vb = zqtree_top_value(b, key);
+
+	return va < vb || (va == vb && a->qid > b->qid);
+}
+
+/* Put qd at the root of a heap of nr and sift it down */
+static void zqtree_top_sift(struct zqdata **heap, unsigned int nr, int key,
+			    struct zqdata *qd)
+{
+	unsigned int i = 0, child;
+
+	while ((child = 2 * i + 1) < nr) {
+		if (child + 1 < nr &&
+		    zqtree_top_less(heap[child + 1], heap[child], key))
+			child++;
+		if (!zqtree_top_less(heap[child], qd, key))
+			break;
+		heap[i] = heap[child];
+		i = child;
+	}
+	heap[i] = qd;
+}
+
+static void zqtree_top_push(struct zqtree_top *top, int key,
+			    struct zqdata *qd)
+{
+	struct zqdata **heap = top->heap;
+	unsigned int i, parent;
+
+	if (top->nr < top->size) {
+		for (i = top->nr++; i; i = parent) {
+			parent = (i - 1) / 2;
+			if (!zqtree_top_less(qd, heap[parent], key))
+				break;
+			heap[i] = heap[parent];
+		}
+		heap[i] = qd;
+	} else if (top->size && zqtree_top_less(heap[0], qd, key)) {
+		zqtree_top_sift(heap, top->nr, key, qd);
+	}
+}
+
+/* Heap into the descending order, in place */
+static void zqtree_top_sort(struct zqtree_top *top, int key)
+{
+	struct zqdata *min;
+	unsigned int nr;
+
+	for (nr = top->nr; nr > 1; ) {
+		min = top->heap[0];
+		nr--;
+		zqtree_top_sift(top->heap, nr, key, top->heap[nr]);
+		top->heap[nr] = min;
+	}
+}
+
+static int zqtree_top_keys(struct zqtree *qt)
+{
+	return qt->caps & ZFS_CAP_OBJQUOTA ? ZQTREE_TOP_NR : ZQTREE_TOP_OBJ;
+}
+
+/* No index is no error, the queries walk the tree then */
+static void zqtree_top_init(struct zqtree *qt)
+{
+	unsigned int size = min_t(unsigned int, top_index, ZQTREE_TOP_MAX);
+	int key;
+
+	if (!size)
+		return;
+
+	for (key = 0; key < zqtree_top_keys(qt); key++) {
+		qt->top[key].heap = kmalloc(size * sizeof(struct zqdata *),
+					    GFP_NOFS | __GFP_NOWARN);
+		if (qt->top[key].heap)
+			qt->top[key].size = size;
+	}
+}
+
+static void zqtree_top_add(struct zqtree *qt, struct zqdata *qd)
+{
+	int key;
+
+	for (key = 0; key < zqtree_top_keys(qt); key++)
+		zqtree_top_push(&qt->top[key], key, qd);
+}
+
+int zqtree_top(struct zqtree *qt, int key, unsigned int qid_limit,
+	       unsigned int n, int (*fn)(const struct zqdata *qd, void *arg),
+	       void *arg)
+{
+	struct zqtree_top *top = &qt->top[key], walk = { NULL };
+	my_radix_tree_iter_t iter;
+	struct zqdata *entry, qd;
+	unsigned int i;
+	int err = 0;
+
+	if (atomic_read(&qt->state) != 1)
+		return -EAGAIN;
+	if (key >= zqtree_top_keys(qt))
+		return -EOPNOTSUPP;
+
+	n = min_t(unsigned int, n, ZQTREE_TOP_MAX);
+	n = min_t(unsigned long, n, qt->summary.entries);
+	if (!n)
+		return 0;
+
+	/* A full index misses what is past it */
+	if (qid_limit < qt->qid_limit || n > top->size ||
+	    (n > top->nr && top->nr == top->size)) {
+		walk.heap = kmalloc(n * sizeof(struct zqdata *), GFP_KERNEL);
+		if (!walk.heap)
+			return -ENOMEM;
+		walk.size = n;
+
+		for (my_radix_tree_iter_start(&iter, &qt->radix, 0);
+		     (entry = my_radix_tree_iter_item(&iter)) &&
+		     entry->qid < qid_limit;
+		     my_radix_tree_iter_next(&iter, entry->qid))
+			zqtree_top_push(&walk, key, entry);
+		zqtree_top_sort(&walk, key);
+		top = &walk;
+	}
+
+	for (i = 0; i < min(n, top->nr) && !err; i++) {
+		zqtree_copy_entry(qt, &qd, top->heap[i]);
+		err = fn(&qd, arg);
+	}
+
+	kfree(walk.heap);
+	return err;
+}
+
+uint64_t zqtree_generation(struct zqtree *qt)
+{
+	return qt->generation;
+}
+
+unsigned int zqtree_caps(struct zqtree *qt)
+{
+	return qt->caps;
+}
+
+struct zqobjset *zqtree_get_objset(struct zqtree *qt)
+{
+	return qt->objset;
+}
+
+struct timespec zqtree_mtime(struct zqtree *qt)
+{
+	return qt->mtime;
+}
+
+unsigned long zqtree_event(struct zqtree *qt)
+{
+	return qt->event;
+}
+
+int zqtree_for_each(struct zqtree *qt, unsigned int qid_limit,
+		    int (*fn)(const struct zqdata *qd, void *arg), void *arg)
+{
+	my_radix_tree_iter_t iter;
+	struct zqdata *entry, qd;
+	int err;
+
+	if (atomic_read(&qt->state) != 1)
+		return -EAGAIN;
+
+	for (my_radix_tree_iter_start(&iter, &qt->radix, 0);
+	     (entry = my_radix_tree_iter_item(&iter)) &&
+	     entry->qid < qid_limit;
+	     my_radix_tree_iter_next(&iter, entry->qid)) {
+		zqtree_copy_entry(qt, &qd, entry);
+		err = fn(&qd, arg);
+		if (err)
+			return err;
+	}
+
+	return 0;
+}
+
+int zqtree_next(struct zqtree *qt, qid_t from, unsigned int qid_limit,
+		struct zqdata *qd)
+{
+	struct zqdata *entry;
+
+	if (atomic_read(&qt->state) != 1)
+		return -EAGAIN;
+
+	if (from >= qid_limit ||
+	    !radix_tree_gang_lookup(&qt->radix, (void **)&entry, from, 1) ||
+	    entry->qid >= qid_limit)
+		return -ENOENT;
+
+	zqtree_copy_entry(qt, qd, entry);
+	return 0;
+}
+
+/* Copies the entry out of a built tree, a missing entry is all zeroes */
+int zqtree_lookup(struct zqtree *qt, qid_t qid, struct zqdata *qd)
+{
+	struct zqdata *found;
+
+	if (atomic_read(&qt->state) != 1)
+		return -EAGAIN;
+	if (qid >= qt->qid_limit)
+		return -ERANGE;
+
+	found = radix_tree_lookup(&qt->radix, qid);
+	if (found) {
+		zqtree_copy_entry(qt, qd, found);
+	} else {
+		memset(qd, 0, sizeof(*qd));
+		qd->qid = qid;
+	}
+
+	return 0;
 }
 
 static DECLARE_WAIT_QUEUE_HEAD(zqtree_upgrade_wqh);
@@ -87,32 +677,519 @@ static DECLARE_WAIT_QUEUE_HEAD(zqtree_upgrade_wqh);
 #define GET_ERR(state)		((state) >> 16)
 
 static int zqtree_build_qdtree(struct zqtree *zqtree);
-static int zqtree_build_blktree(struct zqtree *zqtree);
+static int blktree_build(struct zqtree *zqtree);
+
+/* Per entry, true once the pass is out of its budget */
+static inline int zqtree_build_yield(struct zqtree_build *b)
+{
+	return build_slice_ms && !(++b->n % ZQTREE_BUILD_BATCH) &&
+	    time_after(jiffies, b->deadline);
+}
+
+/* -EAGAIN when the pass is over but the build is not */
+static int zqtree_build_pass(struct zqtree *qt)
+{
+	struct zqtree_build *b = &qt->build;
+	int err;
+
+	b->deadline = jiffies + msecs_to_jiffies(build_slice_ms);
+	b->n = 0;
+
+	/* The mounts are gone, so is the dataset the backend reads */
+	if (zqobjset_dead(qt->objset)) {
+		if (b->iterating)
+			zfs_prop_iter_stop(&b->iter);
+		b->iterating = 0;
+		return -ENODEV;
+	}
+
+	switch (b->stage) {
+	case ZQTREE_BUILD_PROPS:
+		err = zqtree_build_qdtree(qt);
+		if (err)
+			return err;
+		b->stage = ZQTREE_BUILD_BLOCKS;
+		/* fall through */
+	case ZQTREE_BUILD_BLOCKS:
+		return blktree_build(qt);
+	}
+
+	return -EINVAL;
+}
+
+/**
+ * A scan reads every entry of the property whatever the qid_limit is, the
+ * point lookups only go up to the limit but each costs plan_point_cost
+ * scanned entries. The cheaper one is picked per property, so a build under
+ * a small limit can look up the used space and scan the few limits set.
+ * Zero cost turns the lookups off.
+ */
+static unsigned int plan_point_cost = 8;
+module_param(plan_point_cost, uint, 0644);
+
+static DEFINE_SPINLOCK(zqtree_plan_lock);
+static struct zqtree_plan_stats zqtree_plan_stats;
+
+static void zqtree_plan(struct zqtree *qt)
+{
+	struct zqtree_build *b = &qt->build;
+	void *zfsh = zqobjset_get_zfsh(qt->objset);
+	zfs_prop_list_t *prop;
+	unsigned int i, all = 0;
+	uint64_t count;
+
+	b->point = 0;
+	for (prop = b->prop, i = 0; prop->prop >= 0; prop++, i++) {
+		if (prop->caps & ~qt->caps)
+			continue;
+		all |= 1U << i;
+		/* No estimate, no gamble */
+		if (!plan_point_cost ||
+		    zfs_prop_count(zfsh, prop->prop, &count))
+			continue;
+		if ((uint64_t)qt->qid_limit * plan_point_cost < count)
+			b->point |= 1U << i;
+	}
+
+	spin_lock(&zqtree_plan_lock);
+	if (!b->point)
+		zqtree_plan_stats.scan++;
+	else if (b->point == all)
+		zqtree_plan_stats.point++;
+	else
+		zqtree_plan_stats.hybrid++;
+	spin_unlock(&zqtree_plan_lock);
+}
+
+void zqtree_get_plan_stats(struct zqtree_plan_stats *stats)
+{
+	spin_lock(&zqtree_plan_lock);
+	*stats = zqtree_plan_stats;
+	spin_unlock(&zqtree_plan_lock);
+}
+
+/* -EINTR if killed before admission, the tree is left building */
+static int zqtree_build_start(struct zqtree *qt, int from_host)
+{
+	int err;
+
+	err = zqbuild_admit(&qt->build.ticket, qt->objset, from_host);
+	if (err)
+		return err;
+	/* The first pass fails it */
+	if (zqobjset_dead(qt->objset))
+		return 0;
+	qt->caps = zqobjset_caps(qt->objset);
+	qt->build.prop = zfs_get_prop_list(qt->type);
+	zqtree_plan(qt);
+	return 0;
+}
+
+/* Back to empty, the waiters take it over */
+static void zqtree_build_abandon(struct zqtree *qt)
+{
+	atomic_set(&qt->state, ZQTREE_EMPTY);
+	wake_up_all(&zqtree_upgrade_wqh);
+}
+
+static atomic64_t zqtree_generation_seq = ATOMIC64_INIT(0);
+
+/**
+ * Delta feed. At publish every entry gets in its version the generation
+ * its values last changed in: the tree is merged in qid order with a hash
+ * of the values of the previous tree of the slot. The qids gone from it
+ * are kept as tombstones until they come back, delta_tombstones at most,
+ * the oldest dropped first. The feed is complete for the generations
+ * after the horizon.
+ */
+static int delta_track = 1;
+module_param(delta_track, int, 0644);
+static unsigned int delta_tombstones = 65536;
+module_param(delta_tombstones, uint, 0644);
+
+struct zqdelta_rec {
+	uint32_t		qid;
+	uint32_t		version;
+	uint64_t		hash;
+};
+
+void zqtree_delta_init(struct zqtree_delta *delta)
+{
+	memset(delta, 0, sizeof(*delta));
+	mutex_init(&delta->lock);
+}
+
+static void zqtree_delta_reset(struct zqtree_delta *delta)
+{
+	vfree(delta->recs);
+	kfree(delta->gone);
+	delta->recs = delta->gone = NULL;
+	delta->nr = delta->nr_gone = delta->gone_size = 0;
+	delta->seeded = 0;
+}
+
+void zqtree_delta_free(struct zqtree_delta *delta)
+{
+	zqtree_delta_reset(delta);
+}
+
+static uint64_t zqtree_delta_hash(const struct zqdata *qd)
+{
+	const uint64_t mul = 0x9e3779b97f4a7c15ULL;
+	uint64_t h;
+
+	h = qd->space_used * mul ^ qd->space_quota;
+#ifdef HAVE_ZFS_OBJECT_QUOTA
+	h = h * mul ^ qd->obj_used;
+	h = h * mul ^ qd->obj_quota;
+#endif /* HAVE_ZFS_OBJECT_QUOTA */
+	return h * mul;
+}
+
+/* Full generation of a version, from a generation not older than it */
+static inline uint64_t zqtree_delta_gen(uint64_t now, uint32_t version)
+{
+	return now - (uint32_t)((uint32_t)now - version);
+}
+
+static int zqtree_delta_bury(struct zqtree_delta *delta, uint32_t qid,
+			     uint64_t generation)
+{
+	struct zqdelta_rec *gone;
+	unsigned int size, drop;
+
+	if (delta->nr_gone >= max(delta_tombstones, 1U)) {
+		/* The oldest half goes, and the feed gets shorter */
+		drop = (delta->nr_gone + 1) / 2;
+		delta->horizon = max(delta->horizon,
+				     zqtree_delta_gen(generation,
+						delta->gone[drop - 1].version));
+		delta->nr_gone -= drop;
+		memmove(delta->gone, delta->gone + drop,
+			delta->nr_gone * sizeof(*gone));
+	}
+
+	if (delta->nr_gone == delta->gone_size) {
+		size = delta->gone_size ? delta->gone_size * 2 : 16;
+		gone = krealloc(delta->gone, size * sizeof(*gone),
+				GFP_NOFS | __GFP_NOWARN);
+		if (!gone)
+			return -ENOMEM;
+		delta->gone = gone;
+		delta->gone_size = size;
+	}
+
+	gone = &delta->gone[delta->nr_gone++];
+	gone->qid = qid;
+	gone->version = (uint32_t)generation;
+	return 0;
+}
+
+static int zqtree_delta_has(const struct zqdelta_rec *recs, unsigned int nr,
+			    uint32_t qid)
+{
+	unsigned int lo = 0, hi = nr, mid;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (recs[mid].qid == qid)
+			return 1;
+		if (recs[mid].qid < qid)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return 0;
+}
+
+/* Qids back in the tree are live again, their tombstones would delete them */
+static void zqtree_delta_unbury(struct zqtree_delta *delta,
+				const struct zqdelta_rec *recs,
+				unsigned int nr)
+{
+	unsigned int i, kept = 0;
+
+	for (i = 0; i < delta->nr_gone; i++)
+		if (!zqtree_delta_has(recs, nr, delta->gone[i].qid))
+			delta->gone[kept++] = delta->gone[i];
+	delta->nr_gone = kept;
+}
+
+/*
+ * Called before the tree is published, the entries are still its own.
+ * The generation is taken under the lock, so concurrent finishes stamp
+ * the feed in the order of their generations.
+ */
+static void zqtree_delta_stamp(struct zqtree *qt, struct zqtree_delta *delta)
+{
+	struct zqdelta_rec *recs, *old, *end;
+	my_radix_tree_iter_t iter;
+	struct zqdata *entry, qd;
+	unsigned int nr = 0;
+	uint32_t version;
+	int born = 0;
+
+	mutex_lock(&delta->lock);
+	qt->generation = atomic64_inc_return(&zqtree_generation_seq);
+	version = (uint32_t)qt->generation;
+	if (!delta_track) {
+		zqtree_delta_reset(delta);
+		goto out;
+	}
+
+	recs = vmalloc(max_t(unsigned long, qt->summary.entries, 1) *
+		       sizeof(*recs));
+	if (!recs)
+		goto out_reset;
+
+	old = delta->recs;
+	end = old + delta->nr;
+	for (my_radix_tree_iter_start(&iter, &qt->radix, 0);
+	     (entry = my_radix_tree_iter_item(&iter));
+	     my_radix_tree_iter_next(&iter, entry->qid)) {
+		zqtree_copy_entry(qt, &qd, entry);
+
+		for (; old < end && old->qid < entry->qid; old++)
+			if (zqtree_delta_bury(delta, old->qid,
+					      qt->generation))
+				goto out_free;
+
+		recs[nr].qid = entry->qid;
+		recs[nr].hash = zqtree_delta_hash(&qd);
+		recs[nr].version = version;
+		if (old < end && old->qid == entry->qid) {
+			if (old->hash == recs[nr].hash)
+				recs[nr].version = old->version;
+			old++;
+		} else {
+			born = 1;
+		}
+		entry->version = recs[nr].version;
+		nr++;
+	}
+	for (; old < end; old++)
+		if (zqtree_delta_bury(delta, old->qid, qt->generation))
+			goto out_free;
+	if (born && delta->nr_gone)
+		zqtree_delta_unbury(delta, recs, nr);
+
+	vfree(delta->recs);
+	delta->recs = recs;
+	delta->nr = nr;
+	if (!delta->seeded) {
+		delta->horizon = qt->generation;
+		delta->seeded = 1;
+	}
+	goto out;
+
+out_free:
+	vfree(recs);
+out_reset:
+	/* Starts over with the next tree */
+	zqtree_delta_reset(delta);
+out:
+	mutex_unlock(&delta->lock);
+}
+
+/* Wraps with the 32 bits of the version */
+static inline int zqtree_delta_after(uint32_t version, uint32_t since)
+{
+	return (int32_t)(version - since) > 0;
+}
+
+int zqtree_delta(struct zqtree *qt, struct zqtree_delta *delta,
+		 uint64_t since, unsigned int qid_limit,
+		 int (*fn)(const struct zqdata *qd, int gone, void *arg),
+		 void *arg)
+{
+	my_radix_tree_iter_t iter;
+	struct zqdata *entry, qd;
+	unsigned int i;
+	int err = 0;
+
+	if (atomic_read(&qt->state) != 1)
+		return -EAGAIN;
+
+	mutex_lock(&delta->lock);
+	/* Zero is the whole tree, with nothing gone */
+	if (since && (!delta->seeded || since < delta->horizon ||
+		      since > qt->generation)) {
+		err = -ESTALE;
+		goto out;
+	}
+
+	for (my_radix_tree_iter_start(&iter, &qt->radix, 0);
+	     (entry = my_radix_tree_iter_item(&iter)) &&
+	     entry->qid < qid_limit && !err;
+	     my_radix_tree_iter_next(&iter, entry->qid)) {
+		if (since && !zqtree_delta_after(entry->version, since))
+			continue;
+		zqtree_copy_entry(qt, &qd, entry);
+		err = fn(&qd, 0, arg);
+	}
+
+	memset(&qd, 0, sizeof(qd));
+	for (i = 0; since && i < delta->nr_gone && !err; i++) {
+		qd.qid = delta->gone[i].qid;
+		qd.version = delta->gone[i].version;
+		/* Buried by a tree newer than this one */
+		if (!zqtree_delta_after(qd.version, since) ||
+		    zqtree_delta_after(qd.version, (uint32_t)qt->generation) ||
+		    qd.qid >= qid_limit)
+			continue;
+		err = fn(&qd, 1, arg);
+	}
+
+out:
+	mutex_unlock(&delta->lock);
+	return err;
+}
+
+static void zqtree_build_finish(struct zqtree *qt, int err)
+{
+	struct zqtree_build *b = &qt->build;
+	struct zqtree_delta *delta;
+
+	spin_lock(&zqtree_plan_lock);
+	zqtree_plan_stats.scanned += b->scanned;
+	zqtree_plan_stats.lookups += b->lookups;
+	spin_unlock(&zqtree_plan_lock);
+
+	if (err) {
+		blktree_free(b->root);
+		atomic_cmpxchg(&qt->state, -1, ERR_STATE(-err, 0));
+	} else {
+		qt->blktree_root = b->root;
+		qt->built = jiffies;
+		delta = zqobjset_delta(qt->objset, qt->type);
+		if (delta)
+			zqtree_delta_stamp(qt, delta);
+		else
+			qt->generation =
+				atomic64_inc_return(&zqtree_generation_seq);
+		qt->mtime = CURRENT_TIME;
+		qt->event = zqobjset_notify(qt->objset, qt->type);
+		atomic_cmpxchg(&qt->state, -1, 1);
+	}
+	b->root = NULL;
+
+	zqbuild_done(&b->ticket);
+	wake_up_all(&zqtree_upgrade_wqh);
+
+	/* Walks the whole tree, so the waiters go first */
+	if (!err)
+		zqobjset_watch(qt->objset, qt->type, qt);
+}
+
+static struct workqueue_struct *zqtree_build_wq;
+
+/* Builds handed off by readers, one pass per run */
+static void zqtree_build_work(struct work_struct *work)
+{
+	struct zqtree *qt = container_of(work, struct zqtree, build.work);
+	int err;
+
+	err = zqtree_build_pass(qt);
+	if (err == -EAGAIN) {
+		/* Let the other builds have their pass */
+		queue_work(zqtree_build_wq, work);
+		return;
+	}
+
+	zqtree_build_finish(qt, err);
+	zqobjset_build_done(qt->objset);
+	zqtree_put(qt);
+}
+
+/*
+ * Prefetched builds wait for admission on a queue of their own, the build
+ * worker would otherwise stall the handed off builds holding the slots.
+ */
+static struct workqueue_struct *zqtree_prefetch_wq;
+
+static void zqtree_prefetch_work(struct work_struct *work)
+{
+	struct zqtree *qt = container_of(work, struct zqtree, build.prefetch);
+
+	/* Nobody is going to read it, or a reader got to it first */
+	if (zqobjset_dead(qt->objset) ||
+	    atomic_cmpxchg(&qt->state, 0, -1) != 0)
+		goto out;
+
+	if (zqtree_build_start(qt, qt->build.from_host)) {
+		zqtree_build_abandon(qt);
+		goto out;
+	}
+	/* The build worker takes over our reference and count */
+	queue_work(zqtree_build_wq, &qt->build.work);
+	return;
+out:
+	zqobjset_build_done(qt->objset);
+	zqtree_put(qt);
+}
+
+void zqtree_prefetch(struct zqtree *qt)
+{
+	if (atomic_read(&qt->state) != ZQTREE_EMPTY)
+		return;
+
+	atomic_inc(&qt->refcnt);
+	zqobjset_build_queued(qt->objset);
+	qt->build.from_host = zqbuild_from_host();
+	if (!queue_work(zqtree_prefetch_wq, &qt->build.prefetch)) {
+		/* Already queued */
+		zqobjset_build_done(qt->objset);
+		zqtree_put(qt);
+	}
+}
+
+/* For O_NONBLOCK readers, the build goes on in the background */
+int zqtree_upgrade_nowait(struct zqtree *qt)
+{
+	int state = atomic_read(&qt->state);
+
+	if (state > 0)
+		return -GET_ERR(state);
+
+	zqtree_prefetch(qt);
+	return -EAGAIN;
+}
 
 int zqtree_upgrade(struct zqtree *qt)
 {
 	int was_state;
 	int err;
 
+again:
 	was_state = atomic_cmpxchg(&qt->state, 0, -1);
 	if (likely(was_state > 0)) {
 		return -GET_ERR(was_state);
 	} else if (was_state < 0) {
 		/* Another thread upgrades to a state <= than ours */
-		/* Wait for state update */
+		/* Wait for state update, or for it to give up the build */
 		err = wait_event_interruptible(zqtree_upgrade_wqh,
-				 atomic_read(&qt->state) >= 1);
-		return err ?: GET_ERR(atomic_read(&qt->state));
+				 atomic_read(&qt->state) >= 0);
+		if (err)
+			return err;
+		goto again;
 	} else if (was_state == 0) {
 		/* We have locked it, let's update */
-		err = zqtree_build_qdtree(qt);
-		if (!err)
-			err = zqtree_build_blktree(qt);
-		if (err)
-			atomic_cmpxchg(&qt->state, -1, ERR_STATE(-err, 0));
-		else
-			atomic_cmpxchg(&qt->state, -1, 1);
-		wake_up_all(&zqtree_upgrade_wqh);
+		err = zqtree_build_start(qt, zqbuild_from_host());
+		if (err) {
+			zqtree_build_abandon(qt);
+			return err;
+		}
+		while ((err = zqtree_build_pass(qt)) == -EAGAIN) {
+			if (signal_pending(current)) {
+				/* The worker finishes it for the others */
+				atomic_inc(&qt->refcnt);
+				zqobjset_build_queued(qt->objset);
+				queue_work(zqtree_build_wq, &qt->build.work);
+				return -ERESTARTSYS;
+			}
+			cond_resched();
+		}
+		zqtree_build_finish(qt, err);
 		return err;
 	}
 
@@ -120,7 +1197,9 @@ int zqtree_upgrade(struct zqtree *qt)
 }
 
 /* Private part */
-static int zqtree_quota_tree_destroy(struct zqtree *quota_tree)
+/* Deletes nr entries at most, 1 once the tree is empty */
+static int zqtree_quota_tree_destroy(struct zqtree *quota_tree,
+				     unsigned int nr)
 {
 	my_radix_tree_iter_t iter;
 	struct zqdata *qd;
@@ -131,13 +1210,14 @@ static int zqtree_quota_tree_destroy(struct zqtree *quota_tree)
 	for (my_radix_tree_iter_start(&iter, root, 0);
 	     (qd = my_radix_tree_iter_item(&iter));
 	     my_radix_tree_iter_next(&iter, qid)) {
+		if (!nr--)
+			return 0;
 
 		qid = qd->qid;
-		kmem_cache_free(quota_data_cachep, qd);
 		radix_tree_delete(root, qid);
 	}
 
-	return 0;
+	return 1;
 }
 
 static struct zqdata *zqtree_get_quota_data(struct zqtree *quota_tree,
@@ -149,67 +1229,113 @@ static struct zqdata *zqtree_get_quota_data(struct zqtree *quota_tree,
 	quota_data = radix_tree_lookup(&quota_tree->radix, id);
 
 	if (quota_data == NULL) {
-		quota_data = kmem_cache_zalloc(quota_data_cachep, GFP_NOFS);
+		quota_data = zqarena_alloc(&quota_tree->arena,
+					   zqtree_entry_size(quota_tree));
 		if (!quota_data)
 			return NULL;
 
 		quota_data->qid = id;
 
+		/* On failure the entry stays in the arena until the end */
 		err = radix_tree_insert(&quota_tree->radix, id, quota_data);
-		if (err == -ENOMEM) {
-			kmem_cache_free(quota_data_cachep, quota_data);
+		if (err == -ENOMEM)
 			return NULL;
-		}
 	}
 
 	return quota_data;
 }
 
-static int zqtree_iterate_prop(void *zfsh,
-			       struct zqtree *quota_tree,
-			       zfs_prop_list_t *prop)
+static int zqtree_iterate_prop(struct zqtree *quota_tree)
 {
-	zfs_prop_iter_t iter;
+	struct zqtree_build *b = &quota_tree->build;
 	zfs_prop_pair_t *pair;
-	int err = 0;
 
 	struct zqdata *qd;
 
-	zfs_prop_iter_start(zfsh, prop->prop, &iter);
-	while ((pair = zfs_prop_iter_item(&iter))) {
+	while ((pair = zfs_prop_iter_item(&b->iter))) {
 
+		b->scanned++;
 		if (pair->rid < quota_tree->qid_limit) {
 			qd = zqtree_get_quota_data(quota_tree, pair->rid);
-			if (!qd) {
-				err = -ENOMEM;
-				break;
-			}
-			*(uint64_t *)((void *)qd + prop->offset) = pair->value;
+			if (!qd)
+				return -ENOMEM;
+			*(uint64_t *)((void *)qd + b->prop->offset) =
+			    pair->value;
 		}
 
-		zfs_prop_iter_next(&iter);
+		zfs_prop_iter_next(&b->iter);
+		if (zqtree_build_yield(b))
+			return -EAGAIN;
 	}
-	zfs_prop_iter_stop(&iter);
 
-	return err ?: zfs_prop_iter_error(&iter);
+	/* Backend errors are positive */
+	return -zfs_prop_iter_error(&b->iter);
+}
+
+/* Point lookups of the qids below the limit, instead of the scan */
+static int zqtree_lookup_prop(void *zfsh, struct zqtree *quota_tree)
+{
+	struct zqtree_build *b = &quota_tree->build;
+	struct zqdata *qd;
+	uint64_t value;
+	int err;
+
+	for (; b->next_qid < quota_tree->qid_limit; b->next_qid++) {
+		err = zfs_prop_one(zfsh, b->prop->prop, b->next_qid, &value);
+		if (err)
+			return -err;
+		b->lookups++;
+
+		/* As with the scan, only the set ones make an entry */
+		if (value) {
+			qd = zqtree_get_quota_data(quota_tree, b->next_qid);
+			if (!qd)
+				return -ENOMEM;
+			*(uint64_t *)((void *)qd + b->prop->offset) = value;
+		}
+
+		if (zqtree_build_yield(b)) {
+			b->next_qid++;
+			return -EAGAIN;
+		}
+	}
+
+	return 0;
 }
 
 static int zqtree_build_qdtree(struct zqtree *zqtree)
 {
 	int ret = 0;
 
-	void *zfsh = zqhandle_get_zfsh(zqtree->handle);
-	zfs_prop_list_t *prop;
-
-	for (prop = zfs_get_prop_list(zqtree->type); prop->prop >= 0; ++prop) {
-		ret = zqtree_iterate_prop(zfsh, zqtree, prop);
-		if (ret && ret != EOPNOTSUPP)
+	void *zfsh = zqobjset_get_zfsh(zqtree->objset);
+	struct zqtree_build *b = &zqtree->build;
+
+	for (; b->prop->prop >= 0; ++b->prop, ++b->nprop) {
+		/* Not there on this dataset, its fields stay out of the tree */
+		if (b->prop->caps & ~zqtree->caps)
+			continue;
+		if (b->point & (1U << b->nprop)) {
+			ret = zqtree_lookup_prop(zfsh, zqtree);
+			if (ret == -EAGAIN)
+				return ret;
+			b->next_qid = 0;
+		} else {
+			/* A new property or the one the last pass stopped in */
+			if (!b->iterating) {
+				zfs_prop_iter_start(zfsh, b->prop->prop,
+						    &b->iter);
+				b->iterating = 1;
+			}
+			ret = zqtree_iterate_prop(zqtree);
+			if (ret == -EAGAIN)
+				return ret;
+			zfs_prop_iter_stop(&b->iter);
+			b->iterating = 0;
+		}
+		if (ret)
 			break;
 	}
 
-	if (ret == EOPNOTSUPP)
-		ret = 0;
-
 	return ret;
 }
 
@@ -219,13 +1345,16 @@ static int zqtree_build_qdtree(struct zqtree *zqtree)
 void zqtree_print_quota_data(struct zqdata *qd)
 {
 	printk(KERN_DEBUG "qd = %p, "
-	       "{ .qid = %u, .space_used = %Lu, .space_quota = %Lu"
+	       "{ .qid = %u, .space_used = %llu, .space_quota = %llu"
 #ifdef HAVE_ZFS_OBJECT_QUOTA
-	       ", .obj_used = %Lu, .obj_quota = %Lu"
+	       ", .obj_used = %llu, .obj_quota = %llu"
 #endif /* HAVE_ZFS_OBJECT_QUOTA */
-	       " }\n", qd, qd->qid, qd->space_used, qd->space_quota
+	       " }\n", qd, qd->qid,
+	       (unsigned long long)qd->space_used,
+	       (unsigned long long)qd->space_quota
 #ifdef HAVE_ZFS_OBJECT_QUOTA
-	       , qd->obj_used, qd->obj_quota
+	       , (unsigned long long)qd->obj_used,
+	       (unsigned long long)qd->obj_quota
 #endif /* HAVE_ZFS_OBJECT_QUOTA */
 	    );
 }
@@ -233,14 +1362,15 @@ void zqtree_print_quota_data(struct zqdata *qd)
 int zqtree_print(struct zqtree *quota_tree)
 {
 	my_radix_tree_iter_t iter;
-	struct zqdata *qd;
+	struct zqdata *entry, qd;
 
 	printk(KERN_DEBUG "quota_tree = %p\n", quota_tree);
 	for (my_radix_tree_iter_start(&iter, &quota_tree->radix, 0);
-	     (qd = my_radix_tree_iter_item(&iter));
-	     my_radix_tree_iter_next(&iter, qd->qid)) {
+	     (entry = my_radix_tree_iter_item(&iter));
+	     my_radix_tree_iter_next(&iter, entry->qid)) {
 
-		zqtree_print_quota_data(qd);
+		zqtree_copy_entry(quota_tree, &qd, entry);
+		zqtree_print_quota_data(&qd);
 	}
 
 	return 0;
@@ -291,16 +1421,20 @@ struct v2r1_disk_dqblk {
 };
 
 static int quota_data_to_v2r1_disk_dqblk(struct zqdata *quota_data,
-					 struct v2r1_disk_dqblk *v2r1)
+					 struct v2r1_disk_dqblk *v2r1,
+					 unsigned int caps)
 {
 	v2r1->dqb_id = cpu_to_le32(quota_data->qid);
 	v2r1->dqb_bsoftlimit = v2r1->dqb_bhardlimit =
 	    cpu_to_le64(quota_data->space_quota / 1024);
 	v2r1->dqb_curspace = cpu_to_le64(quota_data->space_used);
 #ifdef HAVE_ZFS_OBJECT_QUOTA
-	v2r1->dqb_ihardlimit = v2r1->dqb_isoftlimit =
-	    cpu_to_le64(quota_data->obj_quota);
-	v2r1->dqb_curinodes = cpu_to_le64(quota_data->obj_used);
+	/* Short entries have no obj_* */
+	if (caps & ZFS_CAP_OBJQUOTA) {
+		v2r1->dqb_ihardlimit = v2r1->dqb_isoftlimit =
+		    cpu_to_le64(quota_data->obj_quota);
+		v2r1->dqb_curinodes = cpu_to_le64(quota_data->obj_used);
+	}
 #endif /* HAVE_ZFS_OBJECT_QUOTA */
 	v2r1->dqb_btime = v2r1->dqb_itime = cpu_to_le64(0);
 
@@ -313,6 +1447,7 @@ static int quota_data_to_v2r1_disk_dqblk(struct zqdata *quota_data,
 	 sizeof(struct v2r1_disk_dqblk))
 
 #define QTREE_DEPTH     4
+#define	QTREE_PATH	(QTREE_DEPTH - 1)
 
 #define	DATA_BLOCK_MASK	2UL
 
@@ -346,16 +1481,55 @@ struct blktree_root {
 	struct blktree_data_block	*first_data_block;
 	struct blktree_data_block	*data_block;
 
-	struct radix_tree_root		blocks;
+	/* Block number -> block, numbers are handed out in order */
+	void				**blocks;
+	uint32_t			nr_blocks_max;
+
+	/* Where the build goes on with the next qid */
+	struct blktree_block		*path[QTREE_PATH];
+	struct blktree_block		*block;
 };
 
+static int blktree_index_add(struct blktree_root *root, uint32_t blknum,
+			     void *block)
+{
+	void **blocks;
+	uint32_t n;
+
+	if (blknum >= root->nr_blocks_max) {
+		n = max(root->nr_blocks_max * 2, 256U);
+		blocks = vmalloc(n * sizeof(*blocks));
+		if (!blocks)
+			return -ENOMEM;
+
+		if (root->blocks)
+			memcpy(blocks, root->blocks,
+			       root->nr_blocks_max * sizeof(*blocks));
+		memset(blocks + root->nr_blocks_max, 0,
+		       (n - root->nr_blocks_max) * sizeof(*blocks));
+		vfree(root->blocks);
+		root->blocks = blocks;
+		root->nr_blocks_max = n;
+	}
+
+	root->blocks[blknum] = block;
+	return 0;
+}
+
+static inline void *blktree_index_get(struct blktree_root *root,
+				      uint32_t blknum)
+{
+	return blknum < root->blknum ? root->blocks[blknum] : NULL;
+}
+
 static struct blktree_data_block *
 blktree_get_datablock(struct blktree_root *tree)
 {
 	struct blktree_data_block *data_block = tree->data_block;
 
 	if (!data_block || data_block->n == DATA_PER_BLOCK) {
-		data_block = kzalloc(sizeof(*data_block), GFP_KERNEL);
+		data_block = zqarena_alloc(&tree->zqtree->arena,
+					   sizeof(*data_block));
 		if (!data_block)
 			return NULL;
 
@@ -392,31 +1566,23 @@ static struct blktree_block *
 blktree_new_block(struct blktree_root *root, uint32_t num)
 {
 	struct blktree_block *block;
-	int err;
 
-	block = kzalloc(sizeof(*block), GFP_KERNEL);
+	block = zqarena_alloc(&root->zqtree->arena, sizeof(*block));
 	if (!block)
 		return NULL;
 
-
 	block->num = num;
 	block->blknum  = root->blknum++;
 
 	if (!root->first_block.child)
 		root->first_block.child = block;
 
-	err = radix_tree_insert(&root->blocks, block->blknum, block);
-	if (err)
-		goto out_err;
+	if (blktree_index_add(root, block->blknum, block))
+		return NULL;
 
 	return block;
-out_err:
-	kfree(block);
-	return NULL;
 }
 
-#define	QTREE_PATH	(QTREE_DEPTH - 1)
-
 static inline uint32_t
 qid_to_prefix(qid_t qid, int level)
 {
@@ -447,6 +1613,8 @@ blktree_get_pointer_block(struct blktree_block *block,
 	/* Now allocate new blocks */
 	for (i++; i <= QTREE_PATH - 1; i++) {
 		block = blktree_new_block(root, qid_to_prefix(qid, i));
+		if (!block)
+			return NULL;
 		if (i > 0 && !path[i - 1]->child)
 			path[i - 1]->child = block;
 		if (path[i])
@@ -468,7 +1636,7 @@ blktree_enumerate_data_blocks(struct blktree_root *root)
 	     data_block; data_block = data_block->next)
 	{
 		data_block->blknum = root->blknum++;
-		err = radix_tree_insert(&root->blocks, data_block->blknum,
+		err = blktree_index_add(root, data_block->blknum,
 					(void *)(DATA_BLOCK_MASK |
 						 (unsigned long)data_block));
 		if (err)
@@ -478,78 +1646,100 @@ blktree_enumerate_data_blocks(struct blktree_root *root)
 	return err;
 }
 
-static struct blktree_root *
+/* The root is kept in the build state until the build is finished */
+static int
 blktree_build(struct zqtree *zqtree)
 {
-	struct blktree_block *path[QTREE_PATH] = {
-		[0 ... QTREE_PATH - 1]	= 0
-	};
-
-	struct blktree_root *root;
-	struct blktree_block *block = NULL;
+	struct zqtree_build *b = &zqtree->build;
+	struct blktree_root *root = b->root;
 	struct blktree_data_block *data_block;
+	struct blktree_block *block;
 	struct zqdata *qd;
 	my_radix_tree_iter_t iter;
+	int i;
 
-	root = kzalloc(sizeof(*root), GFP_KERNEL);
-	if (!root)
-		goto out_mem;
+	if (!root) {
+		root = zqarena_alloc(&zqtree->arena, sizeof(*root));
+		if (!root)
+			return -ENOMEM;
+
+		root->blknum = 2;
+		root->first_block.blknum = 1;
+		root->zqtree = zqtree;
+		b->root = root;
 
-	root->blknum = 2;
-	root->first_block.blknum = 1;
-	root->zqtree = zqtree;
+		zqtree_top_init(zqtree);
 
-	INIT_RADIX_TREE(&root->blocks, GFP_KERNEL);
-	radix_tree_insert(&root->blocks, 1, &root->first_block);
+		if (blktree_index_add(root, 1, &root->first_block))
+			return -ENOMEM;
+	}
 
-	for (my_radix_tree_iter_start(&iter, &zqtree->radix, 0);
+	for (my_radix_tree_iter_start(&iter, &zqtree->radix, b->next_qid);
 	     (qd = my_radix_tree_iter_item(&iter));
 	     my_radix_tree_iter_next(&iter, qd->qid))
 	{
 		data_block = blktree_insert(root, qd);
 		if (!data_block)
-			goto out_free_blktree;
-		block = blktree_get_pointer_block(block, path, root, qd->qid);
+			return -ENOMEM;
+		block = blktree_get_pointer_block(root->block, root->path,
+						  root, qd->qid);
 		if (!block)
-			goto out_free_blktree;
+			return -ENOMEM;
+		root->block = block;
 		if (!block->child) {
 			block->data_child = data_block;
 			block->offset = data_block->n - 1;
 			block->is_leaf = 1;
 		}
+		zqtree_summary_add(zqtree, &zqtree->summary, qd);
+		zqtree_top_add(zqtree, qd);
+		if (zqtree_over_add(zqtree, qd))
+			return -ENOMEM;
+
+		if (zqtree_build_yield(b)) {
+			b->next_qid = qd->qid + 1;
+			return -EAGAIN;
+		}
 	}
 
+	for (i = 0; i < ZQTREE_TOP_NR; i++)
+		zqtree_top_sort(&zqtree->top[i], i);
+
 	/* renumerate data_blocks & insert them */
 	if (blktree_enumerate_data_blocks(root))
-		goto out_free_blktree;
-
-	return root;
+		return -ENOMEM;
 
-out_free_blktree:
-	blktree_free(root);
-out_mem:
-	return NULL;
+	return 0;
 }
 
-static int zqtree_build_blktree(struct zqtree *zqtree)
+/*
+ * The tree is built up to the largest qid_limit of the handles sharing it,
+ * every reader sees it through its own limit: blocks and entries of qids
+ * at or above the limit are left out of the output.
+ */
+static inline int
+is_prefix_visible(uint32_t num, int level, unsigned int qid_limit)
 {
-	struct blktree_root *blktree_root;
-
-	blktree_root = blktree_build(zqtree);
-	if (IS_ERR_OR_NULL(blktree_root))
-		return PTR_ERR(blktree_root);
-
-	zqtree->blktree_root = blktree_root;
-	return 0;
+	return qid_limit && num <= qid_to_prefix(qid_limit - 1, level);
 }
 
 static int
-blktree_output_block_node(struct blktree_block *node, char *buf)
+blktree_output_block_node(struct blktree_block *node, char *buf,
+			  unsigned int qid_limit)
 {
 	__le32 *ref = (__le32 *) buf;
+	int level;
+
+	/* Root points to level 0, leaves are at QTREE_PATH - 1 */
+	if (node->blknum == 1)
+		level = 0;
+	else if (node->child && node->child->is_leaf)
+		level = QTREE_PATH - 1;
+	else
+		level = 1;
 
 	node = node->child;
-	while (node) {
+	while (node && is_prefix_visible(node->num, level, qid_limit)) {
 		ref[node->num & 255] = cpu_to_le32(node->blknum);
 		node = node->next;
 	}
@@ -558,7 +1748,8 @@ blktree_output_block_node(struct blktree_block *node, char *buf)
 }
 
 static int
-blktree_output_block_leaf(struct blktree_block *leaf, char *buf)
+blktree_output_block_leaf(struct blktree_block *leaf, char *buf,
+			  unsigned int qid_limit)
 {
 	__le32 *ref = (__le32 *) buf;
 	uint32_t first_num = leaf->num << 8, last_num = first_num + 256,
@@ -570,7 +1761,7 @@ blktree_output_block_leaf(struct blktree_block *leaf, char *buf)
 	while (data_block && data_block->qid_first < last_num) {
 		for (i = offset; i < data_block->n; i++) {
 			struct zqdata *qd = data_block->data[i];
-			if (last_num <= qd->qid)
+			if (last_num <= qd->qid || qid_limit <= qd->qid)
 				break;
 
 			ref[qd->qid & 255] = cpu_to_le32(data_block->blknum);
@@ -585,21 +1776,25 @@ blktree_output_block_leaf(struct blktree_block *leaf, char *buf)
 }
 
 static int
-blktree_output_block_data(struct blktree_data_block *data_block, char *buf)
+blktree_output_block_data(struct blktree_data_block *data_block, char *buf,
+			  unsigned int qid_limit, unsigned int caps)
 {
 	struct qt_disk_dqdbheader *dh =
 	    (struct qt_disk_dqdbheader *)buf;
 	struct v2r1_disk_dqblk *db =
 	    (struct v2r1_disk_dqblk *)(buf + sizeof(*dh));
-	int i;
-
-	dh->dqdh_entries = data_block->n;
-
+	unsigned int i;
 
+	/* Entries are sorted by qid, so the visible ones go first */
 	for (i = 0; i < data_block->n; i++, db++) {
-		quota_data_to_v2r1_disk_dqblk(data_block->data[i], db);
+		if (data_block->data[i]->qid >= qid_limit)
+			break;
+		quota_data_to_v2r1_disk_dqblk(data_block->data[i], db, caps);
 	}
 
+	if (i)
+		dh->dqdh_entries = cpu_to_le16(i);
+
 	return QTREE_BLOCKSIZE;
 }
 
@@ -655,7 +1850,7 @@ static struct blktree_data_block *to_data_block_ptr(void *ptr)
 }
 
 int zqtree_output_block(struct zqtree *zqtree,
-		        char *buf, uint32_t blknum)
+		        char *buf, uint32_t blknum, unsigned int qid_limit)
 {
 	struct blktree_root *blktree = zqtree->blktree_root;
 	struct blktree_block *node;
@@ -674,48 +1869,32 @@ int zqtree_output_block(struct zqtree *zqtree,
 	if (blknum == 0)
 		return blktree_output_header(blktree, buf);
 
-	node = radix_tree_lookup(&blktree->blocks, blknum);
+	node = blktree_index_get(blktree, blknum);
 	if (!node)
 		return 0;
 
 	if (is_data_block_ptr(node)) {
 		/* data block */
-		return blktree_output_block_data(to_data_block_ptr(node), buf);
+		return blktree_output_block_data(to_data_block_ptr(node), buf,
+						 qid_limit, zqtree->caps);
 	} else if (node->is_leaf) {
 		/* tree leaf, points to data blocks */
-		return blktree_output_block_leaf(node, buf);
+		return blktree_output_block_leaf(node, buf, qid_limit);
 	} else {
 		/* tree node */
-		return blktree_output_block_node(node, buf);
+		return blktree_output_block_node(node, buf, qid_limit);
 	}
 
 	return 0;
 }
 
+/* Nodes are in the arena of the tree, only the index is left */
 static int blktree_free(struct blktree_root *root)
 {
-	void *block;
-	size_t blknum = 2;
-	struct blktree_data_block *data_block;
-
 	if (!root)
 		return 0;
 
-	while ((data_block = root->first_data_block)) {
-		root->first_data_block = data_block->next;
-		kfree(data_block);
-	}
-
-	while (true) {
-		block = radix_tree_delete(&root->blocks, blknum);
-		if (!block)
-			break;
-		if (!is_data_block_ptr(block))
-			kfree(block);
-		blknum++;
-	}
-
-	kfree(root);
+	vfree(root->blocks);
 	return 0;
 }
 
@@ -724,13 +1903,37 @@ static int blktree_free(struct blktree_root *root)
  ****************************************************************************/
 int __init zfsquota_tree_init(void)
 {
-	quota_data_cachep =
-	    kmem_cache_create("zfs-quotadata", sizeof(struct zqdata), 0, 0,
-			      NULL);
+	zqarena_pool = mempool_create_page_pool(arena_reserve, ZQARENA_ORDER);
+	if (!zqarena_pool)
+		return -ENOMEM;
+	zqtree_reclaim_wq = create_singlethread_workqueue("zfsquota_reclaim");
+	if (!zqtree_reclaim_wq)
+		goto out_pool;
+	zqtree_build_wq = create_singlethread_workqueue("zfsquota_build");
+	if (!zqtree_build_wq)
+		goto out_reclaim;
+	zqtree_prefetch_wq = create_singlethread_workqueue("zfsquota_prefetch");
+	if (!zqtree_prefetch_wq)
+		goto out_build;
 	return 0;
+
+out_build:
+	destroy_workqueue(zqtree_build_wq);
+out_reclaim:
+	destroy_workqueue(zqtree_reclaim_wq);
+out_pool:
+	mempool_destroy(zqarena_pool);
+	return -ENOMEM;
 }
 
-void __exit zfsquota_tree_exit(void)
+/* Not __exit, module init unwinds with it too */
+void zfsquota_tree_exit(void)
 {
-	kmem_cache_destroy(quota_data_cachep);
+	/* Prefetches hand their builds to the build worker */
+	destroy_workqueue(zqtree_prefetch_wq);
+	/* Finishes the handed off builds, they put their trees */
+	destroy_workqueue(zqtree_build_wq);
+	/* Flushes the trees still queued for reclaim */
+	destroy_workqueue(zqtree_reclaim_wq);
+	mempool_destroy(zqarena_pool);
 }
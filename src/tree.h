@@ -13,20 +13,127 @@ struct zqdata {
 #endif	/* HAVE_ZFS_OBJECT_QUOTA */
 };
 
+#ifdef	HAVE_ZFS_OBJECT_QUOTA
+/* Trees of datasets without object accounting store entries up to obj_* */
+#define	ZQDATA_SPACE_SIZE	offsetof(struct zqdata, obj_used)
+#else	/* HAVE_ZFS_OBJECT_QUOTA */
+#define	ZQDATA_SPACE_SIZE	sizeof(struct zqdata)
+#endif	/* HAVE_ZFS_OBJECT_QUOTA */
+
 struct zqtree;
-struct zqhandle;
+struct zqobjset;
 
 /*
  * Z(FS)Q(UOTA) tree utils
  */
 
-struct zqtree *zqtree_new(struct zqhandle *handle, int type,
+struct zqtree *zqtree_new(struct zqobjset *objset, int type,
 			  unsigned int qid_limit);
 struct zqtree *zqtree_get(struct zqtree *qt);
 void zqtree_put(struct zqtree *qt);
+/* zqtree_put of a reader done with the tree, keeps the cached one longer */
+void zqtree_close(struct zqtree *qt);
+int zqtree_idle(struct zqtree *qt);
+/* Built without errors, so lookups will not wait */
+int zqtree_built(struct zqtree *qt);
+/* Entry of an already built tree, -EAGAIN if it is not built */
+int zqtree_lookup(struct zqtree *qt, qid_t qid, struct zqdata *qd);
+
+/* How the builds fetched the properties, host-wide */
+struct zqtree_plan_stats {
+	unsigned long		scan;		/* builds that only scanned */
+	unsigned long		point;		/* only looked up */
+	unsigned long		hybrid;		/* both */
+	unsigned long		scanned;	/* entries read by the scans */
+	unsigned long		lookups;	/* qids looked up */
+};
+
+void zqtree_get_plan_stats(struct zqtree_plan_stats *stats);
+
+/* Totals of a built tree, what the host monitoring wants */
+struct zqtree_summary {
+	unsigned long		entries;
+	unsigned long		over;		/* at or above a limit */
+	uint64_t		space_used;
+	unsigned long		age;		/* jiffies since the build */
+};
+
+/* -EAGAIN if the tree is not built, entries from qid_limit on don't count */
+int zqtree_summary(struct zqtree *qt, unsigned int qid_limit,
+		   struct zqtree_summary *summary);
+
+/*
+ * Entries of a built tree at or past over_percent of a limit, below
+ * qid_limit in qid order, until fn fails. Recorded by the build.
+ */
+int zqtree_for_each_over(struct zqtree *qt, unsigned int qid_limit,
+			 int (*fn)(const struct zqdata *qd, void *arg),
+			 void *arg);
+
+/* Delta feed state of a quota type of an objset, see tree.c */
+struct zqdelta_rec;
+struct zqtree_delta {
+	struct mutex		lock;
+	/* Qids of the last tree in qid order, tombstones oldest first */
+	struct zqdelta_rec	*recs, *gone;
+	unsigned int		nr, nr_gone, gone_size;
+	uint64_t		horizon;
+	int			seeded;
+};
+
+void zqtree_delta_init(struct zqtree_delta *delta);
+void zqtree_delta_free(struct zqtree_delta *delta);
+/*
+ * Entries of a built tree below qid_limit changed after generation since
+ * and then the qids gone after it with only qid and version set, until fn
+ * fails. -ESTALE if the feed does not go back to since, zero since is the
+ * whole tree.
+ */
+int zqtree_delta(struct zqtree *qt, struct zqtree_delta *delta,
+		 uint64_t since, unsigned int qid_limit,
+		 int (*fn)(const struct zqdata *qd, int gone, void *arg),
+		 void *arg);
+
+/* Keys of zqtree_top */
+enum {
+	ZQTREE_TOP_SPACE,
+	ZQTREE_TOP_OBJ,
+	ZQTREE_TOP_NR,
+};
+#define ZQTREE_TOP_MAX		65536
+
+/*
+ * The n largest entries by key below qid_limit of a built tree, largest
+ * first, until fn fails. n is at most ZQTREE_TOP_MAX, -EOPNOTSUPP for the
+ * inodes of a tree without them.
+ */
+int zqtree_top(struct zqtree *qt, int key, unsigned int qid_limit,
+	       unsigned int n, int (*fn)(const struct zqdata *qd, void *arg),
+	       void *arg);
+
+/* Of a built tree, grows with every build host-wide */
+uint64_t zqtree_generation(struct zqtree *qt);
+/* ZFS_CAP_* the tree was built with */
+unsigned int zqtree_caps(struct zqtree *qt);
+/* Not referenced, the tree holds it */
+struct zqobjset *zqtree_get_objset(struct zqtree *qt);
+/* Wall clock time of the build */
+struct timespec zqtree_mtime(struct zqtree *qt);
+/* zqobjset_events of the type when the tree was published, 0 before */
+unsigned long zqtree_event(struct zqtree *qt);
+/* Entries of a built tree below qid_limit in qid order, until fn fails */
+int zqtree_for_each(struct zqtree *qt, unsigned int qid_limit,
+		    int (*fn)(const struct zqdata *qd, void *arg), void *arg);
+/* First entry of a built tree from qid from on, -ENOENT past the last */
+int zqtree_next(struct zqtree *qt, qid_t from, unsigned int qid_limit,
+		struct zqdata *qd);
 
 /* Upgrade zqtree, can sleep */
 int zqtree_upgrade(struct zqtree * zqtree);
+/* -EAGAIN and a background build instead of the sleep */
+int zqtree_upgrade_nowait(struct zqtree *qt);
+/* Start the upgrade in the background, doesn't sleep */
+void zqtree_prefetch(struct zqtree *qt);
 
 /* Printing utilities */
 int zqtree_print_tree(struct zqtree *root);
@@ -34,6 +141,8 @@ void zqtree_print_quota_data(struct zqdata *qd);
 
 /* Block tree interface */
 int zqtree_output_magic(struct zqtree *zqtree, char *buf);
-int zqtree_output_block(struct zqtree *zqtree, char *buf, uint32_t blknum);
+/* Only qids below qid_limit are output, see zqtree_new for the build limit */
+int zqtree_output_block(struct zqtree *zqtree, char *buf, uint32_t blknum,
+			unsigned int qid_limit);
 
 #endif /* TREE_H_INCLUDED */
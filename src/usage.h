@@ -0,0 +1,157 @@
+#ifndef USAGE_H_INCLUDED
+#define USAGE_H_INCLUDED
+
+/*
+ * Layout of /proc/zfsquota/<dev>/usage.bin, host byte order. The header is
+ * followed by count entries sorted by type, then by qid, so a reader can
+ * mmap the file and binary search the part of a type.
+ */
+
+#define ZQUSAGE_MAGIC		0x7a717573	/* "zqus" */
+#define ZQUSAGE_VERSION		1
+
+/* Header flags */
+#define ZQUSAGE_OBJ		1	/* obj_used and obj_quota are valid */
+
+struct zqusage_header {
+	uint32_t	magic;
+	uint32_t	version;
+	uint64_t	generation;	/* changes with every rebuild */
+	uint64_t	count;
+	uint32_t	flags;
+	uint32_t	entry_size;
+};
+
+struct zqusage_entry {
+	uint32_t	qid;
+	uint32_t	type;		/* USRQUOTA or GRPQUOTA */
+	uint64_t	space_used;
+	uint64_t	space_quota;
+	uint64_t	obj_used;
+	uint64_t	obj_quota;
+};
+
+/*
+ * Layout of /proc/zfsquota/<dev>/delta.bin: the header and count entries,
+ * for each type the changed ones in qid order and then the gone ones. Seek
+ * to the generation to read the changes after it, see README.md.
+ */
+
+#define ZQDELTA_MAGIC		0x7a716474	/* "zqdt" */
+#define ZQDELTA_VERSION		1
+
+/* Entry flags */
+#define ZQDELTA_GONE		1	/* qid is gone, only qid and type valid */
+
+struct zqdelta_header {
+	uint32_t	magic;
+	uint32_t	version;
+	uint64_t	generation;	/* seek here for the next delta */
+	uint64_t	since;
+	uint64_t	count;
+	uint32_t	flags;		/* ZQUSAGE_OBJ */
+	uint32_t	entry_size;
+};
+
+struct zqdelta_entry {
+	uint32_t	qid;
+	uint32_t	type;
+	uint32_t	flags;
+	uint32_t	version;	/* low 32 bits of the generation */
+	uint64_t	space_used;
+	uint64_t	space_quota;
+	uint64_t	obj_used;
+	uint64_t	obj_quota;
+};
+
+/*
+ * Layout of /proc/zfsquota/<dev>/history, there with history_kb set. The
+ * header page is followed by a ring of size bytes the samples of every
+ * published tree go into, oldest at tail. head and tail count the bytes
+ * ever written, so a record lives at offset + (pos % size) and never
+ * wraps: a ZQHISTORY_PAD record, of which only size and kind are valid,
+ * fills the end of the ring instead.
+ *
+ * A sample lists the qids whose usage changed since the previous sample
+ * of the type, then the qids gone since it, as LEB128 varints: every qid
+ * as the difference with the previous qid of the list (the first one with
+ * 0), each change as zigzag encoded space_used and obj_used differences.
+ * A ZQHISTORY_KEY sample has every qid with the differences from 0, the
+ * chain of a type starts over there.
+ *
+ * The ring is written in place. Read head, copy out the records from tail
+ * on, then check that tail did not go past what was copied.
+ */
+
+#define ZQHISTORY_MAGIC		0x7a716869	/* "zqhi" */
+#define ZQHISTORY_VERSION	1
+
+struct zqhistory_header {
+	uint32_t	magic;
+	uint32_t	version;
+	uint64_t	offset;		/* of the ring in the file */
+	uint64_t	size;
+	uint64_t	head;
+	uint64_t	tail;
+	uint64_t	dropped;	/* samples larger than half the ring */
+};
+
+/* Record kinds */
+#define ZQHISTORY_PAD		0
+#define ZQHISTORY_SAMPLE	1
+
+/* Sample flags */
+#define ZQHISTORY_KEY		1
+#define ZQHISTORY_OBJ		2	/* obj_used is tracked */
+
+struct zqhistory_record {
+	uint32_t	size;		/* with the varints, 8 byte aligned */
+	uint16_t	kind;
+	uint16_t	flags;
+	uint32_t	type;		/* USRQUOTA or GRPQUOTA */
+	uint32_t	changed;
+	uint32_t	gone;
+	uint32_t	pad;
+	uint64_t	generation;
+	uint64_t	time;		/* of the build, seconds since the epoch */
+	/* Totals of the snapshot */
+	uint64_t	entries;
+	uint64_t	space_used;
+	uint64_t	obj_used;
+};
+
+/*
+ * ZQ_IOC_GETQUOTA on aquota.user and aquota.group: the quota of count qids
+ * of the file's type in one call, one struct zqdqblk per qid filled as
+ * Q_GETQUOTA fills struct if_dqblk. The pointers are user addresses.
+ */
+
+#define ZQ_IOC_MAGIC		'q'
+#define ZQ_IOC_GETQUOTA		_IOWR(ZQ_IOC_MAGIC, 1, struct zqgetquota)
+
+/* At most qids per call */
+#define ZQGETQUOTA_MAX		65536
+
+/* Flags, set on return */
+#define ZQGETQUOTA_CACHED	1	/* all of it came from the snapshot */
+
+struct zqgetquota {
+	uint64_t	qids;		/* uint32_t[count] */
+	uint64_t	dqblks;		/* struct zqdqblk[count] */
+	uint32_t	count;
+	uint32_t	flags;
+};
+
+/* struct if_dqblk without the grace times, same on 32 and 64 bits */
+struct zqdqblk {
+	uint64_t	bhardlimit;	/* in 1024 byte blocks */
+	uint64_t	bsoftlimit;
+	uint64_t	curspace;	/* in bytes */
+	uint64_t	ihardlimit;
+	uint64_t	isoftlimit;
+	uint64_t	curinodes;
+	uint32_t	qid;
+	uint32_t	valid;		/* QIF_* */
+};
+
+#endif /* USAGE_H_INCLUDED */
@@ -0,0 +1,357 @@
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/slab.h>
+#include <linux/delay.h>
+#include <linux/mutex.h>
+#include <linux/string.h>
+#include <linux/radix-tree.h>
+
+#include "zfs.h"
+
+/**
+ * Synthetic backend. Generates qids of the given distribution on the fly,
+ * so millions of them cost no memory, and derives the values from a hash
+ * of qid. Limits set through quotactl are kept in a radix-tree per prop.
+ *
+ * Used to benchmark tree build and render without ZFS at hand.
+ */
+
+#define SYNTH_CLUSTER		1024
+#define SYNTH_BUFSIZE		(sizeof(zfs_prop_pair_t) * 2048)
+
+struct synth_limit {
+	uint32_t		rid;
+	uint64_t		value;
+};
+
+struct zfs_synth {
+	struct zfs_synth_params	params;
+	uint32_t		stride;
+	uint32_t		nclusters;
+
+	struct mutex		lock;
+	struct radix_tree_root	limits[ZQ_NUM_PROPS];
+};
+
+static const char *synth_dist_names[] = {
+	[ZFS_SYNTH_DENSE]	= "dense",
+	[ZFS_SYNTH_SPARSE]	= "sparse",
+	[ZFS_SYNTH_CLUSTERED]	= "clustered",
+};
+
+int zfs_synth_parse_dist(const char *name)
+{
+	unsigned int i;
+
+	for (i = 0; i < ARRAY_SIZE(synth_dist_names); i++)
+		if (!strcmp(name, synth_dist_names[i]))
+			return i;
+	return -EINVAL;
+}
+EXPORT_SYMBOL(zfs_synth_parse_dist);
+
+const char *zfs_synth_dist_name(unsigned int dist)
+{
+	if (dist >= ARRAY_SIZE(synth_dist_names))
+		return "unknown";
+	return synth_dist_names[dist];
+}
+EXPORT_SYMBOL(zfs_synth_dist_name);
+
+static inline uint32_t synth_hash(uint32_t x, uint32_t seed)
+{
+	x ^= seed * 0x9e3779b9;
+	x ^= x >> 16;
+	x *= 0x85ebca6b;
+	x ^= x >> 13;
+	x *= 0xc2b2ae35;
+	x ^= x >> 16;
+	return x;
+}
+
+static inline void synth_delay(struct zfs_synth *synth)
+{
+	unsigned int delay = synth->params.delay;
+
+	if (delay)
+		usleep_range(delay, delay + delay / 8 + 1);
+}
+
+/* Base qid of the cluster */
+static inline uint32_t synth_cluster_base(struct zfs_synth *synth, uint32_t k)
+{
+	return k * synth->stride +
+		synth_hash(k, synth->params.seed) %
+		(synth->stride - SYNTH_CLUSTER + 1);
+}
+
+/* n-th qid of the distribution, sorted ascending */
+static uint32_t synth_qid(struct zfs_synth *synth, uint32_t n)
+{
+	switch (synth->params.dist) {
+	case ZFS_SYNTH_SPARSE:
+		return n * synth->stride +
+			synth_hash(n, synth->params.seed) % synth->stride;
+	case ZFS_SYNTH_CLUSTERED:
+		return synth_cluster_base(synth, n / SYNTH_CLUSTER) +
+			n % SYNTH_CLUSTER;
+	default:
+		return n;
+	}
+}
+
+/* Is qid part of the distribution */
+static int synth_has_qid(struct zfs_synth *synth, uint64_t qid)
+{
+	uint32_t n, k, base;
+
+	if (qid > UINT_MAX)
+		return 0;
+
+	switch (synth->params.dist) {
+	case ZFS_SYNTH_SPARSE:
+		n = qid / synth->stride;
+		return n < synth->params.count && synth_qid(synth, n) == qid;
+	case ZFS_SYNTH_CLUSTERED:
+		k = qid / synth->stride;
+		if (k >= synth->nclusters)
+			return 0;
+		base = synth_cluster_base(synth, k);
+		return qid >= base && qid - base < SYNTH_CLUSTER &&
+			(uint64_t)k * SYNTH_CLUSTER + (qid - base) <
+			synth->params.count;
+	default:
+		return qid < synth->params.count;
+	}
+}
+
+static inline int synth_prop_is_limit(int prop)
+{
+	return prop == ZQ_PROP_USERQUOTA || prop == ZQ_PROP_GROUPQUOTA ||
+		prop == ZQ_PROP_USEROBJQUOTA || prop == ZQ_PROP_GROUPOBJQUOTA;
+}
+
+static inline int synth_prop_is_obj(int prop)
+{
+	return prop >= ZQ_PROP_USEROBJUSED;
+}
+
+static uint64_t synth_used(struct zfs_synth *synth, int prop, uint32_t qid)
+{
+	uint32_t h = synth_hash(qid ^ (prop << 24), synth->params.seed);
+
+	if (synth_prop_is_obj(prop))
+		return 1 + h % 100000;
+	return 512 + ((uint64_t)(h % (1U << 30)) & ~511ULL);
+}
+
+/* Every fourth qid has a limit twice its usage unless it is overridden */
+static uint64_t synth_limit(struct zfs_synth *synth, int prop, uint32_t qid)
+{
+	struct synth_limit *limit;
+
+	limit = radix_tree_lookup(&synth->limits[prop], qid);
+	if (limit)
+		return limit->value;
+
+	if (!synth_has_qid(synth, qid) ||
+	    synth_hash(qid, ~synth->params.seed) & 3)
+		return 0;
+
+	return 2 * synth_used(synth, prop - 1, qid);
+}
+
+static uint64_t synth_value(struct zfs_synth *synth, int prop, uint32_t qid)
+{
+	if (synth_prop_is_limit(prop))
+		return synth_limit(synth, prop, qid);
+	return synth_has_qid(synth, qid) ? synth_used(synth, prop, qid) : 0;
+}
+
+/* As ZFS answers about a dataset without object accounting */
+static inline int synth_prop_check(struct zfs_synth *synth, int prop)
+{
+	if (prop < 0 || prop >= ZQ_NUM_PROPS)
+		return EINVAL;
+	if (synth->params.noobj && synth_prop_is_obj(prop))
+		return EOPNOTSUPP;
+	return 0;
+}
+
+static int synth_prop_one(void *priv, int prop, uint64_t rid, uint64_t *value)
+{
+	struct zfs_synth *synth = priv;
+	int err;
+
+	err = synth_prop_check(synth, prop);
+	if (err)
+		return err;
+
+	synth_delay(synth);
+
+	mutex_lock(&synth->lock);
+	*value = rid > UINT_MAX ? 0 : synth_value(synth, prop, rid);
+	mutex_unlock(&synth->lock);
+
+	return 0;
+}
+
+static int synth_prop_many(void *priv, int prop, uint64_t *cookie,
+			   void *buf, uint64_t *npairs)
+{
+	struct zfs_synth *synth = priv;
+	zfs_prop_pair_t *pair = buf;
+	uint64_t n = 0, value;
+	uint32_t qid;
+	int err;
+
+	*npairs = 0;
+	err = synth_prop_check(synth, prop);
+	if (err)
+		return err;
+
+	synth_delay(synth);
+
+	mutex_lock(&synth->lock);
+	for (; *cookie < synth->params.count &&
+	       n < SYNTH_BUFSIZE / sizeof(*pair); ++*cookie) {
+		qid = synth_qid(synth, *cookie);
+		value = synth_value(synth, prop, qid);
+		/* As ZFS does, list only the set ones */
+		if (!value)
+			continue;
+
+		pair[n].rid = qid;
+		pair[n].value = value;
+		n++;
+	}
+	mutex_unlock(&synth->lock);
+
+	*npairs = n;
+	return 0;
+}
+
+static int synth_prop_set(void *priv, int prop, uint64_t rid, uint64_t value)
+{
+	struct zfs_synth *synth = priv;
+	struct synth_limit *limit;
+	int err = 0;
+
+	if (!synth_prop_is_limit(prop) || rid > UINT_MAX)
+		return EINVAL;
+	err = synth_prop_check(synth, prop);
+	if (err)
+		return err;
+
+	synth_delay(synth);
+
+	mutex_lock(&synth->lock);
+	limit = radix_tree_lookup(&synth->limits[prop], rid);
+	if (!limit) {
+		limit = kmalloc(sizeof(*limit), GFP_KERNEL);
+		if (!limit) {
+			err = ENOMEM;
+			goto out;
+		}
+		limit->rid = rid;
+		err = -radix_tree_insert(&synth->limits[prop], rid, limit);
+		if (err) {
+			kfree(limit);
+			goto out;
+		}
+	}
+	limit->value = value;
+out:
+	mutex_unlock(&synth->lock);
+	return err;
+}
+
+/* Limits are set on every fourth qid, overrides are not counted */
+static int synth_prop_count(void *priv, int prop, uint64_t *count)
+{
+	struct zfs_synth *synth = priv;
+	int err;
+
+	err = synth_prop_check(synth, prop);
+	if (err)
+		return err;
+
+	*count = synth->params.count;
+	if (synth_prop_is_limit(prop))
+		*count /= 4;
+	return 0;
+}
+
+static void synth_release(void *priv)
+{
+	struct zfs_synth *synth = priv;
+	struct synth_limit *limits[16];
+	unsigned long index;
+	int prop, i, n;
+
+	for (prop = 0; prop < ZQ_NUM_PROPS; prop++) {
+		index = 0;
+		while ((n = radix_tree_gang_lookup(&synth->limits[prop],
+						   (void **)limits, index,
+						   ARRAY_SIZE(limits)))) {
+			for (i = 0; i < n; i++) {
+				index = limits[i]->rid + 1;
+				radix_tree_delete(&synth->limits[prop],
+						  limits[i]->rid);
+				kfree(limits[i]);
+			}
+		}
+	}
+
+	kfree(synth);
+}
+
+static const zfs_quota_ops_t synth_quota_ops = {
+	.name		= "synthetic",
+	.bufsize	= SYNTH_BUFSIZE,
+	.prop_one	= synth_prop_one,
+	.prop_many	= synth_prop_many,
+	.prop_set	= synth_prop_set,
+	.prop_count	= synth_prop_count,
+	.release	= synth_release,
+};
+
+int zfs_synth_backend_init(zfs_backend_t *backend,
+			   const struct zfs_synth_params *params)
+{
+	struct zfs_synth *synth;
+	int prop;
+
+	if (params->dist >= ARRAY_SIZE(synth_dist_names))
+		return -EINVAL;
+
+	synth = kzalloc(sizeof(*synth), GFP_KERNEL);
+	if (!synth)
+		return -ENOMEM;
+
+	synth->params = *params;
+	switch (params->dist) {
+	case ZFS_SYNTH_SPARSE:
+		synth->stride = params->count ? UINT_MAX / params->count : 1;
+		break;
+	case ZFS_SYNTH_CLUSTERED:
+		synth->nclusters = DIV_ROUND_UP(params->count, SYNTH_CLUSTER);
+		synth->stride = synth->nclusters ?
+			UINT_MAX / synth->nclusters : UINT_MAX;
+		if (synth->stride < SYNTH_CLUSTER) {
+			kfree(synth);
+			return -EINVAL;
+		}
+		break;
+	}
+	if (!synth->stride)
+		synth->stride = 1;
+
+	mutex_init(&synth->lock);
+	for (prop = 0; prop < ZQ_NUM_PROPS; prop++)
+		INIT_RADIX_TREE(&synth->limits[prop], GFP_KERNEL);
+
+	backend->ops = &synth_quota_ops;
+	backend->priv = synth;
+	return 0;
+}
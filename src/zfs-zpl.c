@@ -0,0 +1,145 @@
+#include <linux/stddef.h>
+
+#include <spl_config.h>
+#include <zfs_config.h>
+#include <sys/zfs_context.h>
+#include <sys/types.h>
+#include <sys/zfs_vfsops.h>
+#include <sys/zap.h>
+
+#include "zfs.h"
+
+/**
+ * ZFS POSIX layer backend: the real thing, priv is zfsvfs_t
+ */
+
+#define ZFS_PROP_ITER_BUFSIZE (sizeof(zfs_useracct_t) * 128)
+
+static const zfs_userquota_prop_t zpl_props[ZQ_NUM_PROPS] = {
+	[ZQ_PROP_USERUSED]	= ZFS_PROP_USERUSED,
+	[ZQ_PROP_USERQUOTA]	= ZFS_PROP_USERQUOTA,
+	[ZQ_PROP_GROUPUSED]	= ZFS_PROP_GROUPUSED,
+	[ZQ_PROP_GROUPQUOTA]	= ZFS_PROP_GROUPQUOTA,
+#ifdef HAVE_ZFS_OBJECT_QUOTA
+	[ZQ_PROP_USEROBJUSED]	= ZFS_PROP_USEROBJUSED,
+	[ZQ_PROP_USEROBJQUOTA]	= ZFS_PROP_USEROBJQUOTA,
+	[ZQ_PROP_GROUPOBJUSED]	= ZFS_PROP_GROUPOBJUSED,
+	[ZQ_PROP_GROUPOBJQUOTA]	= ZFS_PROP_GROUPOBJQUOTA,
+#endif /* HAVE_ZFS_OBJECT_QUOTA */
+};
+
+static inline int zpl_prop(int prop, zfs_userquota_prop_t *zprop)
+{
+	if (prop < 0 || prop >= ZQ_NUM_PROPS)
+		return EINVAL;
+#ifndef HAVE_ZFS_OBJECT_QUOTA
+	if (prop >= ZQ_PROP_USEROBJUSED)
+		return EOPNOTSUPP;
+#endif /* #ifndef HAVE_ZFS_OBJECT_QUOTA */
+
+	*zprop = zpl_props[prop];
+	return 0;
+}
+
+static int zpl_prop_one(void *priv, int prop, uint64_t rid, uint64_t *value)
+{
+	zfs_userquota_prop_t zprop;
+	int err;
+
+	err = zpl_prop(prop, &zprop);
+	if (err)
+		return err;
+
+	return zfs_userspace_one(priv, zprop, "", rid, value);
+}
+
+/* Entries are converted in-place, zfs_prop_pair_t is way smaller */
+static int zpl_prop_many(void *priv, int prop, uint64_t *cookie,
+			 void *buf, uint64_t *npairs)
+{
+	zfs_userquota_prop_t zprop;
+	zfs_useracct_t *zu = buf;
+	zfs_prop_pair_t *pair = buf;
+	uint64_t retsize = ZFS_PROP_ITER_BUFSIZE, i, n;
+	int err;
+
+	*npairs = 0;
+
+	err = zpl_prop(prop, &zprop);
+	if (err)
+		return err;
+
+	err = zfs_userspace_many(priv, zprop, cookie, buf, &retsize);
+	if (err)
+		return err;
+
+	n = retsize / sizeof(zfs_useracct_t);
+	for (i = 0; i < n; i++, zu++, pair++) {
+		uint64_t rid = zu->zu_rid, value = zu->zu_space;
+
+		pair->rid = rid;
+		pair->value = value;
+	}
+
+	*npairs = n;
+	return 0;
+}
+
+static int zpl_prop_set(void *priv, int prop, uint64_t rid, uint64_t value)
+{
+	zfs_userquota_prop_t zprop;
+	int err;
+
+	err = zpl_prop(prop, &zprop);
+	if (err)
+		return err;
+
+	return zfs_set_userquota(priv, zprop, "", rid, value);
+}
+
+/* Size of the ZAP the scan walks, object accounting ones are unknown */
+static int zpl_prop_count(void *priv, int prop, uint64_t *count)
+{
+	zfsvfs_t *zfsvfs = priv;
+	uint64_t obj;
+
+	switch (prop) {
+	case ZQ_PROP_USERUSED:
+		obj = DMU_USERUSED_OBJECT;
+		break;
+	case ZQ_PROP_GROUPUSED:
+		obj = DMU_GROUPUSED_OBJECT;
+		break;
+	case ZQ_PROP_USERQUOTA:
+		obj = zfsvfs->z_userquota_obj;
+		break;
+	case ZQ_PROP_GROUPQUOTA:
+		obj = zfsvfs->z_groupquota_obj;
+		break;
+	default:
+		return EOPNOTSUPP;
+	}
+
+	/* No quota has been set yet */
+	if (!obj) {
+		*count = 0;
+		return 0;
+	}
+
+	return zap_count(zfsvfs->z_os, obj, count);
+}
+
+static const zfs_quota_ops_t zpl_quota_ops = {
+	.name		= "zpl",
+	.bufsize	= ZFS_PROP_ITER_BUFSIZE,
+	.prop_one	= zpl_prop_one,
+	.prop_many	= zpl_prop_many,
+	.prop_set	= zpl_prop_set,
+	.prop_count	= zpl_prop_count,
+};
+
+void zfs_zpl_backend_init(zfs_backend_t *backend, void *zfsvfs)
+{
+	backend->ops = &zpl_quota_ops;
+	backend->priv = zfsvfs;
+}
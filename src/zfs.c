@@ -1,87 +1,110 @@
-
 #include <linux/stddef.h>
-
-#include <spl_config.h>
-#include <zfs_config.h>
-#include <sys/zfs_context.h>
-#include <sys/types.h>
-#include <sys/zfs_vfsops.h>
+#include <linux/kernel.h>
+#include <linux/quota.h>
+#include <linux/vmalloc.h>
 
 #include "tree.h"
 #include "zfs.h"
 
+/**
+ * Backend neutral part. zfs_handle is a zfs_backend_t, the calls are
+ * dispatched through its ops.
+ */
+
+static inline zfs_backend_t *to_backend(void *zfs_handle)
+{
+	return zfs_handle;
+}
+
+void zfs_backend_release(zfs_backend_t *backend)
+{
+	if (backend->ops && backend->ops->release)
+		backend->ops->release(backend->priv);
+	backend->ops = NULL;
+	backend->priv = NULL;
+}
+
+unsigned int zfs_probe_caps(void *zfs_handle)
+{
+#ifdef HAVE_ZFS_OBJECT_QUOTA
+	zfs_backend_t *backend = to_backend(zfs_handle);
+	uint64_t value;
+
+	/* Datasets not upgraded have no object accounting */
+	if (backend->ops->prop_one(backend->priv, ZQ_PROP_USEROBJUSED, 0,
+				   &value) != EOPNOTSUPP)
+		return ZFS_CAP_OBJQUOTA;
+#endif /* HAVE_ZFS_OBJECT_QUOTA */
+
+	return 0;
+}
+
 int zfs_fill_quotadata(void *zfs_handle, struct zqdata *quota_data,
-		       int type, qid_t id)
+		       int type, qid_t id, unsigned int caps)
 {
+	zfs_backend_t *backend = to_backend(zfs_handle);
+	zfs_prop_list_t *prop;
 	int err;
-	uint64_t rid = id;
 
+	memset(quota_data, 0, sizeof(*quota_data));
 	quota_data->qid = id;
 
-	err = zfs_userspace_one(zfs_handle,
-				type ==
-				USRQUOTA ? ZFS_PROP_USERUSED :
-				ZFS_PROP_GROUPUSED, "", rid,
-				&quota_data->space_used);
-	if (err)
-		return err;
-
-	err = zfs_userspace_one(zfs_handle,
-				type ==
-				USRQUOTA ? ZFS_PROP_USERQUOTA :
-				ZFS_PROP_GROUPQUOTA, "", rid,
-				&quota_data->space_quota);
-	if (err)
-		return err;
-
-#ifdef HAVE_ZFS_OBJECT_QUOTA
-	err = zfs_userspace_one(zfs_handle,
-				type ==
-				USRQUOTA ? ZFS_PROP_USEROBJUSED :
-				ZFS_PROP_GROUPOBJUSED, "", rid,
-				&quota_data->obj_used);
-	if (err == EOPNOTSUPP)
-		goto no_obj_quota;
-
-	if (err)
-		return err;
-
-	err = zfs_userspace_one(zfs_handle,
-				type ==
-				USRQUOTA ? ZFS_PROP_USEROBJQUOTA :
-				ZFS_PROP_GROUPOBJQUOTA, "", rid,
-				&quota_data->obj_quota);
-	if (err)
-		return err;
-
-no_obj_quota:
-	;
-#endif /* HAVE_ZFS_OBJECT_QUOTA */
+	prop = zfs_get_prop_list(type);
+	if (!prop)
+		return EINVAL;
+
+	for (; prop->prop >= 0; ++prop) {
+		if (prop->caps & ~caps)
+			continue;
+		err = backend->ops->prop_one(backend->priv, prop->prop, id,
+				(uint64_t *)((void *)quota_data + prop->offset));
+		if (err)
+			return err;
+	}
 
 	return 0;
 }
 
+int zfs_prop_one(void *zfs_handle, int prop, qid_t id, uint64_t *value)
+{
+	zfs_backend_t *backend = to_backend(zfs_handle);
+
+	return backend->ops->prop_one(backend->priv, prop, id, value);
+}
+
+int zfs_prop_count(void *zfs_handle, int prop, uint64_t *count)
+{
+	zfs_backend_t *backend = to_backend(zfs_handle);
+
+	if (!backend->ops->prop_count)
+		return EOPNOTSUPP;
+
+	return backend->ops->prop_count(backend->priv, prop, count);
+}
+
 #define QD_OFFSET(m) offsetof(struct zqdata, m)
 
 zfs_prop_list_t *zfs_get_prop_list(int quota_type)
 {
 	static zfs_prop_list_t usrquota_props[] = {
 		{
-			.prop = ZFS_PROP_USERUSED,
+			.prop = ZQ_PROP_USERUSED,
 			.offset = QD_OFFSET(space_used),
 		},
 		{
-			.prop = ZFS_PROP_USERQUOTA,
+			.prop = ZQ_PROP_USERQUOTA,
 			.offset = QD_OFFSET(space_quota),
 		},
 #ifdef HAVE_ZFS_OBJECT_QUOTA
 		{
-			.prop = ZFS_PROP_USEROBJUSED,
+			.prop = ZQ_PROP_USEROBJUSED,
 			.offset = QD_OFFSET(obj_used),
+			.caps = ZFS_CAP_OBJQUOTA,
 		},
 		{
-			.prop = ZFS_PROP_USEROBJQUOTA,
+			.prop = ZQ_PROP_USEROBJQUOTA,
 			.offset = QD_OFFSET(obj_quota),
+			.caps = ZFS_CAP_OBJQUOTA,
 		},
 #endif /* HAVE_ZFS_OBJECT_QUOTA */
 		{
@@ -90,21 +113,23 @@ zfs_prop_list_t *zfs_get_prop_list(int quota_type)
 	};
 	static zfs_prop_list_t grpquota_props[] = {
 		{
-			.prop = ZFS_PROP_GROUPUSED,
+			.prop = ZQ_PROP_GROUPUSED,
 			.offset = QD_OFFSET(space_used),
 		},
 		{
-			.prop = ZFS_PROP_GROUPQUOTA,
+			.prop = ZQ_PROP_GROUPQUOTA,
 			.offset = QD_OFFSET(space_quota),
 		},
 #ifdef HAVE_ZFS_OBJECT_QUOTA
 		{
-			.prop = ZFS_PROP_GROUPOBJUSED,
+			.prop = ZQ_PROP_GROUPOBJUSED,
 			.offset = QD_OFFSET(obj_used),
+			.caps = ZFS_CAP_OBJQUOTA,
 		},
 		{
-			.prop = ZFS_PROP_GROUPOBJQUOTA,
+			.prop = ZQ_PROP_GROUPOBJQUOTA,
 			.offset = QD_OFFSET(obj_quota),
+			.caps = ZFS_CAP_OBJQUOTA,
 		},
 #endif /* HAVE_ZFS_OBJECT_QUOTA */
 		{
@@ -127,62 +152,63 @@ zfs_prop_list_t *zfs_get_prop_list(int quota_type)
 int zfs_set_space_quota(void *zfs_handle, int quota_type, qid_t id,
 			uint64_t limit)
 {
-	zfs_userquota_prop_t type;
+	zfs_backend_t *backend = to_backend(zfs_handle);
+	int prop;
 
 	switch (quota_type) {
 	case USRQUOTA:
-		type = ZFS_PROP_USERQUOTA;
+		prop = ZQ_PROP_USERQUOTA;
 		break;
 	case GRPQUOTA:
-		type = ZFS_PROP_GROUPQUOTA;
+		prop = ZQ_PROP_GROUPQUOTA;
 		break;
 	default:
 		return -EINVAL;
 	}
 
-	return zfs_set_userquota(zfs_handle, type, "", id, limit);
+	return backend->ops->prop_set(backend->priv, prop, id, limit);
 }
 
 #ifdef HAVE_ZFS_OBJECT_QUOTA
 int zfs_set_object_quota(void *zfs_handle, int quota_type, qid_t id,
 			 uint64_t limit)
 {
-	zfs_userquota_prop_t type;
+	zfs_backend_t *backend = to_backend(zfs_handle);
+	int prop;
 
 	switch (quota_type) {
 	case USRQUOTA:
-		type = ZFS_PROP_USEROBJQUOTA;
+		prop = ZQ_PROP_USEROBJQUOTA;
 		break;
 	case GRPQUOTA:
-		type = ZFS_PROP_GROUPOBJQUOTA;
+		prop = ZQ_PROP_GROUPOBJQUOTA;
 		break;
 	default:
 		return -EINVAL;
 	}
 
-	return zfs_set_userquota(zfs_handle, type, "", id, limit);
+	return backend->ops->prop_set(backend->priv, prop, id, limit);
 }
 #endif /* HAVE_ZFS_OBJECT_QUOTA */
 
 
-#define ZFS_PROP_ITER_BUFSIZE (sizeof(zfs_useracct_t) * 128)
-
 static int zfs_prop_iter_next_call(zfs_prop_iter_t * iter)
 {
-	iter->retsize = iter->bufsize;
-	iter->offset = 0;
+	zfs_backend_t *backend = to_backend(iter->zfs_handle);
+
+	iter->npairs = 0;
+	iter->idx = 0;
 
-	iter->error = zfs_userspace_many(iter->zfs_handle,
-					 (zfs_userquota_prop_t) iter->prop,
-					 &iter->cookie, iter->buf,
-					 &iter->retsize);
+	iter->error = backend->ops->prop_many(backend->priv, iter->prop,
+					      &iter->cookie, iter->buf,
+					      &iter->npairs);
 	return iter->error;
 }
 
 void zfs_prop_iter_stop(zfs_prop_iter_t * iter)
 {
 	if (iter->buf)
-		vmem_free(iter->buf, iter->bufsize);
+		vfree(iter->buf);
 	iter->buf = NULL;
 }
 
@@ -191,8 +217,8 @@ void zfs_prop_iter_start(void *zfs_handle, int prop, zfs_prop_iter_t * iter)
 	iter->zfs_handle = zfs_handle;
 	iter->prop = prop;
 
-	iter->bufsize = ZFS_PROP_ITER_BUFSIZE;
-	iter->buf = vmem_alloc(iter->bufsize, KM_SLEEP);
+	iter->bufsize = to_backend(zfs_handle)->ops->bufsize;
+	iter->buf = vmalloc(iter->bufsize);
 	if (!iter->buf) {
 		iter->error = ENOMEM;
 		return;
@@ -213,30 +239,19 @@ void zfs_prop_iter_reset(int prop, zfs_prop_iter_t * iter)
 
 zfs_prop_pair_t *zfs_prop_iter_item(zfs_prop_iter_t * iter)
 {
-	zfs_useracct_t *buf;
-
-	if (iter->error || iter->retsize == 0)
+	if (iter->error || iter->idx >= iter->npairs)
 		return NULL;
 
-	buf = (zfs_useracct_t *) ((uintptr_t) iter->buf + iter->offset);
-
-	iter->pair.rid = buf->zu_rid;
-	iter->pair.value = buf->zu_space;
-
-	return &iter->pair;
+	return (zfs_prop_pair_t *)iter->buf + iter->idx;
 }
 
 void zfs_prop_iter_next(zfs_prop_iter_t * iter)
 {
-	iter->offset += sizeof(zfs_useracct_t);
+	iter->idx++;
 
-	if (iter->offset >= iter->retsize) {
-		/* End of the last buffer */
-		if (iter->retsize < iter->bufsize)
-			iter->retsize = 0;
-		else
-			zfs_prop_iter_next_call(iter);
-	}
+	/* End of the buffer, the backend says when there is no more */
+	if (iter->idx >= iter->npairs && iter->npairs)
+		zfs_prop_iter_next_call(iter);
 }
 
 int zfs_prop_iter_error(zfs_prop_iter_t * iter)
@@ -2,30 +2,106 @@
 #ifndef ZFS_H_INCLUDED
 #define ZFS_H_INCLUDED
 
+struct zqdata;
+
+/* Backend neutral quota properties, same order as zfs_userquota_prop_t */
+enum {
+	ZQ_PROP_USERUSED,
+	ZQ_PROP_USERQUOTA,
+	ZQ_PROP_GROUPUSED,
+	ZQ_PROP_GROUPQUOTA,
+	ZQ_PROP_USEROBJUSED,
+	ZQ_PROP_USEROBJQUOTA,
+	ZQ_PROP_GROUPOBJUSED,
+	ZQ_PROP_GROUPOBJQUOTA,
+	ZQ_NUM_PROPS
+};
+
+/* What the dataset supports beyond space accounting */
+#define ZFS_CAP_OBJQUOTA	1
+
 typedef struct zfs_prop_pair {
 	uint64_t rid, value;
 } zfs_prop_pair_t;
 
+/**
+ * Quota backend. Errors are positive errno values as ZFS returns them.
+ *
+ * prop_many fills buf (bufsize bytes) with zfs_prop_pair_t entries
+ * starting at *cookie, advances the cookie and returns the number of
+ * entries in *npairs, zero meaning there is no more.
+ *
+ * prop_count, if there is one, estimates the entries prop_many would list.
+ */
+typedef struct zfs_quota_ops {
+	const char	*name;
+	uint64_t	bufsize;
+
+	int (*prop_one)(void *priv, int prop, uint64_t rid, uint64_t *value);
+	int (*prop_many)(void *priv, int prop, uint64_t *cookie,
+			 void *buf, uint64_t *npairs);
+	int (*prop_set)(void *priv, int prop, uint64_t rid, uint64_t value);
+	int (*prop_count)(void *priv, int prop, uint64_t *count);
+	void (*release)(void *priv);
+} zfs_quota_ops_t;
+
+typedef struct zfs_backend {
+	const zfs_quota_ops_t	*ops;
+	void			*priv;
+} zfs_backend_t;
+
+/* ZFS POSIX layer backend, zfsvfs is the s_fs_info of ZFS superblock */
+void zfs_zpl_backend_init(zfs_backend_t *backend, void *zfsvfs);
+
+/* Synthetic in-memory backend for benchmarking */
+enum {
+	ZFS_SYNTH_DENSE,	/* qids 0 .. count - 1 */
+	ZFS_SYNTH_SPARSE,	/* random 32-bit qids, like qrandom.py does */
+	ZFS_SYNTH_CLUSTERED,	/* runs of consecutive qids at random bases */
+};
+
+struct zfs_synth_params {
+	unsigned int	dist;
+	unsigned int	count;
+	unsigned int	seed;
+	unsigned int	delay;	/* microseconds injected into every call */
+	unsigned int	noobj;	/* no object accounting, as not upgraded */
+};
+
+int zfs_synth_backend_init(zfs_backend_t *backend,
+			   const struct zfs_synth_params *params);
+int zfs_synth_parse_dist(const char *name);
+const char *zfs_synth_dist_name(unsigned int dist);
+
+void zfs_backend_release(zfs_backend_t *backend);
+
 typedef struct zfs_prop_iter {
 	void *zfs_handle;
 	int prop;
 
 	void *buf;
-	uint64_t bufsize, retsize, offset;
+	uint64_t bufsize, npairs, idx;
 	uint64_t cookie;
-	zfs_prop_pair_t pair;
 	int error;
 } zfs_prop_iter_t;
 
 typedef struct zfs_prop_list {
 	int prop;
 	uintptr_t offset;
+	unsigned int caps;	/* ZFS_CAP_* the property needs */
 } zfs_prop_list_t;
 zfs_prop_list_t *zfs_get_prop_list(int quota_type);
 
 
+/* ZFS_CAP_* of the dataset, asks the backend so better cache it */
+unsigned int zfs_probe_caps(void *zfs_handle);
+
+/* Only the properties the caps allow, the rest is left zero */
 int zfs_fill_quotadata(void *zfs_handle, struct zqdata *quota_data,
-		       int type, qid_t id);
+		       int type, qid_t id, unsigned int caps);
+int zfs_prop_one(void *zfs_handle, int prop, qid_t id, uint64_t *value);
+/* EOPNOTSUPP when the backend can't tell */
+int zfs_prop_count(void *zfs_handle, int prop, uint64_t *count);
 
 int zfs_set_space_quota(void *zfs_handle, int quota_type, qid_t id,
 			uint64_t limit);
@@ -44,6 +44,7 @@
 #include <asm/unistd.h>
 #include <asm/uaccess.h>
 
+#include "zfs.h"
 #include "quota.h"
 
 #define ZQFS_GET_LOWER_FS_SB(sb) sb->s_root->d_sb
@@ -51,7 +52,12 @@
 struct zqfs_fs_info {
 	struct vfsmount		*real_mnt;
 	unsigned int		qid_limit;
+	int			prefetch;
 	char			fs_root[PATH_MAX];
+
+	/* Benchmarking mode, quota comes from the synthetic backend */
+	int			synth;
+	struct zfs_synth_params	synth_params;
 };
 
 static struct super_operations zqfs_super_ops;
@@ -162,6 +168,21 @@ static void zqfs_show_type(struct seq_file *m, struct super_block *sb)
 }
 #endif /* #ifdef CONFIG_VE */
 
+static void zqfs_show_synth_options(struct seq_file *m,
+				    struct zqfs_fs_info *fs_info)
+{
+	struct zfs_synth_params *params = &fs_info->synth_params;
+
+	if (!fs_info->synth)
+		return;
+
+	seq_printf(m, ",synth=%s,synth_count=%u,synth_seed=%u,synth_delay=%u",
+		   zfs_synth_dist_name(params->dist), params->count,
+		   params->seed, params->delay);
+	if (params->noobj)
+		seq_puts(m, ",synth_noobj");
+}
+
 #ifdef HAVE_SHOW_OPTIONS_VFSMOUNT
 static int zqfs_show_options(struct seq_file *m, struct vfsmount *mnt)
 {
@@ -170,6 +191,9 @@ static int zqfs_show_options(struct seq_file *m, struct vfsmount *mnt)
 	seq_printf(m, ",fsroot=%s", fs_info->fs_root);
 	if (fs_info->qid_limit != UINT_MAX)
 		seq_printf(m, ",limit=%u", fs_info->qid_limit);
+	if (!fs_info->prefetch)
+		seq_puts(m, ",noprefetch");
+	zqfs_show_synth_options(m, fs_info);
 	if (sb_has_quota_loaded(mnt->mnt_sb, USRQUOTA))
 		seq_puts(m, ",usrquota");
 	if (sb_has_quota_loaded(mnt->mnt_sb, GRPQUOTA))
@@ -185,6 +209,9 @@ static int zqfs_show_options(struct seq_file *m, struct dentry *d_root)
 	seq_printf(m, ",fsroot=%s", fs_info->fs_root);
 	if (fs_info->qid_limit != UINT_MAX)
 		seq_printf(m, ",limit=%u", fs_info->qid_limit);
+	if (!fs_info->prefetch)
+		seq_puts(m, ",noprefetch");
+	zqfs_show_synth_options(m, fs_info);
 	seq_puts(m, ",usrquota");
 	seq_puts(m, ",grpquota");
 	return 0;
@@ -414,12 +441,22 @@ int path_lookup(const char *name, unsigned int flags, struct nameidata *nd)
 #endif /* #ifdef HAVE_PATH_LOOKUP */
 
 enum {
-	Opt_fsroot, Opt_limit, Opt_err
+	Opt_fsroot, Opt_limit, Opt_prefetch, Opt_noprefetch,
+	Opt_synth, Opt_synth_count, Opt_synth_seed, Opt_synth_delay,
+	Opt_synth_noobj,
+	Opt_err
 };
 
 static const match_table_t tokens = {
 	{Opt_fsroot, "fsroot=%s"},
 	{Opt_limit, "limit=%u"},
+	{Opt_prefetch, "prefetch"},
+	{Opt_noprefetch, "noprefetch"},
+	{Opt_synth, "synth=%s"},
+	{Opt_synth_count, "synth_count=%u"},
+	{Opt_synth_seed, "synth_seed=%u"},
+	{Opt_synth_delay, "synth_delay=%u"},
+	{Opt_synth_noobj, "synth_noobj"},
 	{Opt_err, NULL}
 };
 
@@ -451,13 +488,15 @@ struct zqfs_fs_info *zqfs_parse_options(char *options)
 	struct zqfs_fs_info *fs_info;
 	substring_t args[MAX_OPT_ARGS];
 	int token, err;
-	char *p;
+	char *p, *name;
 
 	fs_info = kzalloc(sizeof(*fs_info), GFP_KERNEL);
 	if (!fs_info)
 		return ERR_PTR(-ENOMEM);
 
 	fs_info->qid_limit = UINT_MAX;
+	fs_info->prefetch = 1;
+	fs_info->synth_params.count = 128 * 1024;
 
 	while ((p = strsep(&options, ",")) != NULL) {
 		if (!*p)
@@ -476,6 +515,45 @@ struct zqfs_fs_info *zqfs_parse_options(char *options)
 			if (err)
 				goto out_err;
 			break;
+		case Opt_prefetch:
+			fs_info->prefetch = 1;
+			break;
+		case Opt_noprefetch:
+			fs_info->prefetch = 0;
+			break;
+		case Opt_synth:
+			err = -ENOMEM;
+			name = match_strdup(&args[0]);
+			if (!name)
+				goto out_err;
+			err = zfs_synth_parse_dist(name);
+			kfree(name);
+			if (err < 0)
+				goto out_err;
+			fs_info->synth_params.dist = err;
+			fs_info->synth = 1;
+			break;
+		case Opt_synth_count:
+			err = kstrtouint_from_arg(&fs_info->synth_params.count,
+						  &args[0], 10);
+			if (err)
+				goto out_err;
+			break;
+		case Opt_synth_seed:
+			err = kstrtouint_from_arg(&fs_info->synth_params.seed,
+						  &args[0], 10);
+			if (err)
+				goto out_err;
+			break;
+		case Opt_synth_delay:
+			err = kstrtouint_from_arg(&fs_info->synth_params.delay,
+						  &args[0], 10);
+			if (err)
+				goto out_err;
+			break;
+		case Opt_synth_noobj:
+			fs_info->synth_params.noobj = 1;
+			break;
 		case Opt_err:
 			err = -EINVAL;
 			goto out_err;
@@ -530,6 +608,8 @@ static int zqfs_fill_super(struct super_block *s, void *data, int silent)
 	path_put(&nd.path);
 
 	zfsq_opts.qid_limit = fs_info->qid_limit;
+	zfsq_opts.prefetch = fs_info->prefetch;
+	zfsq_opts.synth = fs_info->synth ? &fs_info->synth_params : NULL;
 	return zfsquota_setup_quota_opts(s, &zfsq_opts);
 
 out_path:
@@ -0,0 +1,14 @@
+#ifndef BENCH_H_INCLUDED
+#define BENCH_H_INCLUDED
+
+struct zqobjset;
+struct zfs_synth_params;
+
+struct zqobjset *bench_objset_new(const struct zfs_synth_params *params);
+int bench_objset_set_backend(struct zqobjset *objset,
+			     const struct zfs_synth_params *params);
+
+int zfsquota_tree_init(void);
+void zfsquota_tree_exit(void);
+
+#endif /* BENCH_H_INCLUDED */
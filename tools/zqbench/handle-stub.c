@@ -0,0 +1,115 @@
+/*
+ * Just enough of src/handle.c for the tree code to run on top of a
+ * synthetic backend.
+ */
+#include "kshim.h"
+
+#include "handle.h"
+#include "tree.h"
+#include "zfs.h"
+#include "bench.h"
+
+struct zqobjset {
+	atomic_t		refcnt;
+	zfs_backend_t		zfsh;
+	struct zqtree_delta	delta[MAXQUOTAS];
+};
+
+struct zqobjset *bench_objset_new(const struct zfs_synth_params *params)
+{
+	struct zqobjset *objset;
+	int type;
+
+	objset = kzalloc(sizeof(*objset), GFP_KERNEL);
+	if (!objset)
+		return NULL;
+
+	if (zfs_synth_backend_init(&objset->zfsh, params)) {
+		kfree(objset);
+		return NULL;
+	}
+	for (type = USRQUOTA; type <= GRPQUOTA; type++)
+		zqtree_delta_init(&objset->delta[type]);
+	atomic_set(&objset->refcnt, 1);
+
+	return objset;
+}
+
+/* The dataset changing under the objset, for the trees built from then on */
+int bench_objset_set_backend(struct zqobjset *objset,
+			     const struct zfs_synth_params *params)
+{
+	zfs_backend_t zfsh;
+	int err;
+
+	err = zfs_synth_backend_init(&zfsh, params);
+	if (err)
+		return err;
+
+	zfs_backend_release(&objset->zfsh);
+	objset->zfsh = zfsh;
+	return 0;
+}
+
+struct zqobjset *zqobjset_get(struct zqobjset *objset)
+{
+	if (likely(objset))
+		atomic_inc(&objset->refcnt);
+	return objset;
+}
+
+void zqobjset_put(struct zqobjset *objset)
+{
+	int type;
+
+	if (objset && atomic_dec_and_test(&objset->refcnt)) {
+		for (type = USRQUOTA; type <= GRPQUOTA; type++)
+			zqtree_delta_free(&objset->delta[type]);
+		zfs_backend_release(&objset->zfsh);
+		kfree(objset);
+	}
+}
+
+void *zqobjset_get_zfsh(struct zqobjset *objset)
+{
+	return &objset->zfsh;
+}
+
+unsigned int zqobjset_caps(struct zqobjset *objset)
+{
+	return zfs_probe_caps(&objset->zfsh);
+}
+
+/* Bench objsets live as long as their trees */
+int zqobjset_dead(struct zqobjset *objset)
+{
+	return 0;
+}
+
+void zqobjset_build_queued(struct zqobjset *objset)
+{
+}
+
+void zqobjset_build_done(struct zqobjset *objset)
+{
+}
+
+struct zqtree_delta *zqobjset_delta(struct zqobjset *objset, int type)
+{
+	return &objset->delta[type];
+}
+
+/* Nobody polls the bench trees */
+unsigned long zqobjset_notify(struct zqobjset *objset, int type)
+{
+	return 0;
+}
+
+void zqobjset_tree_closed(struct zqobjset *objset, int type,
+			  struct zqtree *qt)
+{
+}
+
+void zqobjset_watch(struct zqobjset *objset, int type, struct zqtree *qt)
+{
+}
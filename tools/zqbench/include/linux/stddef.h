@@ -0,0 +1,2 @@
+#include_next <linux/stddef.h>
+#include "../../kshim.h"
@@ -0,0 +1,112 @@
+/*
+ * Userspace implementation of the kernel shim: accounted allocator,
+ * slab caches and jiffies.
+ */
+#include "kshim.h"
+
+/* Keeps the size in front of the block, 16 bytes keep the alignment */
+#define KSHIM_HDR	16
+
+static size_t mem_current, mem_peak;
+static pthread_mutex_t mem_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void *kshim_alloc(size_t size, gfp_t flags)
+{
+	char *ptr;
+
+	if (flags & __GFP_ZERO)
+		ptr = calloc(1, size + KSHIM_HDR);
+	else
+		ptr = malloc(size + KSHIM_HDR);
+	if (!ptr)
+		return NULL;
+
+	*(size_t *)ptr = size;
+
+	pthread_mutex_lock(&mem_lock);
+	mem_current += size;
+	if (mem_current > mem_peak)
+		mem_peak = mem_current;
+	pthread_mutex_unlock(&mem_lock);
+
+	return ptr + KSHIM_HDR;
+}
+
+void kshim_free(const void *ptr)
+{
+	char *p = (char *)ptr;
+
+	if (!p)
+		return;
+
+	p -= KSHIM_HDR;
+
+	pthread_mutex_lock(&mem_lock);
+	mem_current -= *(size_t *)p;
+	pthread_mutex_unlock(&mem_lock);
+
+	free(p);
+}
+
+void *kshim_realloc(const void *ptr, size_t size, gfp_t flags)
+{
+	void *p;
+
+	p = kshim_alloc(size, flags);
+	if (p && ptr) {
+		size_t old = *(size_t *)((char *)ptr - KSHIM_HDR);
+
+		memcpy(p, ptr, old < size ? old : size);
+		kshim_free(ptr);
+	}
+	return p;
+}
+
+size_t kshim_mem_current(void)
+{
+	return mem_current;
+}
+
+size_t kshim_mem_peak(void)
+{
+	return mem_peak;
+}
+
+void kshim_mem_reset_peak(void)
+{
+	pthread_mutex_lock(&mem_lock);
+	mem_peak = mem_current;
+	pthread_mutex_unlock(&mem_lock);
+}
+
+struct kmem_cache *kmem_cache_create(const char *name, size_t size,
+				     size_t align, unsigned long flags,
+				     void (*ctor)(void *))
+{
+	struct kmem_cache *cachep = malloc(sizeof(*cachep));
+
+	if (cachep)
+		cachep->size = size;
+	return cachep;
+}
+
+void kmem_cache_destroy(struct kmem_cache *cachep)
+{
+	free(cachep);
+}
+
+unsigned long kshim_jiffies(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * HZ + ts.tv_nsec / (1000000000 / HZ);
+}
+
+struct timespec kshim_current_time(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return ts;
+}
@@ -0,0 +1,354 @@
+/*
+ * Thin userspace shim for the kernel API used by the tree code, so that
+ * src/tree.c and friends build and run as a plain library.
+ */
+#ifndef KSHIM_H_INCLUDED
+#define KSHIM_H_INCLUDED
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifndef HAVE_ZFS_OBJECT_QUOTA
+#define HAVE_ZFS_OBJECT_QUOTA	1
+#endif
+
+/* Kernel internal, never seen by userspace */
+#define ERESTARTSYS		512
+
+/* Types */
+typedef uint32_t qid_t;
+typedef uint32_t __le32;
+typedef uint16_t __le16;
+typedef uint64_t __le64;
+typedef unsigned int gfp_t;
+
+struct super_block;
+struct inode;
+struct file;
+struct if_dqblk;
+struct proc_dir_entry;
+
+/* Compiler and module glue */
+#define likely(x)		__builtin_expect(!!(x), 1)
+#define unlikely(x)		__builtin_expect(!!(x), 0)
+#define __init
+#define __exit
+#define __user
+#define EXPORT_SYMBOL(sym)
+#define module_param(name, type, perm)
+#define MODULE_PARM_DESC(name, desc)
+
+#define ARRAY_SIZE(a)		(sizeof(a) / sizeof((a)[0]))
+#define DIV_ROUND_UP(n, d)	(((n) + (d) - 1) / (d))
+#define ALIGN(x, a)		(((x) + (a) - 1) & ~((typeof(x))(a) - 1))
+#define round_down(x, a)	((x) & ~((typeof(x))(a) - 1))
+#define min(a, b)		((a) < (b) ? (a) : (b))
+#define max(a, b)		((a) > (b) ? (a) : (b))
+#define min_t(t, a, b)		min((t)(a), (t)(b))
+#define max_t(t, a, b)		max((t)(a), (t)(b))
+
+#define KERN_DEBUG		""
+#define KERN_INFO		""
+#define KERN_WARNING		""
+#define KERN_ERR		""
+#define printk			printf
+
+#define WARN(cond, fmt...)	({					\
+	int __c = !!(cond);						\
+	if (__c)							\
+		fprintf(stderr, fmt);					\
+	__c;								\
+})
+#define WARN_ON(cond)		WARN(cond, "WARN_ON(%s) at %s:%d\n",	\
+				     #cond, __FILE__, __LINE__)
+#define WARN_ON_ONCE(cond)	WARN_ON(cond)
+#define BUG_ON(cond)		do { if (cond) abort(); } while (0)
+#define BUG()			abort()
+
+/* Byte order, x86 only */
+#define cpu_to_le16(x)		((uint16_t)(x))
+#define cpu_to_le32(x)		((uint32_t)(x))
+#define cpu_to_le64(x)		((uint64_t)(x))
+#define le16_to_cpu(x)		((uint16_t)(x))
+#define le32_to_cpu(x)		((uint32_t)(x))
+#define le64_to_cpu(x)		((uint64_t)(x))
+
+/* Error pointers */
+#define MAX_ERRNO		4095
+#define IS_ERR_VALUE(x)		((unsigned long)(x) >= (unsigned long)-MAX_ERRNO)
+static inline void *ERR_PTR(long error) { return (void *)error; }
+static inline long PTR_ERR(const void *ptr) { return (long)ptr; }
+static inline int IS_ERR(const void *ptr) { return IS_ERR_VALUE(ptr); }
+static inline int IS_ERR_OR_NULL(const void *ptr)
+{
+	return !ptr || IS_ERR_VALUE(ptr);
+}
+
+/* Quota */
+#define USRQUOTA		0
+#define GRPQUOTA		1
+#define MAXQUOTAS		2
+
+/* Memory, accounted to report the peak usage */
+#define GFP_KERNEL		0x01u
+#define GFP_NOFS		0x02u
+#define GFP_ATOMIC		0x04u
+#define __GFP_ZERO		0x100u
+#define __GFP_NOWARN		0x200u
+#define __GFP_NORETRY		0x400u
+#define PAGE_SIZE		4096UL
+#define PAGE_SHIFT		12
+#define PAGE_ALIGN(x)		ALIGN(x, PAGE_SIZE)
+
+void *kshim_alloc(size_t size, gfp_t flags);
+void kshim_free(const void *ptr);
+void *kshim_realloc(const void *ptr, size_t size, gfp_t flags);
+size_t kshim_mem_current(void);
+size_t kshim_mem_peak(void);
+void kshim_mem_reset_peak(void);
+
+#define GFP_NOWAIT		0x08u
+
+/* A page is just its memory here */
+struct page;
+#define alloc_pages(flags, order)	\
+	((struct page *)kshim_alloc(PAGE_SIZE << (order), flags))
+#define __free_pages(page, order)	kshim_free(page)
+#define page_address(page)		((void *)(page))
+
+/* No reserve in userspace, allocations fail as the page allocator does */
+typedef struct mempool_s mempool_t;
+#define mempool_create_page_pool(min_nr, order)	\
+	((void)(min_nr), (mempool_t *)&kshim_alloc)
+#define mempool_alloc(pool, flags)	NULL
+#define mempool_free(elem, pool)	kshim_free(elem)
+#define mempool_destroy(pool)		((void)(pool))
+
+#define kmalloc(size, flags)	kshim_alloc(size, flags)
+#define kzalloc(size, flags)	kshim_alloc(size, (flags) | __GFP_ZERO)
+#define kcalloc(n, size, flags)	kshim_alloc((n) * (size), (flags) | __GFP_ZERO)
+#define kfree(ptr)		kshim_free(ptr)
+#define krealloc(ptr, size, flags)	kshim_realloc(ptr, size, flags)
+#define vmalloc(size)		kshim_alloc(size, GFP_KERNEL)
+#define vzalloc(size)		kshim_alloc(size, GFP_KERNEL | __GFP_ZERO)
+#define vmalloc_user(size)	vzalloc(size)
+#define vfree(ptr)		kshim_free(ptr)
+#define __get_free_page(flags)	((unsigned long)kshim_alloc(PAGE_SIZE, flags))
+#define free_page(addr)		kshim_free((void *)(addr))
+
+struct kmem_cache {
+	size_t size;
+};
+
+struct kmem_cache *kmem_cache_create(const char *name, size_t size,
+				     size_t align, unsigned long flags,
+				     void (*ctor)(void *));
+void kmem_cache_destroy(struct kmem_cache *cachep);
+#define kmem_cache_alloc(c, flags)	kshim_alloc((c)->size, flags)
+#define kmem_cache_zalloc(c, flags)	kshim_alloc((c)->size, (flags) | __GFP_ZERO)
+#define kmem_cache_free(c, ptr)		kshim_free(ptr)
+
+#define smp_wmb()		__sync_synchronize()
+#define smp_rmb()		__sync_synchronize()
+
+/* Atomics */
+typedef struct {
+	int counter;
+} atomic_t;
+
+#define ATOMIC_INIT(i)		{ (i) }
+#define atomic_read(v)		__atomic_load_n(&(v)->counter, __ATOMIC_SEQ_CST)
+#define atomic_set(v, i)	__atomic_store_n(&(v)->counter, i, __ATOMIC_SEQ_CST)
+#define atomic_inc(v)		((void)__atomic_add_fetch(&(v)->counter, 1, __ATOMIC_SEQ_CST))
+#define atomic_dec(v)		((void)__atomic_sub_fetch(&(v)->counter, 1, __ATOMIC_SEQ_CST))
+#define atomic_add(i, v)	((void)__atomic_add_fetch(&(v)->counter, i, __ATOMIC_SEQ_CST))
+#define atomic_sub(i, v)	((void)__atomic_sub_fetch(&(v)->counter, i, __ATOMIC_SEQ_CST))
+#define atomic_inc_return(v)	__atomic_add_fetch(&(v)->counter, 1, __ATOMIC_SEQ_CST)
+#define atomic_dec_and_test(v)	(__atomic_sub_fetch(&(v)->counter, 1, __ATOMIC_SEQ_CST) == 0)
+static inline int atomic_cmpxchg(atomic_t *v, int old, int new)
+{
+	__atomic_compare_exchange_n(&v->counter, &old, new, 0,
+				    __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+	return old;
+}
+typedef struct {
+	long long counter;
+} atomic64_t;
+
+#define ATOMIC64_INIT(i)	{ (i) }
+#define atomic64_read(v)	__atomic_load_n(&(v)->counter, __ATOMIC_SEQ_CST)
+#define atomic64_inc_return(v)	__atomic_add_fetch(&(v)->counter, 1, __ATOMIC_SEQ_CST)
+
+static inline int atomic_inc_not_zero(atomic_t *v)
+{
+	int c = atomic_read(v);
+
+	while (c && !__atomic_compare_exchange_n(&v->counter, &c, c + 1, 0,
+						 __ATOMIC_SEQ_CST,
+						 __ATOMIC_SEQ_CST))
+		;
+	return c != 0;
+}
+
+/* Locks */
+typedef pthread_mutex_t spinlock_t;
+#define DEFINE_SPINLOCK(x)	spinlock_t x = PTHREAD_MUTEX_INITIALIZER
+#define spin_lock_init(x)	pthread_mutex_init(x, NULL)
+#define spin_lock(x)		pthread_mutex_lock(x)
+#define spin_unlock(x)		pthread_mutex_unlock(x)
+#define spin_trylock(x)		(pthread_mutex_trylock(x) == 0)
+
+struct mutex {
+	pthread_mutex_t m;
+};
+#define DEFINE_MUTEX(x)		struct mutex x = { PTHREAD_MUTEX_INITIALIZER }
+#define mutex_init(x)		pthread_mutex_init(&(x)->m, NULL)
+#define mutex_lock(x)		pthread_mutex_lock(&(x)->m)
+#define mutex_unlock(x)		pthread_mutex_unlock(&(x)->m)
+
+/* Scheduling and waiting */
+typedef struct {
+	int unused;
+} wait_queue_head_t;
+#define DECLARE_WAIT_QUEUE_HEAD(x)	wait_queue_head_t x
+#define init_waitqueue_head(x)		do { } while (0)
+#define wake_up_all(x)			((void)(x))
+#define wake_up(x)			((void)(x))
+#define wait_event_interruptible(wq, cond)	({			\
+	while (!(cond))							\
+		sched_yield();						\
+	0;								\
+})
+#define wait_event(wq, cond)		(void)wait_event_interruptible(wq, cond)
+#define wait_event_killable(wq, cond)	wait_event_interruptible(wq, cond)
+#define cond_resched()			do { } while (0)
+#define signal_pending(task)		0
+#define current				NULL
+
+/* Work runs right away in the caller */
+struct work_struct {
+	void (*func)(struct work_struct *work);
+};
+struct workqueue_struct;
+#define DECLARE_WORK(n, f)		struct work_struct n = { (f) }
+#define INIT_WORK(w, f)			((w)->func = (f))
+#define create_singlethread_workqueue(name)	\
+	((struct workqueue_struct *)(name))
+#define destroy_workqueue(wq)		((void)(wq))
+#define flush_workqueue(wq)		((void)(wq))
+static inline bool queue_work(struct workqueue_struct *wq,
+			      struct work_struct *work)
+{
+	work->func(work);
+	return true;
+}
+#define schedule_work(w)		queue_work(NULL, w)
+
+static inline void usleep_range(unsigned long min, unsigned long max)
+{
+	usleep(min);
+}
+
+#define HZ			1000
+unsigned long kshim_jiffies(void);
+#define jiffies			kshim_jiffies()
+#define time_after(a, b)	((long)((b) - (a)) < 0)
+#define time_before(a, b)	time_after(b, a)
+#define jiffies_to_msecs(j)	((unsigned int)(j))
+#define msecs_to_jiffies(m)	((unsigned long)(m))
+#define div64_u64(a, b)		((uint64_t)(a) / (uint64_t)(b))
+struct timespec kshim_current_time(void);
+#define CURRENT_TIME		kshim_current_time()
+
+/* Lists, just what is used */
+struct list_head {
+	struct list_head *next, *prev;
+};
+#define LIST_HEAD_INIT(name)	{ &(name), &(name) }
+#define LIST_HEAD(name)		struct list_head name = LIST_HEAD_INIT(name)
+static inline void INIT_LIST_HEAD(struct list_head *list)
+{
+	list->next = list->prev = list;
+}
+static inline void __list_add(struct list_head *new, struct list_head *prev,
+			      struct list_head *next)
+{
+	next->prev = new;
+	new->next = next;
+	new->prev = prev;
+	prev->next = new;
+}
+static inline void list_add(struct list_head *new, struct list_head *head)
+{
+	__list_add(new, head, head->next);
+}
+static inline void list_add_tail(struct list_head *new, struct list_head *head)
+{
+	__list_add(new, head->prev, head);
+}
+static inline void list_del_init(struct list_head *entry)
+{
+	entry->next->prev = entry->prev;
+	entry->prev->next = entry->next;
+	INIT_LIST_HEAD(entry);
+}
+static inline void list_del(struct list_head *entry)
+{
+	list_del_init(entry);
+}
+
+static inline int list_empty(const struct list_head *head)
+{
+	return head->next == head;
+}
+#define container_of(ptr, type, member)	\
+	((type *)((char *)(ptr) - offsetof(type, member)))
+#define list_entry(ptr, type, member)	container_of(ptr, type, member)
+#define list_first_entry(ptr, type, member) \
+	list_entry((ptr)->next, type, member)
+#define list_for_each_entry(pos, head, member)				\
+	for (pos = list_entry((head)->next, typeof(*pos), member);	\
+	     &pos->member != (head);					\
+	     pos = list_entry(pos->member.next, typeof(*pos), member))
+#define list_for_each_entry_safe(pos, n, head, member)			\
+	for (pos = list_entry((head)->next, typeof(*pos), member),	\
+	     n = list_entry(pos->member.next, typeof(*pos), member);	\
+	     &pos->member != (head);					\
+	     pos = n, n = list_entry(n->member.next, typeof(*n), member))
+
+/* Radix tree, see radix-tree.c */
+struct radix_tree_node;
+
+struct radix_tree_root {
+	unsigned int		height;
+	gfp_t			gfp_mask;
+	struct radix_tree_node	*rnode;
+};
+
+#define RADIX_TREE_INIT(mask)	{ .height = 0, .gfp_mask = (mask), .rnode = NULL }
+#define RADIX_TREE(name, mask)	struct radix_tree_root name = RADIX_TREE_INIT(mask)
+#define INIT_RADIX_TREE(root, mask)	do {				\
+	(root)->height = 0;						\
+	(root)->gfp_mask = (mask);					\
+	(root)->rnode = NULL;						\
+} while (0)
+
+int radix_tree_insert(struct radix_tree_root *root, unsigned long index,
+		      void *item);
+void *radix_tree_lookup(struct radix_tree_root *root, unsigned long index);
+void *radix_tree_delete(struct radix_tree_root *root, unsigned long index);
+unsigned int radix_tree_gang_lookup(struct radix_tree_root *root,
+				    void **results, unsigned long first_index,
+				    unsigned int max_items);
+
+#endif /* KSHIM_H_INCLUDED */
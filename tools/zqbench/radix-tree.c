@@ -0,0 +1,200 @@
+/*
+ * Minimal radix tree with the kernel interface used by the module.
+ * 64-way nodes, the tree grows and shrinks in height as needed.
+ */
+#include "kshim.h"
+
+#define RADIX_TREE_MAP_SHIFT	6
+#define RADIX_TREE_MAP_SIZE	(1UL << RADIX_TREE_MAP_SHIFT)
+#define RADIX_TREE_MAP_MASK	(RADIX_TREE_MAP_SIZE - 1)
+#define RADIX_TREE_MAX_PATH	DIV_ROUND_UP(sizeof(long) * 8, \
+					     RADIX_TREE_MAP_SHIFT)
+
+struct radix_tree_node {
+	unsigned int	count;
+	void		*slots[RADIX_TREE_MAP_SIZE];
+};
+
+static unsigned long radix_tree_maxindex(unsigned int height)
+{
+	unsigned int shift = height * RADIX_TREE_MAP_SHIFT;
+
+	if (!height)
+		return 0;
+	if (shift >= sizeof(long) * 8)
+		return ~0UL;
+	return (1UL << shift) - 1;
+}
+
+static struct radix_tree_node *radix_tree_node_alloc(struct radix_tree_root *root)
+{
+	return kzalloc(sizeof(struct radix_tree_node), root->gfp_mask);
+}
+
+int radix_tree_insert(struct radix_tree_root *root, unsigned long index,
+		      void *item)
+{
+	struct radix_tree_node *node = NULL, **slot;
+	unsigned int shift;
+
+	BUG_ON(!item);
+
+	/* Grow the tree until index fits */
+	while (!root->height || index > radix_tree_maxindex(root->height)) {
+		if (root->rnode) {
+			node = radix_tree_node_alloc(root);
+			if (!node)
+				return -ENOMEM;
+			node->slots[0] = root->rnode;
+			node->count = 1;
+			root->rnode = node;
+		}
+		root->height++;
+	}
+
+	slot = &root->rnode;
+	shift = (root->height - 1) * RADIX_TREE_MAP_SHIFT;
+	while (1) {
+		unsigned long i;
+
+		if (!*slot) {
+			*slot = radix_tree_node_alloc(root);
+			if (!*slot)
+				return -ENOMEM;
+			if (slot != &root->rnode)
+				node->count++;
+		}
+		node = *slot;
+		i = (index >> shift) & RADIX_TREE_MAP_MASK;
+		if (!shift) {
+			if (node->slots[i])
+				return -EEXIST;
+			node->slots[i] = item;
+			node->count++;
+			return 0;
+		}
+		slot = (struct radix_tree_node **)&node->slots[i];
+		shift -= RADIX_TREE_MAP_SHIFT;
+	}
+}
+
+void *radix_tree_lookup(struct radix_tree_root *root, unsigned long index)
+{
+	struct radix_tree_node *node = root->rnode;
+	unsigned int shift;
+
+	if (!node || index > radix_tree_maxindex(root->height))
+		return NULL;
+
+	shift = (root->height - 1) * RADIX_TREE_MAP_SHIFT;
+	while (node && shift) {
+		node = node->slots[(index >> shift) & RADIX_TREE_MAP_MASK];
+		shift -= RADIX_TREE_MAP_SHIFT;
+	}
+
+	return node ? node->slots[index & RADIX_TREE_MAP_MASK] : NULL;
+}
+
+static void radix_tree_shrink(struct radix_tree_root *root)
+{
+	struct radix_tree_node *node;
+
+	while (root->height > 1) {
+		node = root->rnode;
+		if (node->count != 1 || !node->slots[0])
+			break;
+		root->rnode = node->slots[0];
+		root->height--;
+		kfree(node);
+	}
+}
+
+void *radix_tree_delete(struct radix_tree_root *root, unsigned long index)
+{
+	struct radix_tree_node *path[RADIX_TREE_MAX_PATH + 1];
+	unsigned long offsets[RADIX_TREE_MAX_PATH + 1];
+	struct radix_tree_node *node = root->rnode;
+	unsigned int shift, level = 0;
+	void *item;
+
+	if (!node || index > radix_tree_maxindex(root->height))
+		return NULL;
+
+	shift = (root->height - 1) * RADIX_TREE_MAP_SHIFT;
+	while (1) {
+		path[level] = node;
+		offsets[level] = (index >> shift) & RADIX_TREE_MAP_MASK;
+		if (!shift)
+			break;
+		node = node->slots[offsets[level]];
+		if (!node)
+			return NULL;
+		shift -= RADIX_TREE_MAP_SHIFT;
+		level++;
+	}
+
+	item = node->slots[offsets[level]];
+	if (!item)
+		return NULL;
+
+	/* Free the nodes that became empty bottom-up */
+	while (1) {
+		node = path[level];
+		node->slots[offsets[level]] = NULL;
+		if (--node->count)
+			break;
+		kfree(node);
+		if (!level) {
+			root->rnode = NULL;
+			root->height = 0;
+			return item;
+		}
+		level--;
+	}
+
+	radix_tree_shrink(root);
+	return item;
+}
+
+static unsigned int __radix_tree_gang_lookup(struct radix_tree_node *node,
+					     unsigned int shift,
+					     unsigned long base,
+					     unsigned long first_index,
+					     void **results,
+					     unsigned int max_items,
+					     unsigned int n)
+{
+	unsigned long i = 0;
+
+	if (first_index > base)
+		i = (first_index - base) >> shift;
+
+	for (; i < RADIX_TREE_MAP_SIZE && n < max_items; i++) {
+		unsigned long index = base + (i << shift);
+		void *slot = node->slots[i];
+
+		if (!slot)
+			continue;
+
+		if (!shift)
+			results[n++] = slot;
+		else
+			n = __radix_tree_gang_lookup(slot,
+					shift - RADIX_TREE_MAP_SHIFT, index,
+					first_index, results, max_items, n);
+	}
+
+	return n;
+}
+
+unsigned int radix_tree_gang_lookup(struct radix_tree_root *root,
+				    void **results, unsigned long first_index,
+				    unsigned int max_items)
+{
+	if (!root->rnode || first_index > radix_tree_maxindex(root->height))
+		return 0;
+
+	return __radix_tree_gang_lookup(root->rnode,
+			(root->height - 1) * RADIX_TREE_MAP_SHIFT, 0,
+			first_index, results, max_items, 0);
+}
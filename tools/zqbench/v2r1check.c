@@ -0,0 +1,245 @@
+/*
+ * Validator of the emulated quota file, follows quota-tools' quotaio_v2.c
+ * and quotaio_tree.c logic.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <errno.h>
+
+#include "v2r1check.h"
+
+#define V2_DQINFOOFF		8
+#define V2_DQBLKS_OFF		(V2_DQINFOOFF + 12)
+#define V2R1_VERSION		1
+#define QT_TREEOFF		1
+
+#define DQDH_SIZE		16
+#define DQDH_ENTRIES_OFF	8
+#define DQBLKS_PER_BLOCK	((V2R1_BLOCKSIZE - DQDH_SIZE) / \
+				 sizeof(struct v2r1_dqblk))
+
+static const uint32_t v2_magics[] = {
+	0xd9c01f11,	/* USRQUOTA */
+	0xd9c01927,	/* GRPQUOTA */
+};
+
+struct v2r1_walk {
+	v2r1_read_block_t	read_block;
+	void			*priv;
+	v2r1_entry_t		entry;
+	void			*entry_priv;
+	struct v2r1_check	*check;
+
+	unsigned char		*bitmap;
+	uint32_t		data_blknum;
+	char			data[V2R1_BLOCKSIZE];
+};
+
+static int walk_error(struct v2r1_walk *walk, const char *fmt, ...)
+{
+	va_list ap;
+
+	va_start(ap, fmt);
+	vsnprintf(walk->check->error, sizeof(walk->check->error), fmt, ap);
+	va_end(ap);
+
+	return -EINVAL;
+}
+
+static inline uint32_t get_le32(const char *buf, int off)
+{
+	const unsigned char *p = (const unsigned char *)buf + off;
+
+	return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static int read_block(struct v2r1_walk *walk, uint32_t blknum, char *buf)
+{
+	int err;
+
+	memset(buf, 0, V2R1_BLOCKSIZE);
+	err = walk->read_block(walk->priv, blknum, buf);
+	if (err)
+		return walk_error(walk, "cannot read block %u: %d", blknum,
+				  err);
+	return 0;
+}
+
+/* qtree_entry_unused() */
+static int entry_unused(const struct v2r1_dqblk *dqblk)
+{
+	static const struct v2r1_dqblk empty;
+
+	return !memcmp(dqblk, &empty, sizeof(empty));
+}
+
+static int load_data_block(struct v2r1_walk *walk, uint32_t blknum)
+{
+	if (walk->data_blknum == blknum)
+		return 0;
+
+	walk->data_blknum = 0;
+	if (read_block(walk, blknum, walk->data))
+		return -EIO;
+	walk->data_blknum = blknum;
+
+	return 0;
+}
+
+/* find_block_dqentry() */
+static int find_entry(struct v2r1_walk *walk, uint32_t blknum, uint32_t id)
+{
+	const struct v2r1_dqblk *dqblk;
+	unsigned int i;
+
+	if (load_data_block(walk, blknum))
+		return -EIO;
+
+	dqblk = (const struct v2r1_dqblk *)(walk->data + DQDH_SIZE);
+	for (i = 0; i < DQBLKS_PER_BLOCK; i++, dqblk++)
+		if (dqblk->dqb_id == id && !entry_unused(dqblk))
+			return 0;
+
+	return walk_error(walk, "id %u is not in data block %u", id, blknum);
+}
+
+/* report_block() */
+static int report_block(struct v2r1_walk *walk, uint32_t blknum)
+{
+	const struct v2r1_dqblk *dqblk;
+	unsigned int i;
+	int err, entries = 0;
+
+	if (load_data_block(walk, blknum))
+		return -EIO;
+
+	dqblk = (const struct v2r1_dqblk *)(walk->data + DQDH_SIZE);
+	for (i = 0; i < DQBLKS_PER_BLOCK; i++, dqblk++) {
+		if (entry_unused(dqblk))
+			continue;
+		entries++;
+		if (walk->entry) {
+			err = walk->entry(walk->entry_priv, dqblk);
+			if (err)
+				return walk_error(walk, "entry for id %u "
+						  "rejected: %d",
+						  dqblk->dqb_id, err);
+		}
+	}
+
+	if (entries != (uint16_t)get_le32(walk->data, DQDH_ENTRIES_OFF))
+		return walk_error(walk, "block %u has %d entries, header "
+				  "says %u", blknum, entries,
+				  (uint16_t)get_le32(walk->data,
+						     DQDH_ENTRIES_OFF));
+
+	walk->check->data_blocks++;
+	walk->check->entries += entries;
+	return 0;
+}
+
+/* report_tree() */
+static int report_tree(struct v2r1_walk *walk, uint32_t blknum, int depth,
+		       uint32_t prefix)
+{
+	char buf[V2R1_BLOCKSIZE];
+	uint32_t ref, i;
+	int err;
+
+	err = read_block(walk, blknum, buf);
+	if (err)
+		return err;
+	walk->check->tree_blocks++;
+
+	for (i = 0; i < 256; i++) {
+		ref = get_le32(buf, i * 4);
+		if (!ref)
+			continue;
+
+		if (ref >= walk->check->blocks)
+			return walk_error(walk, "block %u at depth %d refers "
+					  "to %u beyond the file end %u",
+					  blknum, depth, ref,
+					  walk->check->blocks);
+
+		if (depth < V2R1_TREEDEPTH - 1) {
+			err = report_tree(walk, ref, depth + 1,
+					  prefix << 8 | i);
+			if (err)
+				return err;
+			continue;
+		}
+
+		walk->check->refs++;
+		err = find_entry(walk, ref, prefix << 8 | i);
+		if (err)
+			return err;
+
+		if (walk->bitmap[ref >> 3] & (1 << (ref & 7)))
+			continue;
+		walk->bitmap[ref >> 3] |= 1 << (ref & 7);
+
+		err = report_block(walk, ref);
+		if (err)
+			return err;
+	}
+
+	return 0;
+}
+
+int v2r1_check(v2r1_read_block_t read_block_cb, void *priv,
+	       v2r1_entry_t entry, void *entry_priv,
+	       struct v2r1_check *check)
+{
+	struct v2r1_walk walk = {
+		.read_block	= read_block_cb,
+		.priv		= priv,
+		.entry		= entry,
+		.entry_priv	= entry_priv,
+		.check		= check,
+	};
+	char buf[V2R1_BLOCKSIZE];
+	uint32_t magic;
+	int err;
+
+	memset(check, 0, sizeof(*check));
+	check->type = -1;
+
+	err = read_block(&walk, 0, buf);
+	if (err)
+		return err;
+
+	/* v2_check_file() */
+	magic = get_le32(buf, 0);
+	if (magic == v2_magics[0])
+		check->type = 0;
+	else if (magic == v2_magics[1])
+		check->type = 1;
+	else
+		return walk_error(&walk, "bad magic %08x", magic);
+
+	if (get_le32(buf, 4) != V2R1_VERSION)
+		return walk_error(&walk, "bad version %u", get_le32(buf, 4));
+
+	check->blocks = get_le32(buf, V2_DQBLKS_OFF);
+	if (check->blocks <= QT_TREEOFF)
+		return walk_error(&walk, "file has %u blocks", check->blocks);
+
+	walk.bitmap = calloc(check->blocks / 8 + 1, 1);
+	if (!walk.bitmap)
+		return -ENOMEM;
+
+	err = report_tree(&walk, QT_TREEOFF, 0, 0);
+	free(walk.bitmap);
+	if (err)
+		return err;
+
+	if (check->refs != check->entries)
+		return walk_error(&walk, "%llu entries but %llu references",
+				  (unsigned long long)check->entries,
+				  (unsigned long long)check->refs);
+
+	return 0;
+}
@@ -0,0 +1,45 @@
+#ifndef V2R1CHECK_H_INCLUDED
+#define V2R1CHECK_H_INCLUDED
+
+#include <stdint.h>
+
+#define V2R1_BLOCKSIZE		1024
+#define V2R1_TREEDEPTH		4
+
+struct v2r1_dqblk {
+	uint32_t dqb_id;
+	uint32_t dqb_pad;
+	uint64_t dqb_ihardlimit;
+	uint64_t dqb_isoftlimit;
+	uint64_t dqb_curinodes;
+	uint64_t dqb_bhardlimit;
+	uint64_t dqb_bsoftlimit;
+	uint64_t dqb_curspace;
+	uint64_t dqb_btime;
+	uint64_t dqb_itime;
+};
+
+/* Reads block blknum into buf, returns 0 or -errno */
+typedef int (*v2r1_read_block_t)(void *priv, uint32_t blknum, char *buf);
+/* Called for every used entry, non-zero return stops the walk */
+typedef int (*v2r1_entry_t)(void *priv, const struct v2r1_dqblk *dqblk);
+
+struct v2r1_check {
+	int		type;
+	uint32_t	blocks;
+	uint32_t	tree_blocks;
+	uint32_t	data_blocks;
+	uint64_t	entries;
+	uint64_t	refs;
+	char		error[256];
+};
+
+/*
+ * Walks the file the way quota-tools' v2r1 format does for repquota and
+ * verifies that every entry is reachable by the id lookup quotactl does.
+ */
+int v2r1_check(v2r1_read_block_t read_block, void *priv,
+	       v2r1_entry_t entry, void *entry_priv,
+	       struct v2r1_check *check);
+
+#endif /* V2R1CHECK_H_INCLUDED */
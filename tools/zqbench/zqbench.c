@@ -0,0 +1,733 @@
+/*
+ * zqbench: builds quota trees over the synthetic backend and measures
+ * build time, render throughput, peak memory and block read latency for
+ * a matrix of qid counts and distributions. Prints CSV.
+ *
+ * With -c FILE validates a quota file dumped from /proc/zfsquota instead.
+ */
+#include "kshim.h"
+
+#include <getopt.h>
+
+#include "handle.h"
+#include "tree.h"
+#include "zfs.h"
+#include "usage.h"
+#include "history.h"
+#include "bench.h"
+#include "v2r1check.h"
+
+struct bench_result {
+	uint64_t	entries;
+	uint32_t	blocks;
+	double		build_ms;
+	double		render_ms;
+	double		lat_p50, lat_p90, lat_p99, lat_max;
+	size_t		peak;
+	const char	*plan;
+	int		valid;
+};
+
+static double now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static double percentile(double *sorted, size_t n, double p)
+{
+	size_t i = p * (n - 1);
+
+	return n ? sorted[i] : 0;
+}
+
+/* Full tree seen through a qid_limit, as the proc file does */
+struct view {
+	struct zqtree		*zqtree;
+	unsigned int		qid_limit;
+};
+
+static int tree_read_block(void *priv, uint32_t blknum, char *buf)
+{
+	struct view *view = priv;
+	int ret = zqtree_output_block(view->zqtree, buf, blknum,
+				      view->qid_limit);
+
+	return ret < 0 ? ret : 0;
+}
+
+struct expect {
+	void			*zfsh;
+	unsigned int		qid_limit;
+	zfs_prop_iter_t		iter;
+};
+
+/* Entries must come in the order and with the values the backend has */
+static int expect_entry(void *priv, const struct v2r1_dqblk *dqblk)
+{
+	struct expect *expect = priv;
+	zfs_prop_pair_t *pair;
+	struct zqdata qd;
+
+	while ((pair = zfs_prop_iter_item(&expect->iter)) &&
+	       pair->rid >= expect->qid_limit)
+		zfs_prop_iter_next(&expect->iter);
+	if (!pair || pair->rid != dqblk->dqb_id)
+		return -ENOENT;
+	zfs_prop_iter_next(&expect->iter);
+
+	if (zfs_fill_quotadata(expect->zfsh, &qd, USRQUOTA, dqblk->dqb_id,
+			       zfs_probe_caps(expect->zfsh)))
+		return -EIO;
+
+	if (dqblk->dqb_curspace != qd.space_used ||
+	    dqblk->dqb_bhardlimit != qd.space_quota / 1024 ||
+	    dqblk->dqb_curinodes != qd.obj_used ||
+	    dqblk->dqb_ihardlimit != qd.obj_quota)
+		return -EINVAL;
+
+	return 0;
+}
+
+/* A top list must be descending and hold everything above its last one */
+struct top_check {
+	uint64_t		*values;
+	unsigned int		nr;
+	uint64_t		last;
+	unsigned long		above;
+};
+
+static int top_collect(const struct zqdata *qd, void *arg)
+{
+	struct top_check *top = arg;
+
+	if (top->nr && qd->space_used > top->values[top->nr - 1])
+		return -EINVAL;
+	top->values[top->nr++] = qd->space_used;
+	return 0;
+}
+
+static int top_count_above(const struct zqdata *qd, void *arg)
+{
+	struct top_check *top = arg;
+
+	top->above += qd->space_used > top->last;
+	return 0;
+}
+
+static int bench_validate_top(struct zqtree *zqtree, unsigned int qid_limit,
+			      unsigned long entries, unsigned int n,
+			      struct v2r1_check *check)
+{
+	struct top_check top = { NULL };
+	unsigned int i, above = 0;
+	int err;
+
+	top.values = calloc(n, sizeof(*top.values));
+	if (!top.values)
+		return -ENOMEM;
+
+	err = zqtree_top(zqtree, ZQTREE_TOP_SPACE, qid_limit, n, top_collect,
+			 &top);
+	if (!err && top.nr != (entries < n ? entries : n))
+		err = -ENOENT;
+	if (!err && top.nr) {
+		top.last = top.values[top.nr - 1];
+		for (i = 0; i < top.nr; i++)
+			above += top.values[i] > top.last;
+		zqtree_for_each(zqtree, qid_limit, top_count_above, &top);
+		if (top.above != above)
+			err = -EINVAL;
+	}
+	if (err)
+		snprintf(check->error, sizeof(check->error),
+			 "top %u is wrong: %d", n, err);
+
+	free(top.values);
+	return err;
+}
+
+/* The over limit index goes in qid order and agrees with the summary */
+struct over_check {
+	unsigned long		nr;
+	int64_t			last_qid;
+};
+
+static int over_collect(const struct zqdata *qd, void *arg)
+{
+	struct over_check *over = arg;
+
+	if ((int64_t)qd->qid <= over->last_qid)
+		return -EINVAL;
+	over->last_qid = qd->qid;
+	over->nr++;
+	return 0;
+}
+
+static int delta_count(const struct zqdata *qd, int gone, void *arg)
+{
+	unsigned long *counts = arg;
+
+	counts[!!gone]++;
+	return 0;
+}
+
+static uint64_t history_varint(const uint8_t **p)
+{
+	uint64_t v = 0;
+	int shift = 0;
+
+	do {
+		v |= (uint64_t)(**p & 0x7f) << shift;
+		shift += 7;
+	} while (*(*p)++ & 0x80);
+
+	return v;
+}
+
+static uint64_t history_unzigzag(uint64_t v)
+{
+	return (v >> 1) ^ -(v & 1);
+}
+
+/*
+ * Two samples of the same tree: a key one that decodes to the tree and
+ * one with nothing in it
+ */
+static int bench_validate_history(struct zqtree *zqtree,
+				  unsigned int qid_limit,
+				  unsigned long entries,
+				  struct v2r1_check *check)
+{
+	const struct zqhistory_record *rec[2];
+	const struct zqhistory_header *header;
+	struct zqhistory *history;
+	const uint8_t *p;
+	struct zqdata qd;
+	uint64_t space, obj, from = 0;
+	uint32_t qid = 0, i;
+	size_t size;
+	int err = -EINVAL;
+
+	history = zqhistory_new(16384);
+	if (IS_ERR_OR_NULL(history))
+		return -ENOMEM;
+
+	zqhistory_add(history, USRQUOTA, zqtree, qid_limit);
+	zqhistory_add(history, USRQUOTA, zqtree, qid_limit);
+
+	header = zqhistory_buf(history, &size);
+	rec[0] = (const void *)header + header->offset;
+	rec[1] = (const void *)rec[0] + rec[0]->size;
+	if (header->dropped || header->tail ||
+	    header->head != rec[0]->size + rec[1]->size) {
+		snprintf(check->error, sizeof(check->error),
+			 "history has %llu bytes, %llu dropped",
+			 (unsigned long long)header->head,
+			 (unsigned long long)header->dropped);
+		goto out;
+	}
+
+	if (!(rec[0]->flags & ZQHISTORY_KEY) || rec[0]->changed != entries ||
+	    rec[0]->gone || rec[0]->entries != entries ||
+	    (rec[1]->flags & ZQHISTORY_KEY) || rec[1]->changed ||
+	    rec[1]->gone || rec[1]->size != sizeof(*rec[1])) {
+		snprintf(check->error, sizeof(check->error),
+			 "history samples have %u and %u changed of %lu",
+			 rec[0]->changed, rec[1]->changed, entries);
+		goto out;
+	}
+
+	p = (const uint8_t *)(rec[0] + 1);
+	for (i = 0; i < rec[0]->changed; i++) {
+		qid += history_varint(&p);
+		space = history_unzigzag(history_varint(&p));
+		obj = history_unzigzag(history_varint(&p));
+		if (zqtree_next(zqtree, from, qid_limit, &qd) ||
+		    qd.qid != qid || qd.space_used != space ||
+		    qd.obj_used != obj) {
+			snprintf(check->error, sizeof(check->error),
+				 "history has qid %u space %llu", qid,
+				 (unsigned long long)space);
+			goto out;
+		}
+		from = (uint64_t)qid + 1;
+	}
+	err = 0;
+
+out:
+	zqhistory_put(history);
+	return err;
+}
+
+/* The first tree of an objset: all of it since 0, nothing since itself */
+static int bench_validate_delta(struct zqtree *zqtree, unsigned int qid_limit,
+				unsigned long entries, struct v2r1_check *check)
+{
+	struct zqtree_delta *delta;
+	unsigned long counts[2] = { 0, 0 };
+	int err;
+
+	delta = zqobjset_delta(zqtree_get_objset(zqtree), USRQUOTA);
+	err = zqtree_delta(zqtree, delta, 0, qid_limit, delta_count, counts);
+	if (err)
+		goto out_err;
+	if (counts[0] != entries || counts[1]) {
+		snprintf(check->error, sizeof(check->error),
+			 "delta since 0 has %lu entries and %lu gone of %lu",
+			 counts[0], counts[1], entries);
+		return -EINVAL;
+	}
+
+	counts[0] = counts[1] = 0;
+	err = zqtree_delta(zqtree, delta, zqtree_generation(zqtree), qid_limit,
+			   delta_count, counts);
+	if (err)
+		goto out_err;
+	if (counts[0] || counts[1]) {
+		snprintf(check->error, sizeof(check->error),
+			 "delta since the tree has %lu entries", counts[0]);
+		return -EINVAL;
+	}
+
+	return 0;
+
+out_err:
+	snprintf(check->error, sizeof(check->error), "delta: %d", err);
+	return err;
+}
+
+struct delta_qid {
+	uint32_t	qid;
+	int		live, gone;
+};
+
+static int delta_find_qid(const struct zqdata *qd, int gone, void *arg)
+{
+	struct delta_qid *d = arg;
+
+	if (qd->qid == d->qid) {
+		if (gone)
+			d->gone++;
+		else
+			d->live++;
+	}
+	return 0;
+}
+
+/*
+ * A qid deleted and back again is live in the delta from before the
+ * delete, and not gone on top of it
+ */
+static int bench_check_delta_readd(void)
+{
+	struct zfs_synth_params params = {
+		.dist = ZFS_SYNTH_DENSE,
+		.count = 10,
+	};
+	struct delta_qid d = { .qid = 9 };
+	struct zqtree *trees[3] = { NULL };
+	struct zqobjset *objset;
+	uint64_t since = 0;
+	int i, err = -ENOMEM;
+
+	objset = bench_objset_new(&params);
+	if (!objset)
+		return err;
+
+	for (i = 0; i < 3; i++) {
+		params.count = i == 1 ? 9 : 10;
+		err = bench_objset_set_backend(objset, &params);
+		if (err)
+			goto out;
+		trees[i] = zqtree_new(objset, USRQUOTA, UINT_MAX);
+		if (IS_ERR(trees[i])) {
+			err = PTR_ERR(trees[i]);
+			trees[i] = NULL;
+			goto out;
+		}
+		err = zqtree_upgrade(trees[i]);
+		if (err)
+			goto out;
+		if (!i)
+			since = zqtree_generation(trees[i]);
+	}
+
+	err = zqtree_delta(trees[2], zqobjset_delta(objset, USRQUOTA), since,
+			   UINT_MAX, delta_find_qid, &d);
+	if (!err && (d.live != 1 || d.gone)) {
+		fprintf(stderr, "delta after re-add: qid %u live %d gone %d\n",
+			d.qid, d.live, d.gone);
+		err = -EINVAL;
+	}
+
+out:
+	for (i = 0; i < 3; i++)
+		zqtree_put(trees[i]);
+	zqobjset_put(objset);
+	return err;
+}
+
+/*
+ * Checks the structure of the rendered file and, if asked, that it holds
+ * exactly what the backend has
+ */
+static int bench_validate(struct zqtree *zqtree, struct zqobjset *objset,
+			  unsigned int qid_limit, int values,
+			  struct bench_result *res)
+{
+	struct expect expect = {
+		.zfsh = zqobjset_get_zfsh(objset),
+		.qid_limit = qid_limit,
+	};
+	struct view view = {
+		.zqtree = zqtree,
+		.qid_limit = qid_limit,
+	};
+	struct zqtree_summary summary;
+	struct v2r1_check check;
+	int err;
+
+	if (!values) {
+		err = v2r1_check(tree_read_block, &view, NULL, NULL, &check);
+		if (err)
+			fprintf(stderr, "validation failed: %s\n", check.error);
+		res->entries = check.entries;
+		return err;
+	}
+
+	zfs_prop_iter_start(expect.zfsh, ZQ_PROP_USERUSED, &expect.iter);
+	err = v2r1_check(tree_read_block, &view, expect_entry, &expect,
+			 &check);
+	res->entries = check.entries;
+	if (!err && zfs_prop_iter_item(&expect.iter) &&
+	    zfs_prop_iter_item(&expect.iter)->rid < qid_limit) {
+		snprintf(check.error, sizeof(check.error),
+			 "qid %llu is missing", (unsigned long long)
+			 zfs_prop_iter_item(&expect.iter)->rid);
+		err = -ENOENT;
+	}
+	zfs_prop_iter_stop(&expect.iter);
+
+	if (!err && (zqtree_summary(zqtree, qid_limit, &summary) ||
+		     summary.entries != check.entries)) {
+		snprintf(check.error, sizeof(check.error),
+			 "summary has %lu entries", summary.entries);
+		err = -EINVAL;
+	}
+
+	if (!err) {
+		struct over_check over = { .last_qid = -1 };
+
+		if (zqtree_for_each_over(zqtree, qid_limit, over_collect,
+					 &over) || over.nr != summary.over) {
+			snprintf(check.error, sizeof(check.error),
+				 "over index has %lu entries, summary %lu",
+				 over.nr, summary.over);
+			err = -EINVAL;
+		}
+	}
+
+	if (!err)
+		err = bench_validate_delta(zqtree, qid_limit, summary.entries,
+					   &check);
+
+	if (!err)
+		err = bench_validate_history(zqtree, qid_limit,
+					     summary.entries, &check);
+
+	/* The walk of the report files */
+	if (!err) {
+		unsigned long nr = 0;
+		struct zqdata qd;
+		uint64_t from = 0;
+
+		while (!zqtree_next(zqtree, from, qid_limit, &qd)) {
+			nr++;
+			from = (uint64_t)qd.qid + 1;
+		}
+		if (nr != summary.entries) {
+			snprintf(check.error, sizeof(check.error),
+				 "next walk has %lu entries", nr);
+			err = -EINVAL;
+		}
+	}
+
+	/* Out of the index and past it */
+	if (!err)
+		err = bench_validate_top(zqtree, qid_limit, summary.entries, 20,
+					 &check);
+	if (!err)
+		err = bench_validate_top(zqtree, qid_limit, summary.entries,
+					 1000, &check);
+
+	if (err)
+		fprintf(stderr, "validation failed: %s\n", check.error);
+
+	return err;
+}
+
+/* What the planner picked for the build, from the stats it moved */
+static const char *bench_plan(const struct zqtree_plan_stats *before)
+{
+	struct zqtree_plan_stats after;
+
+	zqtree_get_plan_stats(&after);
+	if (after.hybrid != before->hybrid)
+		return "hybrid";
+	if (after.point != before->point)
+		return "point";
+	return "scan";
+}
+
+static int bench_one(struct zfs_synth_params *params, unsigned int qid_limit,
+		     int build_limited, int validate, struct bench_result *res)
+{
+	struct zqtree_plan_stats plan;
+	struct zqobjset *objset;
+	struct zqtree *zqtree;
+	char buf[V2R1_BLOCKSIZE] __attribute__((aligned(8)));
+	double *lat, t0, t;
+	size_t base;
+	uint32_t blk;
+	int err;
+
+	memset(res, 0, sizeof(*res));
+
+	objset = bench_objset_new(params);
+	if (!objset)
+		return -ENOMEM;
+
+	/* Unless asked, built in full and qid_limit only applies rendering */
+	zqtree = zqtree_new(objset, USRQUOTA,
+			    build_limited ? qid_limit : UINT_MAX);
+	zqobjset_put(objset);
+	if (IS_ERR(zqtree))
+		return PTR_ERR(zqtree);
+
+	base = kshim_mem_current();
+	kshim_mem_reset_peak();
+
+	zqtree_get_plan_stats(&plan);
+	t0 = now_us();
+	err = zqtree_upgrade(zqtree);
+	res->build_ms = (now_us() - t0) / 1e3;
+	res->plan = bench_plan(&plan);
+	res->peak = kshim_mem_peak() - base;
+	if (err)
+		goto out;
+
+	memset(buf, 0, sizeof(buf));
+	err = zqtree_output_block(zqtree, buf, 0, qid_limit);
+	if (err < 0)
+		goto out;
+	/* struct v2_disk_dqinfo follows the 8 bytes of magic and version */
+	res->blocks = le32_to_cpu(((__le32 *)buf)[5]);
+
+	err = -ENOMEM;
+	lat = malloc(sizeof(*lat) * res->blocks);
+	if (!lat)
+		goto out;
+
+	t0 = now_us();
+	for (blk = 0; blk < res->blocks; blk++) {
+		t = now_us();
+		memset(buf, 0, sizeof(buf));
+		err = zqtree_output_block(zqtree, buf, blk, qid_limit);
+		lat[blk] = now_us() - t;
+		if (err < 0)
+			break;
+	}
+	res->render_ms = (now_us() - t0) / 1e3;
+
+	qsort(lat, res->blocks, sizeof(*lat), cmp_double);
+	res->lat_p50 = percentile(lat, res->blocks, 0.50);
+	res->lat_p90 = percentile(lat, res->blocks, 0.90);
+	res->lat_p99 = percentile(lat, res->blocks, 0.99);
+	res->lat_max = percentile(lat, res->blocks, 1.00);
+	free(lat);
+	if (err < 0)
+		goto out;
+
+	err = 0;
+	res->valid = !bench_validate(zqtree, objset, qid_limit, validate, res);
+
+out:
+	zqtree_put(zqtree);
+	return err;
+}
+
+/* Validation of a dumped file */
+static int file_read_block(void *priv, uint32_t blknum, char *buf)
+{
+	FILE *file = priv;
+
+	if (fseeko(file, (off_t)blknum * V2R1_BLOCKSIZE, SEEK_SET))
+		return -errno;
+	/* Short read at the end of the file is zero-padded */
+	if (!fread(buf, 1, V2R1_BLOCKSIZE, file) && ferror(file))
+		return -EIO;
+	return 0;
+}
+
+static int check_file(const char *path)
+{
+	struct v2r1_check check;
+	FILE *file;
+	int err;
+
+	file = fopen(path, "r");
+	if (!file) {
+		perror(path);
+		return 1;
+	}
+
+	err = v2r1_check(file_read_block, file, NULL, NULL, &check);
+	fclose(file);
+
+	if (err) {
+		fprintf(stderr, "%s: %s\n", path, check.error);
+		return 1;
+	}
+
+	printf("%s: %s quota, %u blocks, %u tree blocks, %u data blocks, "
+	       "%llu entries\n", path, check.type ? "group" : "user",
+	       check.blocks, check.tree_blocks, check.data_blocks,
+	       (unsigned long long)check.entries);
+	return 0;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+"Usage: %s [-n COUNTS] [-d DISTS] [-r REPEAT] [-s SEED] [-l DELAY]\n"
+"          [-q QID_LIMIT] [-b] [-O] [-V]\n"
+"       %s -c FILE\n"
+"\n"
+"  -n COUNTS     comma separated qid counts (1000,10000,100000,1000000)\n"
+"  -d DISTS      comma separated distributions (dense,sparse,clustered)\n"
+"  -r REPEAT     runs per matrix cell (1)\n"
+"  -s SEED       synthetic backend seed (0)\n"
+"  -l DELAY      microseconds added to every backend call (0)\n"
+"  -q QID_LIMIT  maximum qid shown (no limit)\n"
+"  -b            build up to QID_LIMIT too, as a single mount does\n"
+"  -O            no object accounting, as on a dataset not upgraded\n"
+"  -V            check values of every entry against the backend\n"
+"  -c FILE       validate a quota file dumped from /proc/zfsquota\n",
+		prog, prog);
+}
+
+int main(int argc, char **argv)
+{
+	char *counts = strdup("1000,10000,100000,1000000");
+	char *dists = strdup("dense,sparse,clustered");
+	struct zfs_synth_params params = { 0 };
+	unsigned int qid_limit = UINT_MAX;
+	int repeat = 1, build_limited = 0, validate = 0, failed = 0, opt, r;
+	char *count, *dist, *save_count, *save_dist, *s;
+	struct bench_result res;
+
+	while ((opt = getopt(argc, argv, "n:d:r:s:l:q:bOVc:h")) != -1) {
+		switch (opt) {
+		case 'n':
+			counts = optarg;
+			break;
+		case 'd':
+			dists = optarg;
+			break;
+		case 'r':
+			repeat = atoi(optarg);
+			break;
+		case 's':
+			params.seed = strtoul(optarg, NULL, 0);
+			break;
+		case 'l':
+			params.delay = strtoul(optarg, NULL, 0);
+			break;
+		case 'q':
+			qid_limit = strtoul(optarg, NULL, 0);
+			break;
+		case 'b':
+			build_limited = 1;
+			break;
+		case 'O':
+			params.noobj = 1;
+			break;
+		case 'V':
+			validate = 1;
+			break;
+		case 'c':
+			return check_file(optarg);
+		default:
+			usage(argv[0]);
+			return opt == 'h' ? 0 : 2;
+		}
+	}
+
+	if (zfsquota_tree_init()) {
+		fprintf(stderr, "zfsquota_tree_init failed\n");
+		return 1;
+	}
+
+	if (validate && bench_check_delta_readd()) {
+		fprintf(stderr, "delta re-add check failed\n");
+		failed = 1;
+	}
+
+	printf("dist,count,qid_limit,run,entries,blocks,build_ms,render_ms,"
+	       "render_mb_s,read_p50_us,read_p90_us,read_p99_us,read_max_us,"
+	       "peak_kib,plan,valid\n");
+
+	for (dist = strtok_r(dists, ",", &save_dist); dist;
+	     dist = strtok_r(NULL, ",", &save_dist)) {
+		r = zfs_synth_parse_dist(dist);
+		if (r < 0) {
+			fprintf(stderr, "unknown distribution %s\n", dist);
+			return 2;
+		}
+		params.dist = r;
+
+		s = strdup(counts);
+		for (count = strtok_r(s, ",", &save_count); count;
+		     count = strtok_r(NULL, ",", &save_count)) {
+			params.count = strtoul(count, NULL, 0);
+
+			for (r = 0; r < repeat; r++) {
+				if (bench_one(&params, qid_limit,
+					      build_limited, validate, &res)) {
+					fprintf(stderr, "%s/%u failed\n",
+						dist, params.count);
+					failed = 1;
+					continue;
+				}
+				failed |= !res.valid;
+
+				printf("%s,%u,%u,%d,%llu,%u,%.3f,%.3f,%.1f,"
+				       "%.2f,%.2f,%.2f,%.2f,%zu,%s,%d\n",
+				       dist, params.count, qid_limit, r,
+				       (unsigned long long)res.entries,
+				       res.blocks, res.build_ms, res.render_ms,
+				       res.render_ms ? res.blocks *
+				       (double)V2R1_BLOCKSIZE / 1048576 /
+				       (res.render_ms / 1e3) : 0,
+				       res.lat_p50, res.lat_p90, res.lat_p99,
+				       res.lat_max, res.peak / 1024,
+				       res.plan, res.valid);
+				fflush(stdout);
+			}
+		}
+		free(s);
+	}
+
+	zfsquota_tree_exit();
+	return failed;
+}
@@ -0,0 +1,237 @@
+/*
+ * Listens to the threshold events of zfs-quota and prints a line per
+ * event: dev type qid resource used limit threshold.
+ *
+ *   zqevents [-n count] [-t timeout_seconds]
+ *
+ * Exits with 0 after count events (forever by default), 2 on timeout.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <linux/netlink.h>
+#include <linux/genetlink.h>
+
+#include "../src/events.h"
+
+#define BUFSIZE		8192
+
+#define GENLMSG_DATA(nlh)	((char *)NLMSG_DATA(nlh) + GENL_HDRLEN)
+#define NLA_NEXT(nla)		((struct nlattr *)((char *)(nla) + \
+				 NLA_ALIGN((nla)->nla_len)))
+#define NLA_DATA(nla)		((char *)(nla) + NLA_HDRLEN)
+
+static int nla_ok(const struct nlattr *nla, int len)
+{
+	return len >= (int)sizeof(*nla) && nla->nla_len >= sizeof(*nla) &&
+	       nla->nla_len <= len;
+}
+
+static void parse_attrs(struct nlattr **tb, int max, struct nlattr *nla,
+			int len)
+{
+	memset(tb, 0, sizeof(*tb) * (max + 1));
+	for (; nla_ok(nla, len); len -= NLA_ALIGN(nla->nla_len),
+				 nla = NLA_NEXT(nla)) {
+		int type = nla->nla_type & NLA_TYPE_MASK;
+
+		if (type <= max)
+			tb[type] = nla;
+	}
+}
+
+static uint32_t nla_u32(const struct nlattr *nla)
+{
+	uint32_t v = 0;
+
+	if (nla)
+		memcpy(&v, NLA_DATA(nla), sizeof(v));
+	return v;
+}
+
+static uint64_t nla_u64(const struct nlattr *nla)
+{
+	uint64_t v = 0;
+
+	if (nla)
+		memcpy(&v, NLA_DATA(nla), sizeof(v));
+	return v;
+}
+
+/* Family id and the id of the events group from the controller */
+static int resolve_family(int fd, uint16_t *family, uint32_t *group)
+{
+	struct {
+		struct nlmsghdr n;
+		struct genlmsghdr g;
+		char buf[256];
+	} req;
+	struct nlattr *nla, *tb[CTRL_ATTR_MAX + 1];
+	struct nlattr *grp, *gtb[CTRL_ATTR_MCAST_GRP_MAX + 1];
+	char buf[BUFSIZE];
+	struct nlmsghdr *nlh;
+	int len, rem;
+
+	memset(&req, 0, sizeof(req));
+	req.n.nlmsg_type = GENL_ID_CTRL;
+	req.n.nlmsg_flags = NLM_F_REQUEST;
+	req.n.nlmsg_seq = 1;
+	req.g.cmd = CTRL_CMD_GETFAMILY;
+	req.g.version = 1;
+
+	nla = (struct nlattr *)req.buf;
+	nla->nla_type = CTRL_ATTR_FAMILY_NAME;
+	nla->nla_len = NLA_HDRLEN + sizeof(ZQEVENTS_GENL_NAME);
+	memcpy(NLA_DATA(nla), ZQEVENTS_GENL_NAME, sizeof(ZQEVENTS_GENL_NAME));
+	req.n.nlmsg_len = NLMSG_LENGTH(GENL_HDRLEN) + NLA_ALIGN(nla->nla_len);
+
+	if (send(fd, &req, req.n.nlmsg_len, 0) < 0)
+		return -errno;
+
+	len = recv(fd, buf, sizeof(buf), 0);
+	if (len < 0)
+		return -errno;
+
+	nlh = (struct nlmsghdr *)buf;
+	if (!NLMSG_OK(nlh, len))
+		return -EIO;
+	if (nlh->nlmsg_type == NLMSG_ERROR) {
+		struct nlmsgerr *e = NLMSG_DATA(nlh);
+
+		return e->error ? e->error : -EIO;
+	}
+
+	parse_attrs(tb, CTRL_ATTR_MAX, (struct nlattr *)GENLMSG_DATA(nlh),
+		    NLMSG_PAYLOAD(nlh, GENL_HDRLEN));
+	if (!tb[CTRL_ATTR_FAMILY_ID] || !tb[CTRL_ATTR_MCAST_GROUPS])
+		return -ENOENT;
+	memcpy(family, NLA_DATA(tb[CTRL_ATTR_FAMILY_ID]), sizeof(*family));
+
+	grp = (struct nlattr *)NLA_DATA(tb[CTRL_ATTR_MCAST_GROUPS]);
+	rem = tb[CTRL_ATTR_MCAST_GROUPS]->nla_len - NLA_HDRLEN;
+	for (; nla_ok(grp, rem); rem -= NLA_ALIGN(grp->nla_len),
+				 grp = NLA_NEXT(grp)) {
+		parse_attrs(gtb, CTRL_ATTR_MCAST_GRP_MAX,
+			    (struct nlattr *)NLA_DATA(grp),
+			    grp->nla_len - NLA_HDRLEN);
+		if (!gtb[CTRL_ATTR_MCAST_GRP_NAME] ||
+		    !gtb[CTRL_ATTR_MCAST_GRP_ID])
+			continue;
+		if (strcmp(NLA_DATA(gtb[CTRL_ATTR_MCAST_GRP_NAME]),
+			   ZQEVENTS_GENL_MCGRP))
+			continue;
+		*group = nla_u32(gtb[CTRL_ATTR_MCAST_GRP_ID]);
+		return 0;
+	}
+
+	return -ENOENT;
+}
+
+static void print_event(struct nlmsghdr *nlh)
+{
+	struct nlattr *tb[ZQEVENTS_A_MAX + 1];
+	uint32_t dev;
+
+	parse_attrs(tb, ZQEVENTS_A_MAX, (struct nlattr *)GENLMSG_DATA(nlh),
+		    NLMSG_PAYLOAD(nlh, GENL_HDRLEN));
+
+	dev = nla_u32(tb[ZQEVENTS_A_DEV]);
+	printf("%u:%u %s %u %s %llu %llu %u%%\n",
+	       (dev & 0xfff00) >> 8, (dev & 0xff) | ((dev >> 12) & 0xfff00),
+	       nla_u32(tb[ZQEVENTS_A_TYPE]) ? "group" : "user",
+	       nla_u32(tb[ZQEVENTS_A_QID]),
+	       nla_u32(tb[ZQEVENTS_A_RESOURCE]) == ZQEVENTS_OBJ ?
+	       "inodes" : "space",
+	       (unsigned long long)nla_u64(tb[ZQEVENTS_A_USED]),
+	       (unsigned long long)nla_u64(tb[ZQEVENTS_A_LIMIT]),
+	       nla_u32(tb[ZQEVENTS_A_THRESHOLD]));
+	fflush(stdout);
+}
+
+int main(int argc, char **argv)
+{
+	struct sockaddr_nl addr = { .nl_family = AF_NETLINK };
+	long count = -1, timeout = -1;
+	struct pollfd pfd;
+	uint16_t family = 0;
+	uint32_t group;
+	char buf[BUFSIZE];
+	int fd, opt, err, len;
+
+	while ((opt = getopt(argc, argv, "n:t:")) != -1) {
+		switch (opt) {
+		case 'n':
+			count = atol(optarg);
+			break;
+		case 't':
+			timeout = atol(optarg) * 1000;
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-n count] [-t timeout]\n",
+				argv[0]);
+			return 1;
+		}
+	}
+
+	fd = socket(AF_NETLINK, SOCK_RAW, NETLINK_GENERIC);
+	if (fd < 0 || bind(fd, (struct sockaddr *)&addr, sizeof(addr))) {
+		perror("netlink");
+		return 1;
+	}
+
+	err = resolve_family(fd, &family, &group);
+	if (err) {
+		fprintf(stderr, "%s: %s, is zfs-quota loaded?\n",
+			ZQEVENTS_GENL_NAME, strerror(-err));
+		return 1;
+	}
+
+	if (setsockopt(fd, SOL_NETLINK, NETLINK_ADD_MEMBERSHIP, &group,
+		       sizeof(group))) {
+		perror("NETLINK_ADD_MEMBERSHIP");
+		return 1;
+	}
+
+	pfd.fd = fd;
+	pfd.events = POLLIN;
+	while (count) {
+		struct nlmsghdr *nlh;
+
+		err = poll(&pfd, 1, timeout);
+		if (err < 0 && errno == EINTR)
+			continue;
+		if (err < 0) {
+			perror("poll");
+			return 1;
+		}
+		if (!err)
+			return 2;
+
+		len = recv(fd, buf, sizeof(buf), 0);
+		if (len < 0) {
+			/* ENOBUFS: the socket overran, events were lost */
+			perror("recv");
+			continue;
+		}
+
+		for (nlh = (struct nlmsghdr *)buf; NLMSG_OK(nlh, len) && count;
+		     nlh = NLMSG_NEXT(nlh, len)) {
+			struct genlmsghdr *g = NLMSG_DATA(nlh);
+
+			if (nlh->nlmsg_type != family ||
+			    g->cmd != ZQEVENTS_CMD_THRESHOLD)
+				continue;
+			print_event(nlh);
+			if (count > 0)
+				count--;
+		}
+	}
+
+	close(fd);
+	return 0;
+}
@@ -0,0 +1,64 @@
+/*
+ * Looks up the quota of many ids with a single ZQ_IOC_GETQUOTA and prints
+ * a line per id: qid space_used space_limit inodes_used inodes_limit.
+ *
+ *   zqgetquota /proc/zfsquota/<dev>/aquota.user qid...
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+
+#include "../src/usage.h"
+
+int main(int argc, char **argv)
+{
+	struct zqgetquota arg;
+	struct zqdqblk *dqblks;
+	uint32_t *qids;
+	int fd, i, n = argc - 2;
+
+	if (n < 1) {
+		fprintf(stderr, "usage: %s aquota_file qid...\n", argv[0]);
+		return 1;
+	}
+
+	qids = calloc(n, sizeof(*qids));
+	dqblks = calloc(n, sizeof(*dqblks));
+	if (!qids || !dqblks) {
+		perror("calloc");
+		return 1;
+	}
+	for (i = 0; i < n; i++)
+		qids[i] = strtoul(argv[i + 2], NULL, 0);
+
+	fd = open(argv[1], O_RDONLY);
+	if (fd < 0) {
+		perror(argv[1]);
+		return 1;
+	}
+
+	memset(&arg, 0, sizeof(arg));
+	arg.qids = (uintptr_t)qids;
+	arg.dqblks = (uintptr_t)dqblks;
+	arg.count = n;
+	if (ioctl(fd, ZQ_IOC_GETQUOTA, &arg)) {
+		perror("ZQ_IOC_GETQUOTA");
+		return 1;
+	}
+
+	for (i = 0; i < n; i++)
+		printf("%u %llu %llu %llu %llu\n", dqblks[i].qid,
+		       (unsigned long long)dqblks[i].curspace,
+		       (unsigned long long)dqblks[i].bhardlimit * 1024,
+		       (unsigned long long)dqblks[i].curinodes,
+		       (unsigned long long)dqblks[i].ihardlimit);
+	fprintf(stderr, "%s\n", arg.flags & ZQGETQUOTA_CACHED ?
+		"from the snapshot" : "from ZFS");
+
+	close(fd);
+	return 0;
+}